@@ -0,0 +1,59 @@
+#include <algorithm>
+
+#include "arena.h"
+
+namespace {
+
+size_t align_up(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+}
+
+}
+
+FrameArena::FrameArena(size_t initialBytes) : block(new uint8_t[initialBytes]), blockSize(initialBytes) {
+    spill.reserve(8);
+}
+
+void* FrameArena::allocate_bytes(size_t bytes, size_t align) {
+    // Alignment is computed on the address, since new[] only guarantees fundamental alignment
+    uintptr_t base = reinterpret_cast<uintptr_t>(this->block.get());
+    size_t start = align_up(base + this->offset, align) - base;
+    if (start + bytes <= this->blockSize) {
+        this->offset = start + bytes;
+        return this->block.get() + start;
+    }
+
+    if (!this->spill.empty()) {
+        base = reinterpret_cast<uintptr_t>(this->spill.back().get());
+        start = align_up(base + this->spillOffset, align) - base;
+        if (start + bytes <= this->spillSize) {
+            this->spillOffset = start + bytes;
+            this->spilledBytes += bytes;
+            return this->spill.back().get() + start;
+        }
+    }
+
+    // Out of room: open a spill block at least as large as the main one
+    this->spillSize = std::max(this->blockSize, bytes + align);
+    this->spill.emplace_back(new uint8_t[this->spillSize]);
+    base = reinterpret_cast<uintptr_t>(this->spill.back().get());
+    start = align_up(base, align) - base;
+    this->spillOffset = start + bytes;
+    this->spilledBytes += bytes;
+    return this->spill.back().get() + start;
+}
+
+void FrameArena::reset() {
+    size_t frameBytes = this->offset + this->spilledBytes;
+    this->highWater = std::max(this->highWater, frameBytes);
+    if (!this->spill.empty()) {
+        // Grow to cover the whole frame with headroom for alignment padding, then drop the spill blocks
+        size_t grown = std::max(this->blockSize * 2, frameBytes + frameBytes / 2);
+        this->block.reset(new uint8_t[grown]);
+        this->blockSize = grown;
+        this->spill.clear();
+        this->spillOffset = this->spillSize = 0;
+    }
+    this->offset = 0;
+    this->spilledBytes = 0;
+}
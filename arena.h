@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// Linear allocator for data that lives for one frame. allocate() is a pointer bump and
+// reset() drops everything at once. A frame that outgrows the arena spills into extra
+// blocks, which the next reset() folds into a single larger one, so after the first few
+// frames the steady state never touches the heap.
+class FrameArena {
+public:
+    explicit FrameArena(size_t initialBytes = 64 * 1024);
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+
+    // Uninitialized storage for count objects. Nothing is destroyed on reset(),
+    // hence the trivially destructible requirement.
+    template<typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena memory is released without running destructors");
+        return static_cast<T*>(allocate_bytes(count * sizeof(T), alignof(T)));
+    }
+
+    // Value-initialized array, for the common case of flags and counters
+    template<typename T>
+    T* allocate_zeroed(size_t count) {
+        T* data = allocate<T>(count);
+        for (size_t i = 0; i < count; i++) new (&data[i]) T();
+        return data;
+    }
+
+    void reset();
+
+    size_t used() const { return offset + spilledBytes; }
+    size_t capacity() const { return blockSize; }
+    size_t high_water() const { return highWater; } // largest frame seen, in bytes
+
+private:
+    void* allocate_bytes(size_t bytes, size_t align);
+
+    std::unique_ptr<uint8_t[]> block;
+    size_t blockSize = 0;
+    size_t offset = 0;
+
+    std::vector<std::unique_ptr<uint8_t[]>> spill; // blocks added during an oversized frame
+    size_t spillOffset = 0;  // fill of spill.back()
+    size_t spillSize = 0;    // size of spill.back()
+    size_t spilledBytes = 0; // total handed out from spill blocks this frame
+    size_t highWater = 0;
+};
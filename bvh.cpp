@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+
+#include "bvh.h"
+
+namespace {
+
+constexpr int SAH_BINS = 16;
+constexpr float TRAVERSAL_COST = 1.0f;    // relative to one triangle test
+constexpr size_t PARALLEL_SUBTREE = 4096; // smaller subtrees are built by the thread that split them
+constexpr int SAH_MAX_DEPTH = 48;         // deeper ranges fall back to median splits, which bound the depth
+constexpr int STACK_SIZE = 128;
+
+struct Bounds {
+    float lo[3] = { INFINITY, INFINITY, INFINITY };
+    float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+
+    void grow(const float p[3]) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], p[a]);
+            hi[a] = std::max(hi[a], p[a]);
+        }
+    }
+    void grow(const Bounds& b) {
+        for (int a = 0; a < 3; a++) {
+            lo[a] = std::min(lo[a], b.lo[a]);
+            hi[a] = std::max(hi[a], b.hi[a]);
+        }
+    }
+    float area() const {
+        float x = hi[0] - lo[0], y = hi[1] - lo[1], z = hi[2] - lo[2];
+        return x < 0 ? 0.0f : 2.0f * (x * y + y * z + z * x);
+    }
+};
+
+// Triangle bounds and centroid, the only inputs of the build
+struct BuildRef {
+    Bounds bounds;
+    float centroid[3];
+    uint32_t triangle;
+};
+
+// Node of the tree as built: both children are allocated together, so they are adjacent
+struct BuildNode {
+    Bounds bounds;
+    uint32_t first, count; // leaf range in refs
+    uint32_t left;         // inner node: left child, right child at left + 1
+    int axis;
+};
+
+struct Builder {
+    std::vector<BuildRef>& refs;
+    std::vector<BuildNode>& nodes;
+    std::atomic<uint32_t> nodeCount{ 1 };
+
+    void split(uint32_t index, uint32_t first, uint32_t count, int depth) {
+        Bounds bounds, centroids;
+        for (uint32_t i = first; i < first + count; i++) {
+            bounds.grow(refs[i].bounds);
+            centroids.grow(refs[i].centroid);
+        }
+        BuildNode& node = nodes[index];
+        node.bounds = bounds;
+        node.first = first;
+        node.count = count;
+        if (count <= 2) return;
+
+        // Binned SAH, all three axes binned in one pass over the range
+        float leafCost = float(count);
+        float bestCost = INFINITY;
+        int bestAxis = -1, bestBin = 0;
+        if (depth < SAH_MAX_DEPTH) {
+            float scale[3];
+            for (int a = 0; a < 3; a++) {
+                float extent = centroids.hi[a] - centroids.lo[a];
+                scale[a] = extent > 0 ? SAH_BINS / extent : 0.0f;
+            }
+            Bounds binBounds[3][SAH_BINS];
+            uint32_t binCount[3][SAH_BINS] = {};
+            for (uint32_t i = first; i < first + count; i++) {
+                for (int a = 0; a < 3; a++) {
+                    int b = std::min(SAH_BINS - 1, int((refs[i].centroid[a] - centroids.lo[a]) * scale[a]));
+                    binBounds[a][b].grow(refs[i].bounds);
+                    binCount[a][b]++;
+                }
+            }
+            for (int a = 0; a < 3; a++) {
+                if (scale[a] == 0) continue; // every centroid in one plane
+                // Sweep from the right for the suffix areas, then from the left for the costs
+                float rightArea[SAH_BINS];
+                uint32_t rightCount[SAH_BINS];
+                Bounds right;
+                uint32_t n = 0;
+                for (int b = SAH_BINS - 1; b > 0; b--) {
+                    right.grow(binBounds[a][b]);
+                    n += binCount[a][b];
+                    rightArea[b] = right.area();
+                    rightCount[b] = n;
+                }
+                Bounds left;
+                n = 0;
+                for (int b = 0; b < SAH_BINS - 1; b++) {
+                    left.grow(binBounds[a][b]);
+                    n += binCount[a][b];
+                    if (n == 0 || rightCount[b + 1] == 0) continue;
+                    float cost = TRAVERSAL_COST + (left.area() * n + rightArea[b + 1] * rightCount[b + 1]) / bounds.area();
+                    if (cost < bestCost) {
+                        bestCost = cost;
+                        bestAxis = a;
+                        bestBin = b;
+                    }
+                }
+            }
+        }
+        if (count <= Bvh::MAX_LEAF_TRIANGLES && !(bestCost < leafCost)) return;
+
+        uint32_t mid;
+        if (bestAxis >= 0) {
+            float lo = centroids.lo[bestAxis], scale = SAH_BINS / (centroids.hi[bestAxis] - lo);
+            auto it = std::partition(refs.begin() + first, refs.begin() + first + count, [&](const BuildRef& r) {
+                return std::min(SAH_BINS - 1, int((r.centroid[bestAxis] - lo) * scale)) <= bestBin;
+            });
+            mid = uint32_t(it - refs.begin());
+        }
+        else {
+            // Coincident centroids or too deep: halve at the median of the widest axis
+            bestAxis = 0;
+            for (int a = 1; a < 3; a++) {
+                if (centroids.hi[a] - centroids.lo[a] > centroids.hi[bestAxis] - centroids.lo[bestAxis]) bestAxis = a;
+            }
+            mid = first + count / 2;
+            std::nth_element(refs.begin() + first, refs.begin() + mid, refs.begin() + first + count, [&](const BuildRef& x, const BuildRef& y) {
+                return x.centroid[bestAxis] < y.centroid[bestAxis];
+            });
+        }
+
+        uint32_t left = nodeCount.fetch_add(2);
+        node.left = left;
+        node.axis = bestAxis;
+        node.count = 0;
+
+        uint32_t leftCount = mid - first;
+        if (count > PARALLEL_SUBTREE) {
+            #pragma omp task
+            split(left, first, leftCount, depth + 1);
+            split(left + 1, mid, count - leftCount, depth + 1);
+            #pragma omp taskwait
+        }
+        else {
+            split(left, first, leftCount, depth + 1);
+            split(left + 1, mid, count - leftCount, depth + 1);
+        }
+    }
+};
+
+void store_bounds(BvhNode& node, const Bounds& b) {
+    for (int a = 0; a < 3; a++) {
+        node.boundsMin[a] = b.lo[a];
+        node.boundsMax[a] = b.hi[a];
+    }
+}
+
+// The mesh's triangles with the Y rotation draw_mesh() applies
+void transform_triangles(const Mesh& mesh, float rotation, std::vector<BvhTriangle>& triangles) {
+    float cosR = cos(rotation);
+    float sinR = sin(rotation);
+    auto rotate_y = [&](vec3 v) {
+        return vec3{ v.x * cosR + v.z * sinR, v.y, -v.x * sinR + v.z * cosR };
+        };
+
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < triangles.size(); i++) {
+        BvhTriangle& tri = triangles[i];
+        const uint32_t* index = &mesh.indices[size_t(tri.index) * 3];
+        vec3 v0 = rotate_y(mesh.positions[index[0]]);
+        vec3 e1 = rotate_y(mesh.positions[index[1]]) - v0;
+        vec3 e2 = rotate_y(mesh.positions[index[2]]) - v0;
+        for (int a = 0; a < 3; a++) {
+            tri.v0[a] = float(v0[a]);
+            tri.edge1[a] = float(e1[a]);
+            tri.edge2[a] = float(e2[a]);
+        }
+    }
+}
+
+Bounds triangle_bounds(const BvhTriangle& tri) {
+    Bounds b;
+    float p[3];
+    b.grow(tri.v0);
+    for (int a = 0; a < 3; a++) p[a] = tri.v0[a] + tri.edge1[a];
+    b.grow(p);
+    for (int a = 0; a < 3; a++) p[a] = tri.v0[a] + tri.edge2[a];
+    b.grow(p);
+    return b;
+}
+
+}
+
+void Bvh::build(const Mesh& mesh, float rotation) {
+    size_t count = mesh.triangle_count();
+    this->nodes.clear();
+    this->triangles.assign(count, BvhTriangle{});
+    this->builtRotation = rotation;
+    if (count == 0) return;
+
+    for (size_t i = 0; i < count; i++) this->triangles[i].index = uint32_t(i);
+    transform_triangles(mesh, rotation, this->triangles);
+
+    std::vector<BuildRef> refs(count);
+    #pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < count; i++) {
+        refs[i].bounds = triangle_bounds(this->triangles[i]);
+        for (int a = 0; a < 3; a++) refs[i].centroid[a] = (refs[i].bounds.lo[a] + refs[i].bounds.hi[a]) * 0.5f;
+        refs[i].triangle = uint32_t(i);
+    }
+
+    std::vector<BuildNode> built(2 * count - 1);
+    Builder builder{ refs, built };
+    #pragma omp parallel
+    #pragma omp single
+    builder.split(0, 0, uint32_t(count), 0);
+    uint32_t builtCount = builder.nodeCount.load();
+
+    // Depth-first flattening; triangles are reordered to match the leaves
+    std::vector<BvhTriangle> ordered(count);
+    for (size_t i = 0; i < count; i++) ordered[i] = this->triangles[refs[i].triangle];
+    this->triangles.swap(ordered);
+
+    this->nodes.resize(builtCount);
+    uint32_t next = 0;
+    uint32_t stack[STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const BuildNode& b = built[stack[--top]];
+        BvhNode& node = this->nodes[next++];
+        store_bounds(node, b.bounds);
+        if (b.count > 0) {
+            node.offset = b.first;
+            node.count = uint16_t(b.count);
+            node.axis = 0;
+            continue;
+        }
+        node.count = 0;
+        node.axis = uint16_t(b.axis);
+        stack[top++] = b.left + 1;
+        stack[top++] = b.left; // popped first, so it lands right after its parent
+    }
+    // A right child follows its parent's whole left subtree; sizes come from a backward pass
+    std::vector<uint32_t> subtreeSize(builtCount, 1);
+    for (uint32_t i = builtCount; i-- > 0;) {
+        if (this->nodes[i].count > 0) continue;
+        uint32_t right = i + 1 + subtreeSize[i + 1];
+        this->nodes[i].offset = right;
+        subtreeSize[i] = 1 + subtreeSize[i + 1] + subtreeSize[right];
+    }
+}
+
+void Bvh::refit(const Mesh& mesh, float rotation) {
+    if (this->nodes.empty()) return;
+    this->builtRotation = rotation;
+    transform_triangles(mesh, rotation, this->triangles);
+
+    // Children always come after their parent, so one backward pass sees them first
+    for (size_t i = this->nodes.size(); i-- > 0;) {
+        BvhNode& node = this->nodes[i];
+        Bounds b;
+        if (node.count > 0) {
+            for (uint32_t t = node.offset; t < node.offset + node.count; t++) b.grow(triangle_bounds(this->triangles[t]));
+        }
+        else {
+            for (const BvhNode* child : { &this->nodes[i + 1], &this->nodes[node.offset] }) {
+                b.grow(child->boundsMin);
+                b.grow(child->boundsMax);
+            }
+        }
+        store_bounds(node, b);
+    }
+}
+
+template<bool AnyHit>
+uint32_t Bvh::traverse(const RayPacket& packet, BvhHit* hits) const {
+    constexpr int N = RAY_PACKET_SIZE;
+    float tMax[N], invX[N], invY[N], invZ[N];
+    for (int i = 0; i < N; i++) {
+        // Inactive lanes get a negative tMax, which no box or triangle test passes
+        tMax[i] = (packet.active >> i) & 1 ? packet.tMax[i] : -1.0f;
+        // A zero component would give 0 * inf = NaN in the slab test; a tiny one gives a huge finite slab
+        invX[i] = 1.0f / (std::abs(packet.dx[i]) > 1e-30f ? packet.dx[i] : std::copysign(1e-30f, packet.dx[i]));
+        invY[i] = 1.0f / (std::abs(packet.dy[i]) > 1e-30f ? packet.dy[i] : std::copysign(1e-30f, packet.dy[i]));
+        invZ[i] = 1.0f / (std::abs(packet.dz[i]) > 1e-30f ? packet.dz[i] : std::copysign(1e-30f, packet.dz[i]));
+    }
+    uint32_t blocked = 0;
+    if (this->nodes.empty() || packet.active == 0) return 0;
+
+    // Front-to-back order follows the first active ray; coherent packets share its signs
+    int lead = __builtin_ctz(packet.active);
+    bool negative[3] = { packet.dx[lead] < 0, packet.dy[lead] < 0, packet.dz[lead] < 0 };
+
+    uint32_t stack[STACK_SIZE];
+    int top = 0;
+    uint32_t index = 0;
+    while (true) {
+        const BvhNode& node = this->nodes[index];
+
+        int any = 0;
+        for (int i = 0; i < N; i++) {
+            float x0 = (node.boundsMin[0] - packet.ox[i]) * invX[i], x1 = (node.boundsMax[0] - packet.ox[i]) * invX[i];
+            float y0 = (node.boundsMin[1] - packet.oy[i]) * invY[i], y1 = (node.boundsMax[1] - packet.oy[i]) * invY[i];
+            float z0 = (node.boundsMin[2] - packet.oz[i]) * invZ[i], z1 = (node.boundsMax[2] - packet.oz[i]) * invZ[i];
+            float tNear = std::max(std::max(std::min(x0, x1), std::min(y0, y1)), std::max(std::min(z0, z1), 0.0f));
+            float tFar = std::min(std::min(std::max(x0, x1), std::max(y0, y1)), std::min(std::max(z0, z1), tMax[i]));
+            any |= tNear <= tFar;
+        }
+
+        if (any && node.count == 0) {
+            uint32_t near = index + 1, far = node.offset;
+            if (negative[node.axis]) std::swap(near, far);
+            stack[top++] = far;
+            index = near;
+            continue;
+        }
+        if (any) {
+            for (uint32_t t = node.offset; t < node.offset + node.count; t++) {
+                const BvhTriangle& tri = this->triangles[t];
+                for (int i = 0; i < N; i++) {
+                    // Moller-Trumbore, two-sided
+                    float px = packet.dy[i] * tri.edge2[2] - packet.dz[i] * tri.edge2[1];
+                    float py = packet.dz[i] * tri.edge2[0] - packet.dx[i] * tri.edge2[2];
+                    float pz = packet.dx[i] * tri.edge2[1] - packet.dy[i] * tri.edge2[0];
+                    float det = tri.edge1[0] * px + tri.edge1[1] * py + tri.edge1[2] * pz;
+                    float invDet = 1.0f / det;
+                    float sx = packet.ox[i] - tri.v0[0], sy = packet.oy[i] - tri.v0[1], sz = packet.oz[i] - tri.v0[2];
+                    float u = (sx * px + sy * py + sz * pz) * invDet;
+                    float qx = sy * tri.edge1[2] - sz * tri.edge1[1];
+                    float qy = sz * tri.edge1[0] - sx * tri.edge1[2];
+                    float qz = sx * tri.edge1[1] - sy * tri.edge1[0];
+                    float v = (packet.dx[i] * qx + packet.dy[i] * qy + packet.dz[i] * qz) * invDet;
+                    float dist = (tri.edge2[0] * qx + tri.edge2[1] * qy + tri.edge2[2] * qz) * invDet;
+                    bool hit = std::abs(det) > 1e-12f && u >= 0 && v >= 0 && u + v <= 1 && dist > 0 && dist < tMax[i];
+                    if (!hit) continue;
+                    if (AnyHit) {
+                        blocked |= 1u << i;
+                        tMax[i] = -1.0f; // retire the lane
+                    }
+                    else {
+                        tMax[i] = dist;
+                        hits[i] = BvhHit{ dist, u, v, tri.index };
+                    }
+                }
+            }
+            if (AnyHit && blocked == packet.active) return blocked;
+        }
+        if (top == 0) break;
+        index = stack[--top];
+    }
+    return blocked;
+}
+
+void Bvh::intersect(const RayPacket& packet, BvhHit hits[RAY_PACKET_SIZE]) const {
+    for (int i = 0; i < RAY_PACKET_SIZE; i++) hits[i] = BvhHit{};
+    traverse<false>(packet, hits);
+}
+
+uint32_t Bvh::occluded(const RayPacket& packet) const {
+    return traverse<true>(packet, nullptr);
+}
+
+BvhHit Bvh::intersect(const vec3& origin, const vec3& direction, float tMax) const {
+    RayPacket packet{};
+    packet.ox[0] = float(origin.x);
+    packet.oy[0] = float(origin.y);
+    packet.oz[0] = float(origin.z);
+    packet.dx[0] = float(direction.x);
+    packet.dy[0] = float(direction.y);
+    packet.dz[0] = float(direction.z);
+    packet.tMax[0] = tMax;
+    packet.active = 1;
+    BvhHit hits[RAY_PACKET_SIZE];
+    intersect(packet, hits);
+    return hits[0];
+}
+
+bool Bvh::occluded(const vec3& from, const vec3& to) const {
+    RayPacket packet{};
+    vec3 d = to - from;
+    packet.ox[0] = float(from.x);
+    packet.oy[0] = float(from.y);
+    packet.oz[0] = float(from.z);
+    packet.dx[0] = float(d.x);
+    packet.dy[0] = float(d.y);
+    packet.dz[0] = float(d.z);
+    packet.tMax[0] = 1.0f;
+    packet.active = 1;
+    return occluded(packet) != 0;
+}
+
+void screen_ray(const Pipeline& pipeline, double x, double y, vec3& origin, vec3& direction) {
+    // The perspective puts the eye at view-space z = f, where clip w reaches zero
+    mat<4, 4> modelview = pipeline.get_modelview();
+    double f = -1.0 / pipeline.get_perspective()(3, 2);
+    vec4 eye = inverse(modelview) * vec4{ 0, 0, f, 1 };
+
+    // Any point of the pixel's ray, here the one at screen depth 0
+    mat<4, 4> toScreen = pipeline.get_viewport() * pipeline.get_perspective() * modelview;
+    vec4 p = inverse(toScreen) * vec4{ x, y, 0, 1 };
+
+    origin = vec3{ eye.x / eye.w, eye.y / eye.w, eye.z / eye.w };
+    direction = normalize(vec3{ p.x / p.w, p.y / p.w, p.z / p.w } - origin);
+}
@@ -0,0 +1,89 @@
+#pragma once
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "geometry.h"
+#include "mesh.h"
+#include "pipeline.h"
+
+// Bounding volume hierarchy over a mesh's triangles for CPU-side ray and segment queries
+// (picking, occlusion, light visibility).
+//
+// build() splits with a binned surface area heuristic, building subtrees in parallel,
+// then lays the nodes out depth first: an inner node's left child follows it directly
+// and only the right child's index is stored, so a node is 32 bytes. Triangles are
+// stored in leaf order with the same Y rotation draw_mesh() applies, so hits land on
+// what is on screen. refit() follows a new rotation by recomputing the triangles and
+// the bounds bottom-up without changing the tree; rigid motion keeps the tree valid,
+// only looser than a fresh build.
+//
+// Queries run on packets of RAY_PACKET_SIZE rays in structure-of-arrays form, so every
+// box and triangle test is one loop over the lanes that the compiler vectorizes.
+
+constexpr int RAY_PACKET_SIZE = 8;
+
+struct BvhNode {
+    float boundsMin[3];
+    uint32_t offset;  // leaf: first triangle, inner: right child (the left one is the next node)
+    float boundsMax[3];
+    uint16_t count;   // triangles in a leaf, 0 for inner nodes
+    uint16_t axis;    // split axis of an inner node, for front-to-back traversal
+};
+
+static_assert(sizeof(BvhNode) == 32, "two nodes per cache line");
+
+struct BvhTriangle {
+    float v0[3], edge1[3], edge2[3]; // edges from v0, ready for the intersection test
+    uint32_t index;                  // triangle in the mesh
+};
+
+// Rays in structure-of-arrays form. A segment from a to b is origin a, direction b - a
+// and tMax 1. Lanes not set in active are ignored.
+struct RayPacket {
+    float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+    float dx[RAY_PACKET_SIZE], dy[RAY_PACKET_SIZE], dz[RAY_PACKET_SIZE];
+    float tMax[RAY_PACKET_SIZE];
+    uint32_t active = 0; // bit i = lane i
+};
+
+struct BvhHit {
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    float t = 0, u = 0, v = 0; // distance in units of the direction, barycentrics of corners 1 and 2
+    uint32_t triangle = NONE;
+
+    bool hit() const { return triangle != NONE; }
+};
+
+class Bvh {
+public:
+    static constexpr int MAX_LEAF_TRIANGLES = 8;
+
+    void build(const Mesh& mesh, float rotation = 0.0f);
+    void refit(const Mesh& mesh, float rotation);
+    bool empty() const { return nodes.empty(); }
+    float rotation() const { return builtRotation; }
+
+    // Nearest hit per active lane, both sides of every triangle count
+    void intersect(const RayPacket& packet, BvhHit hits[RAY_PACKET_SIZE]) const;
+    // Mask of the active lanes blocked before their tMax; stops at the first hit per lane
+    uint32_t occluded(const RayPacket& packet) const;
+
+    BvhHit intersect(const vec3& origin, const vec3& direction, float tMax = std::numeric_limits<float>::max()) const;
+    bool occluded(const vec3& from, const vec3& to) const;
+
+    const std::vector<BvhNode>& node_data() const { return nodes; }
+
+private:
+    std::vector<BvhNode> nodes;
+    std::vector<BvhTriangle> triangles;
+    float builtRotation = 0.0f;
+
+    template<bool AnyHit>
+    uint32_t traverse(const RayPacket& packet, BvhHit* hits) const;
+};
+
+// World-space ray through the screen point (x, y), y up as in Rect, for the pipeline's
+// current camera. The origin is the eye.
+void screen_ray(const Pipeline& pipeline, double x, double y, vec3& origin, vec3& direction);
@@ -0,0 +1,830 @@
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunked_mesh.h"
+#include "mesh_optimizer.h"
+
+namespace {
+
+const char CHUNKED_MESH_MAGIC[4] = { 'R', 'C', 'H', 'K' };
+const uint32_t CHUNKED_MESH_VERSION = 1;
+const size_t VERTEX_BYTES = 6 * sizeof(float);
+
+uint64_t align_up(uint64_t value, uint64_t align) {
+    return (value + align - 1) / align * align;
+}
+
+// Splits the triangles at the median centroid along the longest axis until every part is small enough
+std::vector<std::vector<uint32_t>> partition(const Mesh& mesh, size_t trianglesPerChunk) {
+    size_t count = mesh.triangle_count();
+    std::vector<vec3> centroid(count);
+    for (size_t t = 0; t < count; t++) {
+        const uint32_t* tri = &mesh.indices[t * 3];
+        centroid[t] = (mesh.positions[tri[0]] + mesh.positions[tri[1]] + mesh.positions[tri[2]]) * (1.0 / 3);
+    }
+
+    std::vector<uint32_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+
+    std::vector<std::vector<uint32_t>> chunks;
+    std::vector<std::pair<size_t, size_t>> stack = { { 0, count } };
+    while (!stack.empty()) {
+        auto [begin, end] = stack.back();
+        stack.pop_back();
+        if (end - begin <= trianglesPerChunk) {
+            if (end > begin) chunks.emplace_back(order.begin() + begin, order.begin() + end);
+            continue;
+        }
+
+        vec3 lo = centroid[order[begin]], hi = lo;
+        for (size_t i = begin; i < end; i++) {
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], centroid[order[i]][c]);
+                hi[c] = std::max(hi[c], centroid[order[i]][c]);
+            }
+        }
+        vec3 extent = hi - lo;
+        int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+        size_t mid = begin + (end - begin) / 2;
+        std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+            [&](uint32_t a, uint32_t b) { return centroid[a][axis] < centroid[b][axis]; });
+        stack.push_back({ mid, end });
+        stack.push_back({ begin, mid });
+    }
+    return chunks;
+}
+
+// Key of the clustering cell holding p, on the grid of the given cell size anchored at origin
+uint64_t cell_key(const vec3& p, const vec3& origin, double cell) {
+    uint64_t key = 0;
+    for (int c = 0; c < 3; c++) {
+        uint64_t i = static_cast<uint64_t>(std::max(0.0, std::floor((p[c] - origin[c]) / cell)));
+        key = (key << 21) | (i & 0x1fffff);
+    }
+    return key;
+}
+
+// One level of vertex clustering: the cluster of every vertex and the clusters' attributes
+struct Clustering {
+    std::vector<uint32_t> clusterOf;
+    std::vector<vec3> positions, normals;
+    float error = 0.0f; // cell size
+};
+
+// Vertex clustering on a grid shared by the whole mesh: every vertex is replaced by the
+// average of its cell.
+Clustering cluster_vertices(const Mesh& mesh, const vec3& origin, double cell) {
+    Clustering out;
+    std::unordered_map<uint64_t, uint32_t> cells;
+    std::vector<uint32_t> counts;
+    out.clusterOf.resize(mesh.positions.size());
+    out.error = static_cast<float>(cell);
+
+    for (size_t v = 0; v < mesh.positions.size(); v++) {
+        const vec3& p = mesh.positions[v];
+        auto [it, inserted] = cells.try_emplace(cell_key(p, origin, cell), static_cast<uint32_t>(out.positions.size()));
+        if (inserted) {
+            out.positions.push_back(vec3{ 0, 0, 0 });
+            out.normals.push_back(vec3{ 0, 0, 0 });
+            counts.push_back(0);
+        }
+        uint32_t cluster = it->second;
+        out.positions[cluster] = out.positions[cluster] + p;
+        out.normals[cluster] = out.normals[cluster] + mesh.normals[v];
+        counts[cluster]++;
+        out.clusterOf[v] = cluster;
+    }
+
+    for (size_t c = 0; c < out.positions.size(); c++) {
+        out.positions[c] = out.positions[c] * (1.0 / counts[c]);
+        // Opposite sides of a thin sheet can cancel out; any unit normal beats NaN
+        out.normals[c] = magnitude(out.normals[c]) > 1e-12 ? normalize(out.normals[c]) : vec3{ 0, 0, 1 };
+    }
+    return out;
+}
+
+// Pulls the given triangles out as a self-contained mesh, optionally through a vertex clustering.
+// Triangles that collapse or repeat after clustering are dropped.
+Mesh extract(const Mesh& mesh, const std::vector<uint32_t>& triangles, const std::vector<uint32_t>* clusterOf,
+    const std::vector<vec3>& positions, const std::vector<vec3>& normals) {
+    Mesh out;
+    std::unordered_map<uint32_t, uint32_t> local;
+    std::set<std::array<uint32_t, 3>> seen;
+
+    for (uint32_t t : triangles) {
+        uint32_t corner[3];
+        for (int k = 0; k < 3; k++) {
+            uint32_t v = mesh.indices[t * 3 + k];
+            corner[k] = clusterOf ? (*clusterOf)[v] : v;
+        }
+        if (clusterOf) {
+            if (corner[0] == corner[1] || corner[1] == corner[2] || corner[0] == corner[2]) continue;
+            // Rotate the smallest index first so repeats compare equal without flipping the winding
+            int first = corner[0] < corner[1] ? (corner[0] < corner[2] ? 0 : 2) : (corner[1] < corner[2] ? 1 : 2);
+            std::array<uint32_t, 3> canonical = { corner[first], corner[(first + 1) % 3], corner[(first + 2) % 3] };
+            if (!seen.insert(canonical).second) continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            auto [it, inserted] = local.try_emplace(corner[k], static_cast<uint32_t>(out.positions.size()));
+            if (inserted) {
+                out.positions.push_back(positions[corner[k]]);
+                out.normals.push_back(normals[corner[k]]);
+            }
+            out.indices.push_back(it->second);
+        }
+    }
+    return out;
+}
+
+void write_zeros(std::ofstream& ofs, uint64_t count) {
+    static const char zeros[4096] = {};
+    while (count > 0) {
+        uint64_t n = std::min<uint64_t>(count, sizeof(zeros));
+        ofs.write(zeros, n);
+        count -= n;
+    }
+}
+
+ChunkedMeshHeader make_header(size_t chunkCount, int lodCount, const vec3& lo, const vec3& hi) {
+    ChunkedMeshHeader header{};
+    std::memcpy(header.magic, CHUNKED_MESH_MAGIC, sizeof(header.magic));
+    header.version = CHUNKED_MESH_VERSION;
+    header.chunkCount = static_cast<uint32_t>(chunkCount);
+    header.lodCount = static_cast<uint32_t>(lodCount);
+    for (int c = 0; c < 3; c++) {
+        header.boundsMin[c] = static_cast<float>(lo[c]);
+        header.boundsMax[c] = static_cast<float>(hi[c]);
+    }
+    return header;
+}
+
+// Writes every level of one chunk, each at the next aligned offset after position, and
+// fills its record. Level 0 is the mesh itself, level k > 0 goes through levels[k].
+void write_chunk(std::ofstream& ofs, uint64_t& position, const Mesh& mesh, const std::vector<uint32_t>& triangles,
+    const std::vector<Clustering>& levels, ChunkRecord& record, std::vector<float>& vertices) {
+    std::fill(record.boundsMin, record.boundsMin + 3, std::numeric_limits<float>::max());
+    std::fill(record.boundsMax, record.boundsMax + 3, std::numeric_limits<float>::lowest());
+
+    for (size_t lod = 0; lod < levels.size(); lod++) {
+        Mesh part = lod == 0
+            ? extract(mesh, triangles, nullptr, mesh.positions, mesh.normals)
+            : extract(mesh, triangles, &levels[lod].clusterOf, levels[lod].positions, levels[lod].normals);
+        optimize_mesh(part);
+
+        uint64_t offset = align_up(position, CHUNK_DATA_ALIGNMENT);
+        write_zeros(ofs, offset - position);
+
+        vertices.resize(part.positions.size() * 6);
+        for (size_t v = 0; v < part.positions.size(); v++) {
+            for (int c = 0; c < 3; c++) {
+                vertices[v * 6 + c] = static_cast<float>(part.positions[v][c]);
+                vertices[v * 6 + 3 + c] = static_cast<float>(part.normals[v][c]);
+                record.boundsMin[c] = std::min(record.boundsMin[c], vertices[v * 6 + c]);
+                record.boundsMax[c] = std::max(record.boundsMax[c], vertices[v * 6 + c]);
+            }
+        }
+        ofs.write(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(float));
+        ofs.write(reinterpret_cast<const char*>(part.indices.data()), part.indices.size() * sizeof(uint32_t));
+
+        record.lods[lod] = ChunkLod{ offset, static_cast<uint32_t>(part.positions.size()), static_cast<uint32_t>(part.indices.size()), levels[lod].error, 0 };
+        position = offset + part.positions.size() * VERTEX_BYTES + part.indices.size() * sizeof(uint32_t);
+    }
+}
+
+// Number of parts partition() makes of count triangles; the split only depends on counts
+size_t partition_count(size_t count, size_t trianglesPerChunk) {
+    if (count <= trianglesPerChunk) return count > 0 ? 1 : 0;
+    return partition_count(count / 2, trianglesPerChunk) + partition_count(count - count / 2, trianglesPerChunk);
+}
+
+// Temporary file of the out-of-core build. It is unlinked as soon as it is created, so it
+// goes away with the process whatever happens. Appends are buffered, reads go through mmap.
+class ScratchFile {
+public:
+    ScratchFile() = default;
+    ~ScratchFile() { close(); }
+
+    ScratchFile(const ScratchFile&) = delete;
+    ScratchFile& operator=(const ScratchFile&) = delete;
+
+    bool create(const std::string& path) {
+        this->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (this->fd < 0) {
+            std::cerr << "Could not create scratch file " << path << std::endl;
+            return false;
+        }
+        unlink(path.c_str());
+        return true;
+    }
+
+    bool append(const void* data, size_t bytes) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        this->buffer.insert(this->buffer.end(), p, p + bytes);
+        this->length += bytes;
+        return this->buffer.size() < BUFFER_BYTES || flush();
+    }
+
+    // Unbuffered, for files laid out up front with resize()
+    bool write_at(uint64_t offset, const void* data, size_t bytes) {
+        const char* p = static_cast<const char*>(data);
+        while (bytes > 0) {
+            ssize_t n = pwrite(this->fd, p, bytes, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            offset += n;
+            bytes -= n;
+        }
+        return true;
+    }
+
+    bool resize(uint64_t bytes) {
+        this->length = bytes;
+        return ftruncate(this->fd, static_cast<off_t>(bytes)) == 0;
+    }
+
+    uint64_t size() const { return this->length; }
+
+    // Everything written so far, read-only; nullptr when empty or on failure
+    const uint8_t* map() {
+        if (!flush() || this->length == 0) return nullptr;
+        if (!this->mapped) {
+            void* p = mmap(nullptr, this->length, PROT_READ, MAP_SHARED, this->fd, 0);
+            if (p == MAP_FAILED) return nullptr;
+            this->mapped = p;
+            this->mappedSize = this->length;
+        }
+        return static_cast<const uint8_t*>(this->mapped);
+    }
+
+    void close() {
+        if (this->mapped) munmap(this->mapped, this->mappedSize);
+        if (this->fd >= 0) ::close(this->fd);
+        this->mapped = nullptr;
+        this->fd = -1;
+    }
+
+private:
+    static constexpr size_t BUFFER_BYTES = 1 << 20;
+
+    int fd = -1;
+    std::vector<uint8_t> buffer;
+    uint64_t length = 0;
+    void* mapped = nullptr;
+    size_t mappedSize = 0;
+
+    bool flush() {
+        if (this->buffer.empty()) return true;
+        bool ok = write_at(this->length - this->buffer.size(), this->buffer.data(), this->buffer.size());
+        this->buffer.clear();
+        return ok;
+    }
+};
+
+// Counting sort onto disk: records collect in a small buffer per bucket and are written
+// at that bucket's cursor, so every bucket ends up contiguous and in bucket order
+template<typename T>
+class BucketScatter {
+public:
+    BucketScatter(ScratchFile& file, const std::vector<uint64_t>& first) : file(file), cursor(first), pending(first.size() - 1) {}
+
+    bool add(uint32_t bucket, const T& record) {
+        std::vector<T>& buffer = this->pending[bucket];
+        buffer.push_back(record);
+        return buffer.size() < RECORDS || flush(bucket);
+    }
+
+    bool finish() {
+        bool ok = true;
+        for (size_t b = 0; b < this->pending.size(); b++) ok = flush(static_cast<uint32_t>(b)) && ok;
+        return ok;
+    }
+
+private:
+    static constexpr size_t RECORDS = 256;
+
+    ScratchFile& file;
+    std::vector<uint64_t> cursor; // next record of each bucket
+    std::vector<std::vector<T>> pending;
+
+    bool flush(uint32_t bucket) {
+        std::vector<T>& buffer = this->pending[bucket];
+        bool ok = this->file.write_at(this->cursor[bucket] * sizeof(T), buffer.data(), buffer.size() * sizeof(T));
+        this->cursor[bucket] += buffer.size();
+        buffer.clear();
+        return ok;
+    }
+};
+
+// An OBJ face after fan triangulation, with 1-based indices as written (0 when missing)
+struct ObjTriangle {
+    uint32_t v[3], n[3];
+};
+
+// A triangle routed to the bucket of its centroid; index numbers every valid triangle
+struct BucketTriangle {
+    uint64_t index;
+    uint32_t v[3], n[3]; // n all 0 when the face falls back to its geometric normal
+};
+
+// A triangle corner routed to the bucket holding its position. Corners with the same key
+// are the same mesh vertex, as build_mesh() would dedupe them.
+struct BucketCorner {
+    uint64_t key;
+    uint32_t v;
+    float normal[3]; // unnormalized
+};
+
+// Average position and normal of one clustering cell, over every mesh vertex inside it
+struct CellStat {
+    uint64_t key;
+    float position[3], normal[3];
+};
+
+uint64_t corner_key(const BucketTriangle& t, int k) {
+    bool faceNormal = t.n[0] == 0;
+    return faceNormal ? (uint64_t(1) << 63) | (t.index * 3 + k) : (uint64_t(t.v[k]) << 32) | t.n[k];
+}
+
+// Reads the OBJ line by line into scratch files: vertex positions and normals as float
+// triples, faces split into a triangle fan around their first corner. Accepts v, v/t,
+// v//n and v/t/n corners and negative (relative) indices.
+bool parse_obj(const std::string& objPath, ScratchFile& positions, ScratchFile& normals, ScratchFile& triangles, uint32_t& vertexCount, uint32_t& normalCount) {
+    std::ifstream file(objPath);
+    if (!file) {
+        std::cerr << "Could not open " << objPath << std::endl;
+        return false;
+    }
+    vertexCount = 0;
+    normalCount = 0;
+
+    auto resolve = [](long index, uint32_t count) -> uint32_t {
+        if (index < 0) index += long(count) + 1;
+        return index > 0 && index <= long(UINT32_MAX) ? static_cast<uint32_t>(index) : 0;
+    };
+
+    std::string line;
+    std::vector<std::pair<uint32_t, uint32_t>> corners;
+    bool ok = true;
+    while (ok && std::getline(file, line)) {
+        const char* p = line.c_str();
+        if (line.compare(0, 2, "v ") == 0 || line.compare(0, 3, "vn ") == 0) {
+            bool normal = line[1] == 'n';
+            float xyz[3];
+            char* end = const_cast<char*>(p + (normal ? 3 : 2));
+            int read = 0;
+            for (; read < 3; read++) {
+                char* next;
+                xyz[read] = std::strtof(end, &next);
+                if (next == end) break;
+                end = next;
+            }
+            if (read < 3) continue;
+            ok = normal ? normals.append(xyz, sizeof(xyz)) : positions.append(xyz, sizeof(xyz));
+            (normal ? normalCount : vertexCount)++;
+        }
+        else if (line.compare(0, 2, "f ") == 0) {
+            corners.clear();
+            char* cur = const_cast<char*>(p + 2);
+            for (;;) {
+                char* next;
+                long v = std::strtol(cur, &next, 10);
+                if (next == cur) break;
+                long n = 0;
+                cur = next;
+                if (*cur == '/') {
+                    cur++;
+                    std::strtol(cur, &next, 10); // texture coordinate, unused
+                    cur = next;
+                    if (*cur == '/') {
+                        cur++;
+                        n = std::strtol(cur, &next, 10);
+                        cur = next;
+                    }
+                }
+                corners.emplace_back(resolve(v, vertexCount), resolve(n, normalCount));
+                while (*cur && *cur != ' ' && *cur != '\t') cur++; // anything else in the token
+            }
+            for (size_t k = 1; ok && k + 1 < corners.size(); k++) {
+                ObjTriangle t{ { corners[0].first, corners[k].first, corners[k + 1].first }, { corners[0].second, corners[k].second, corners[k + 1].second } };
+                ok = triangles.append(&t, sizeof(t));
+            }
+        }
+    }
+    if (!ok) std::cerr << "Could not write scratch data for " << objPath << std::endl;
+    return ok;
+}
+
+// Buckets are boxes of whole cells of the coarsest clustering grid, so no cell of any
+// level is split between buckets
+struct BucketGrid {
+    vec3 origin;
+    double cell = 1;
+    double perBucket = 1; // cells along a bucket side
+    int dims[3] = { 1, 1, 1 };
+
+    uint32_t bucket_of(const vec3& p) const {
+        int b[3];
+        for (int c = 0; c < 3; c++) {
+            double i = std::floor(std::max(0.0, std::floor((p[c] - origin[c]) / cell)) / perBucket);
+            b[c] = static_cast<int>(std::min(i, double(dims[c] - 1)));
+        }
+        return static_cast<uint32_t>((b[2] * dims[1] + b[1]) * dims[0] + b[0]);
+    }
+    size_t count() const { return size_t(dims[0]) * dims[1] * dims[2]; }
+};
+
+}
+
+bool build_chunked_mesh(const Mesh& mesh, const std::string& path, int trianglesPerChunk, int lodCount) {
+    lodCount = std::clamp(lodCount, 1, MAX_CHUNK_LODS);
+    if (mesh.positions.empty() || mesh.triangle_count() == 0) return false;
+
+    vec3 lo = mesh.positions[0], hi = lo;
+    for (const vec3& p : mesh.positions) {
+        for (int c = 0; c < 3; c++) {
+            lo[c] = std::min(lo[c], p[c]);
+            hi[c] = std::max(hi[c], p[c]);
+        }
+    }
+
+    double edgeSum = 0;
+    for (size_t t = 0; t < mesh.triangle_count(); t++) {
+        const uint32_t* tri = &mesh.indices[t * 3];
+        edgeSum += magnitude(mesh.positions[tri[1]] - mesh.positions[tri[0]]);
+    }
+    double averageEdge = std::max(edgeSum / mesh.triangle_count(), 1e-9);
+
+    // Clusterings are computed once for the whole mesh, level 0 is the mesh itself
+    std::vector<Clustering> levels(lodCount);
+    for (int lod = 1; lod < lodCount; lod++) {
+        levels[lod] = cluster_vertices(mesh, lo, averageEdge * std::pow(2.0, lod));
+    }
+
+    std::vector<std::vector<uint32_t>> chunks = partition(mesh, static_cast<size_t>(std::max(trianglesPerChunk, 1)));
+
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs) return false;
+
+    // Header and table are rewritten at the end, once every offset is known
+    ChunkedMeshHeader header = make_header(chunks.size(), lodCount, lo, hi);
+    std::vector<ChunkRecord> table(chunks.size());
+    uint64_t position = sizeof(header) + table.size() * sizeof(ChunkRecord);
+    write_zeros(ofs, position);
+
+    std::vector<float> vertices;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        write_chunk(ofs, position, mesh, chunks[i], levels, table[i], vertices);
+    }
+
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(ChunkRecord));
+    return static_cast<bool>(ofs);
+}
+
+bool build_chunked_mesh_from_obj(const std::string& objPath, const std::string& path, int trianglesPerChunk, int lodCount, size_t bucketTriangles) {
+    lodCount = std::clamp(lodCount, 1, MAX_CHUNK_LODS);
+    size_t perChunk = static_cast<size_t>(std::max(trianglesPerChunk, 1));
+
+    // Pass 1: the OBJ into scratch files, the only time it is read
+    ScratchFile positionFile, normalFile, objTriangleFile, triangleFile, cornerFile, statFile;
+    uint32_t vertexCount, normalCount;
+    if (!positionFile.create(path + ".scratch-positions") || !normalFile.create(path + ".scratch-normals") ||
+        !objTriangleFile.create(path + ".scratch-faces") || !triangleFile.create(path + ".scratch-triangles") ||
+        !cornerFile.create(path + ".scratch-corners") || !statFile.create(path + ".scratch-cells")) {
+        return false;
+    }
+    if (!parse_obj(objPath, positionFile, normalFile, objTriangleFile, vertexCount, normalCount)) return false;
+
+    const float* positions = reinterpret_cast<const float*>(positionFile.map());
+    const float* normals = reinterpret_cast<const float*>(normalFile.map());
+    const ObjTriangle* objTriangles = reinterpret_cast<const ObjTriangle*>(objTriangleFile.map());
+    size_t objTriangleCount = objTriangleFile.size() / sizeof(ObjTriangle);
+    if (!positions || !objTriangles) {
+        std::cerr << objPath << " has no triangles" << std::endl;
+        return false;
+    }
+    madvise(const_cast<ObjTriangle*>(objTriangles), objTriangleCount * sizeof(ObjTriangle), MADV_SEQUENTIAL);
+
+    auto position_of = [&](uint32_t v) { const float* p = positions + size_t(v - 1) * 3; return vec3{ p[0], p[1], p[2] }; };
+    auto normal_of = [&](uint32_t n) { const float* p = normals + size_t(n - 1) * 3; return vec3{ p[0], p[1], p[2] }; };
+    auto valid_vertices = [&](const ObjTriangle& t) {
+        return t.v[0] && t.v[1] && t.v[2] && t.v[0] <= vertexCount && t.v[1] <= vertexCount && t.v[2] <= vertexCount;
+    };
+    auto valid_normals = [&](const ObjTriangle& t) {
+        return t.n[0] && t.n[1] && t.n[2] && t.n[0] <= normalCount && t.n[1] <= normalCount && t.n[2] <= normalCount;
+    };
+
+    // Pass 2: bounds and average edge, the same statistics build_chunked_mesh() takes
+    vec3 lo{ INFINITY, INFINITY, INFINITY }, hi{ -INFINITY, -INFINITY, -INFINITY };
+    double edgeSum = 0;
+    size_t triangleCount = 0;
+    for (size_t t = 0; t < objTriangleCount; t++) {
+        const ObjTriangle& tri = objTriangles[t];
+        if (!valid_vertices(tri)) continue;
+        for (int k = 0; k < 3; k++) {
+            vec3 p = position_of(tri.v[k]);
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], p[c]);
+                hi[c] = std::max(hi[c], p[c]);
+            }
+        }
+        edgeSum += magnitude(position_of(tri.v[1]) - position_of(tri.v[0]));
+        triangleCount++;
+    }
+    if (triangleCount == 0) {
+        std::cerr << objPath << " has no triangles" << std::endl;
+        return false;
+    }
+    double averageEdge = std::max(edgeSum / triangleCount, 1e-9);
+    std::vector<double> cellSize(lodCount);
+    for (int lod = 0; lod < lodCount; lod++) cellSize[lod] = averageEdge * std::pow(2.0, lod);
+
+    // About bucketTriangles per bucket on average, by volume
+    BucketGrid grid;
+    grid.origin = lo;
+    grid.cell = cellSize[lodCount - 1];
+    double cells[3];
+    for (int c = 0; c < 3; c++) cells[c] = std::floor((hi[c] - lo[c]) / grid.cell) + 1;
+    double target = std::clamp(std::ceil(double(triangleCount) / std::max<size_t>(bucketTriangles, 1)), 1.0, 4096.0);
+    auto buckets_for = [&](double side) { return std::ceil(cells[0] / side) * std::ceil(cells[1] / side) * std::ceil(cells[2] / side); };
+    while (buckets_for(grid.perBucket) > target) grid.perBucket *= 2;
+    for (double step = grid.perBucket / 4; step >= 1; step /= 2) {
+        if (buckets_for(grid.perBucket - step) <= target) grid.perBucket -= step;
+    }
+    for (int c = 0; c < 3; c++) grid.dims[c] = static_cast<int>(std::ceil(cells[c] / grid.perBucket));
+    size_t bucketCount = grid.count();
+
+    // Pass 3: triangles to the bucket of their centroid, corners to the bucket of their position
+    auto centroid_of = [&](const ObjTriangle& t) { return (position_of(t.v[0]) + position_of(t.v[1]) + position_of(t.v[2])) * (1.0 / 3); };
+    std::vector<uint64_t> triangleFirst(bucketCount + 1, 0), cornerFirst(bucketCount + 1, 0);
+    for (size_t t = 0; t < objTriangleCount; t++) {
+        const ObjTriangle& tri = objTriangles[t];
+        if (!valid_vertices(tri)) continue;
+        triangleFirst[grid.bucket_of(centroid_of(tri)) + 1]++;
+        for (int k = 0; k < 3; k++) cornerFirst[grid.bucket_of(position_of(tri.v[k])) + 1]++;
+    }
+    for (size_t b = 0; b < bucketCount; b++) {
+        triangleFirst[b + 1] += triangleFirst[b];
+        cornerFirst[b + 1] += cornerFirst[b];
+    }
+    if (!triangleFile.resize(triangleCount * sizeof(BucketTriangle)) || !cornerFile.resize(triangleCount * 3 * sizeof(BucketCorner))) {
+        std::cerr << "Could not write scratch data for " << objPath << std::endl;
+        return false;
+    }
+    {
+        BucketScatter<BucketTriangle> triangleScatter(triangleFile, triangleFirst);
+        BucketScatter<BucketCorner> cornerScatter(cornerFile, cornerFirst);
+        bool ok = true;
+        uint64_t index = 0;
+        for (size_t t = 0; ok && t < objTriangleCount; t++) {
+            const ObjTriangle& tri = objTriangles[t];
+            if (!valid_vertices(tri)) continue;
+            BucketTriangle routed{ index++, { tri.v[0], tri.v[1], tri.v[2] }, { 0, 0, 0 } };
+            vec3 faceNormal{ 0, 0, 0 };
+            if (valid_normals(tri)) {
+                std::copy(tri.n, tri.n + 3, routed.n);
+            }
+            else {
+                vec3 p0 = position_of(tri.v[0]);
+                faceNormal = normalize(cross(position_of(tri.v[1]) - p0, position_of(tri.v[2]) - p0));
+            }
+            ok = triangleScatter.add(grid.bucket_of(centroid_of(tri)), routed);
+            for (int k = 0; ok && k < 3; k++) {
+                vec3 n = routed.n[0] ? normal_of(routed.n[k]) : faceNormal;
+                BucketCorner corner{ corner_key(routed, k), routed.v[k], { float(n.x), float(n.y), float(n.z) } };
+                ok = cornerScatter.add(grid.bucket_of(position_of(routed.v[k])), corner);
+            }
+        }
+        if (!ok || !triangleScatter.finish() || !cornerScatter.finish()) {
+            std::cerr << "Could not write scratch data for " << objPath << std::endl;
+            return false;
+        }
+    }
+    objTriangleFile.close(); // everything from here reads the bucketed copies
+
+    // Pass 4: cell averages per bucket. Every vertex of a cell lives in the cell's bucket,
+    // so each average is complete and the same for every chunk that uses the cell.
+    const BucketCorner* corners = reinterpret_cast<const BucketCorner*>(cornerFile.map());
+    std::vector<std::pair<uint64_t, uint64_t>> statRange(bucketCount * lodCount, { 0, 0 }); // first record, count
+    uint64_t statCount = 0;
+    std::unordered_set<uint64_t> seen;
+    std::vector<CellStat> sorted;
+    for (size_t b = 0; lodCount > 1 && b < bucketCount; b++) {
+        seen.clear();
+        std::vector<const BucketCorner*> unique;
+        for (uint64_t i = cornerFirst[b]; i < cornerFirst[b + 1]; i++) {
+            if (seen.insert(corners[i].key).second) unique.push_back(&corners[i]);
+        }
+        for (int lod = 1; lod < lodCount; lod++) {
+            std::vector<std::array<double, 7>> total; // position, normal, count
+            std::unordered_map<uint64_t, uint32_t> slot;
+            for (const BucketCorner* corner : unique) {
+                vec3 p = position_of(corner->v);
+                vec3 n = normalize(vec3{ corner->normal[0], corner->normal[1], corner->normal[2] });
+                auto [it, inserted] = slot.try_emplace(cell_key(p, lo, cellSize[lod]), static_cast<uint32_t>(total.size()));
+                if (inserted) total.push_back({ 0, 0, 0, 0, 0, 0, 0 });
+                std::array<double, 7>& sum = total[it->second];
+                for (int c = 0; c < 3; c++) {
+                    sum[c] += p[c];
+                    sum[3 + c] += n[c];
+                }
+                sum[6]++;
+            }
+            sorted.clear();
+            for (const auto& [key, index] : slot) {
+                const std::array<double, 7>& sum = total[index];
+                vec3 p = vec3{ sum[0], sum[1], sum[2] } * (1.0 / sum[6]);
+                vec3 n{ sum[3], sum[4], sum[5] };
+                n = magnitude(n) > 1e-12 ? normalize(n) : vec3{ 0, 0, 1 }; // as in cluster_vertices()
+                sorted.push_back(CellStat{ key, { float(p.x), float(p.y), float(p.z) }, { float(n.x), float(n.y), float(n.z) } });
+            }
+            std::sort(sorted.begin(), sorted.end(), [](const CellStat& a, const CellStat& c) { return a.key < c.key; });
+            statRange[b * lodCount + lod] = { statCount, sorted.size() };
+            statCount += sorted.size();
+            if (!statFile.append(sorted.data(), sorted.size() * sizeof(CellStat))) {
+                std::cerr << "Could not write scratch data for " << objPath << std::endl;
+                return false;
+            }
+        }
+    }
+    cornerFile.close();
+    const CellStat* stats = reinterpret_cast<const CellStat*>(statFile.map());
+
+    // Chunks come out bucket by bucket; their number is known from the counts alone
+    size_t chunkCount = 0;
+    for (size_t b = 0; b < bucketCount; b++) chunkCount += partition_count(triangleFirst[b + 1] - triangleFirst[b], perChunk);
+
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs) return false;
+    ChunkedMeshHeader header = make_header(chunkCount, lodCount, lo, hi);
+    std::vector<ChunkRecord> table(chunkCount);
+    uint64_t position = sizeof(header) + table.size() * sizeof(ChunkRecord);
+    write_zeros(ofs, position);
+
+    // Pass 5: one bucket at a time in memory, as a mesh of its own, split and written like build_chunked_mesh() does
+    const BucketTriangle* routed = reinterpret_cast<const BucketTriangle*>(triangleFile.map());
+    size_t chunk = 0;
+    std::vector<float> vertices;
+    for (size_t b = 0; b < bucketCount; b++) {
+        if (triangleFirst[b + 1] == triangleFirst[b]) continue;
+
+        Mesh mesh;
+        std::unordered_map<uint64_t, uint32_t> local;
+        for (uint64_t i = triangleFirst[b]; i < triangleFirst[b + 1]; i++) {
+            const BucketTriangle& tri = routed[i];
+            vec3 faceNormal{ 0, 0, 0 };
+            if (tri.n[0] == 0) {
+                vec3 p0 = position_of(tri.v[0]);
+                faceNormal = normalize(cross(position_of(tri.v[1]) - p0, position_of(tri.v[2]) - p0));
+            }
+            for (int k = 0; k < 3; k++) {
+                auto [it, inserted] = local.try_emplace(corner_key(tri, k), static_cast<uint32_t>(mesh.positions.size()));
+                if (inserted) {
+                    mesh.positions.push_back(position_of(tri.v[k]));
+                    mesh.normals.push_back(tri.n[0] ? normalize(normal_of(tri.n[k])) : faceNormal);
+                }
+                mesh.indices.push_back(it->second);
+            }
+        }
+
+        // Clusters from the cell averages of whichever bucket owns each cell
+        std::vector<Clustering> levels(lodCount);
+        for (int lod = 1; lod < lodCount; lod++) {
+            Clustering& level = levels[lod];
+            level.error = static_cast<float>(cellSize[lod]);
+            level.clusterOf.resize(mesh.positions.size());
+            std::unordered_map<uint64_t, uint32_t> clusters;
+            for (size_t v = 0; v < mesh.positions.size(); v++) {
+                const vec3& p = mesh.positions[v];
+                uint64_t key = cell_key(p, lo, cellSize[lod]);
+                auto [it, inserted] = clusters.try_emplace(key, static_cast<uint32_t>(level.positions.size()));
+                if (inserted) {
+                    auto [first, count] = statRange[grid.bucket_of(p) * lodCount + lod];
+                    const CellStat* end = stats + first + count;
+                    const CellStat* cell = std::lower_bound(stats + first, end, key,
+                        [](const CellStat& s, uint64_t k) { return s.key < k; });
+                    if (cell == end || cell->key != key) { // the stats pass saw other cells than this one
+                        std::cerr << "Missing LOD " << lod << " cell for a vertex of " << objPath << std::endl;
+                        return false;
+                    }
+                    level.positions.push_back(vec3{ cell->position[0], cell->position[1], cell->position[2] });
+                    level.normals.push_back(vec3{ cell->normal[0], cell->normal[1], cell->normal[2] });
+                }
+                level.clusterOf[v] = it->second;
+            }
+        }
+
+        for (const std::vector<uint32_t>& triangles : partition(mesh, perChunk)) {
+            write_chunk(ofs, position, mesh, triangles, levels, table[chunk++], vertices);
+        }
+    }
+
+    std::cout << objPath << ": " << triangleCount << " triangles in " << bucketCount << " buckets, " << chunkCount << " chunks" << std::endl;
+    ofs.seekp(0);
+    ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    ofs.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(ChunkRecord));
+    return chunk == chunkCount && static_cast<bool>(ofs);
+}
+
+bool ChunkedMeshFile::open(const std::string& path) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Could not open " << path << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(ChunkedMeshHeader))) {
+        std::cerr << path << " is not a chunked mesh" << std::endl;
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps the file alive
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Could not map " << path << std::endl;
+        return false;
+    }
+    this->data = static_cast<const uint8_t*>(mapped);
+    this->size = static_cast<size_t>(st.st_size);
+    this->header = reinterpret_cast<const ChunkedMeshHeader*>(this->data);
+    this->table = reinterpret_cast<const ChunkRecord*>(this->data + sizeof(ChunkedMeshHeader));
+
+    // Validate everything read_chunk() relies on, so a truncated file fails here and not mid-frame
+    bool valid = std::memcmp(header->magic, CHUNKED_MESH_MAGIC, sizeof(header->magic)) == 0 &&
+        header->version == CHUNKED_MESH_VERSION &&
+        header->lodCount >= 1 && header->lodCount <= MAX_CHUNK_LODS &&
+        sizeof(ChunkedMeshHeader) + uint64_t(header->chunkCount) * sizeof(ChunkRecord) <= this->size;
+    for (uint32_t i = 0; valid && i < header->chunkCount; i++) {
+        for (uint32_t lod = 0; lod < header->lodCount; lod++) {
+            const ChunkLod& l = table[i].lods[lod];
+            uint64_t end = l.offset + uint64_t(l.vertexCount) * VERTEX_BYTES + uint64_t(l.indexCount) * sizeof(uint32_t);
+            if (l.offset % alignof(float) != 0 || end > this->size || l.indexCount % 3 != 0) valid = false;
+        }
+    }
+    if (!valid) {
+        std::cerr << path << " is not a valid chunked mesh" << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+void ChunkedMeshFile::close() {
+    if (this->data) munmap(const_cast<uint8_t*>(this->data), this->size);
+    this->data = nullptr;
+    this->size = 0;
+    this->header = nullptr;
+    this->table = nullptr;
+}
+
+size_t ChunkedMeshFile::decoded_bytes(int chunk, int lod) const {
+    const ChunkLod& l = this->table[chunk].lods[lod];
+    return size_t(l.vertexCount) * 2 * sizeof(vec3) + size_t(l.indexCount) * sizeof(uint32_t);
+}
+
+bool ChunkedMeshFile::read_chunk(int chunk, int lod, Mesh& out) const {
+    if (!this->data || chunk < 0 || chunk >= chunk_count() || lod < 0 || lod >= lod_count()) return false;
+    const ChunkLod& l = this->table[chunk].lods[lod];
+
+    const float* vertices = reinterpret_cast<const float*>(this->data + l.offset);
+    out.positions.resize(l.vertexCount);
+    out.normals.resize(l.vertexCount);
+    for (uint32_t v = 0; v < l.vertexCount; v++) {
+        const float* src = vertices + size_t(v) * 6;
+        out.positions[v] = vec3{ src[0], src[1], src[2] };
+        out.normals[v] = vec3{ src[3], src[4], src[5] };
+    }
+
+    const uint32_t* indices = reinterpret_cast<const uint32_t*>(this->data + l.offset + size_t(l.vertexCount) * VERTEX_BYTES);
+    out.indices.assign(indices, indices + l.indexCount);
+    bool valid = std::all_of(out.indices.begin(), out.indices.end(), [&](uint32_t i) { return i < l.vertexCount; });
+
+    // The geometry now lives in `out`; hand the file pages back so the mapping stays out of the resident set
+    static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t begin = l.offset / pageSize * pageSize;
+    size_t end = std::min<size_t>(align_up(l.offset + size_t(l.vertexCount) * VERTEX_BYTES + size_t(l.indexCount) * sizeof(uint32_t), pageSize), this->size);
+    if (begin >= sizeof(ChunkedMeshHeader) + size_t(chunk_count()) * sizeof(ChunkRecord)) {
+        madvise(const_cast<uint8_t*>(this->data + begin), end - begin, MADV_DONTNEED);
+    }
+    return valid;
+}
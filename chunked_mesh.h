@@ -0,0 +1,90 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "mesh.h"
+
+// On-disk mesh split into spatial chunks, each stored at several levels of detail, so a
+// renderer can map the file and decode only the chunks it needs.
+//
+// Layout: ChunkedMeshHeader, then chunkCount ChunkRecords, then the geometry of every
+// (chunk, lod) pair starting on a CHUNK_DATA_ALIGNMENT boundary: vertexCount interleaved
+// float vertices (position xyz, normal xyz) followed by indexCount uint32 indices local
+// to that block. All values are little-endian.
+
+constexpr int MAX_CHUNK_LODS = 6;
+constexpr size_t CHUNK_DATA_ALIGNMENT = 16384; // covers 4K and 16K pages, so chunks never share a page
+
+struct ChunkedMeshHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t chunkCount;
+    uint32_t lodCount;
+    float boundsMin[3], boundsMax[3];
+};
+
+struct ChunkLod {
+    uint64_t offset;       // file offset of the vertex block
+    uint32_t vertexCount;
+    uint32_t indexCount;
+    float error;           // object-space size of the clustering cell, 0 for the full-detail level
+    uint32_t reserved;
+};
+
+struct ChunkRecord {
+    float boundsMin[3], boundsMax[3]; // covers the vertices of every level
+    ChunkLod lods[MAX_CHUNK_LODS];
+};
+
+static_assert(sizeof(ChunkedMeshHeader) == 40, "header layout is part of the file format");
+static_assert(sizeof(ChunkLod) == 24, "chunk layout is part of the file format");
+static_assert(sizeof(ChunkRecord) == 168, "chunk layout is part of the file format");
+
+// Writes mesh as a chunked file. Triangles are split at the median of the longest axis
+// until no chunk holds more than trianglesPerChunk; level k > 0 merges all vertices in
+// a grid cell of 2^k average edge lengths (vertex clustering). Cells are shared across
+// the whole mesh, so neighbouring chunks at the same level meet without cracks.
+// Each level is run through optimize_mesh() before it is written.
+bool build_chunked_mesh(const Mesh& mesh, const std::string& path, int trianglesPerChunk = 8192, int lodCount = 4);
+
+// The same conversion straight from an OBJ on disk, for models larger than memory. The OBJ
+// is parsed once into scratch files next to path, its triangles are sorted into a grid of
+// spatial buckets of about bucketTriangles each, and every bucket is then chunked on its
+// own, so memory holds one bucket at a time. Buckets are boxes of whole cells of the
+// coarsest level and cell averages are taken per bucket over all the vertices inside, so
+// the levels stay crack-free across buckets. Writes no .meshcache.
+bool build_chunked_mesh_from_obj(const std::string& objPath, const std::string& path, int trianglesPerChunk = 8192, int lodCount = 4,
+    size_t bucketTriangles = size_t(1) << 20);
+
+// Read-only memory mapping of a chunked mesh file. The header and chunk table stay
+// mapped; chunk geometry is decoded on demand and its pages released again, so the
+// mapping itself does not grow the resident set. read_chunk() is safe to call from
+// several threads at once.
+class ChunkedMeshFile {
+public:
+    ChunkedMeshFile() = default;
+    ~ChunkedMeshFile() { close(); }
+
+    ChunkedMeshFile(const ChunkedMeshFile&) = delete;
+    ChunkedMeshFile& operator=(const ChunkedMeshFile&) = delete;
+
+    bool open(const std::string& path);
+    void close();
+    bool is_open() const { return data != nullptr; }
+
+    int chunk_count() const { return header ? static_cast<int>(header->chunkCount) : 0; }
+    int lod_count() const { return header ? static_cast<int>(header->lodCount) : 0; }
+    const ChunkedMeshHeader& info() const { return *header; }
+    const ChunkRecord& chunk(int i) const { return table[i]; }
+
+    // Size of the decoded Mesh, known without touching the geometry
+    size_t decoded_bytes(int chunk, int lod) const;
+    bool read_chunk(int chunk, int lod, Mesh& out) const;
+
+private:
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    const ChunkedMeshHeader* header = nullptr;
+    const ChunkRecord* table = nullptr;
+};
@@ -1,8 +1,27 @@
 #pragma once
+#include <cstdint>
 
 struct Color {
     unsigned char r, g, b;
 
     Color operator*(float t) const; 
     Color operator+(const Color& other) const;
-};
\ No newline at end of file
+};
+
+// Framebuffer pixel layouts. RGB8 is an array of Color; the packed layouts hold one aligned
+// uint32 per pixel with the channels named in memory order (little-endian) and opaque alpha.
+enum class ColorFormat : uint8_t {
+    RGB8,
+    RGBA8,
+    BGRA8, // what GL_BGRA and most window systems take without swizzling
+};
+
+inline uint32_t pack_color(Color c, ColorFormat format) {
+    if (format == ColorFormat::BGRA8) return 0xFF000000u | uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | c.b;
+    return 0xFF000000u | uint32_t(c.b) << 16 | uint32_t(c.g) << 8 | c.r;
+}
+
+inline Color unpack_color(uint32_t p, ColorFormat format) {
+    unsigned char lo = p & 0xFF, mid = (p >> 8) & 0xFF, hi = (p >> 16) & 0xFF;
+    return format == ColorFormat::BGRA8 ? Color{ hi, mid, lo } : Color{ lo, mid, hi };
+}
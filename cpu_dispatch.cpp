@@ -0,0 +1,61 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "kernels.h"
+
+// One table per object built from kernels.cpp; the x86 variants are only linked on x86-64
+extern const KernelTable kernel_table_generic;
+#if defined(__x86_64__)
+extern const KernelTable kernel_table_sse42;
+extern const KernelTable kernel_table_avx2;
+extern const KernelTable kernel_table_avx512;
+#endif
+
+namespace {
+
+const KernelTable* selected = nullptr;
+
+const KernelTable& detect() {
+    std::vector<const KernelTable*> tables = supported_kernels();
+    const KernelTable* best = tables.back();
+
+    const char* forced = std::getenv("RENDERER_ISA");
+    if (forced && *forced) {
+        bool found = false;
+        for (const KernelTable* table : tables) {
+            if (std::strcmp(table->isa, forced) == 0) {
+                best = table;
+                found = true;
+            }
+        }
+        if (!found) std::cerr << "RENDERER_ISA=" << forced << " is not supported here, using " << best->isa << std::endl;
+    }
+    return *best;
+}
+
+}
+
+std::vector<const KernelTable*> supported_kernels() {
+    std::vector<const KernelTable*> tables = { &kernel_table_generic };
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) tables.push_back(&kernel_table_sse42);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) tables.push_back(&kernel_table_avx2);
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512dq")) {
+        tables.push_back(&kernel_table_avx512);
+    }
+#endif
+    return tables;
+}
+
+const KernelTable& kernels() {
+    // Function-local static: detection runs once, thread-safe, on first use
+    static const KernelTable& detected = detect();
+    return selected ? *selected : detected;
+}
+
+void use_kernels(const KernelTable& table) {
+    selected = &table;
+}
@@ -73,13 +73,13 @@ public:
         return true;
     }
 
-    const std::vector<Face>& get_faces() {
+    const std::vector<Face>& get_faces() const {
         return faces;
     }
-    const std::vector<vec3>& get_normals() {
+    const std::vector<vec3>& get_normals() const {
         return normals;
     }
-    const std::vector<vec3>& get_vertices() {
+    const std::vector<vec3>& get_vertices() const {
         return vertices;
     }
 
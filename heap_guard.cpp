@@ -0,0 +1,91 @@
+#include "heap_guard.h"
+
+#ifdef RENDERER_HEAP_GUARD
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define HEAP_GUARD_BACKTRACE 1
+#endif
+
+namespace {
+
+thread_local int guardDepth = 0;
+thread_local int allowDepth = 0;
+
+void check(size_t size) {
+    if (guardDepth == 0 || allowDepth > 0) return;
+    allowDepth++; // nothing below may recurse into the check
+    std::fprintf(stderr, "heap guard: %zu byte allocation inside a guarded region\n", size);
+#ifdef HEAP_GUARD_BACKTRACE
+    void* frames[64];
+    int count = backtrace(frames, 64);
+    backtrace_symbols_fd(frames, count, 2);
+#endif
+    std::abort();
+}
+
+void* checked_alloc(size_t size) {
+    check(size);
+    void* p = std::malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void* checked_aligned_alloc(size_t size, size_t align) {
+    check(size);
+    void* p = nullptr;
+    if (posix_memalign(&p, align < sizeof(void*) ? sizeof(void*) : align, size ? size : 1) != 0) throw std::bad_alloc();
+    return p;
+}
+
+}
+
+HeapGuard::HeapGuard(bool arm) : active(arm) {
+    if (active) guardDepth++;
+}
+
+HeapGuard::~HeapGuard() {
+    if (active) guardDepth--;
+}
+
+bool HeapGuard::armed() {
+    return guardDepth > 0 && allowDepth == 0;
+}
+
+HeapGuard::Allow::Allow() {
+    allowDepth++;
+}
+
+HeapGuard::Allow::~Allow() {
+    allowDepth--;
+}
+
+// Replacements for the global allocation functions. Deallocation is never checked:
+// freeing memory allocated before the guard was armed is fine.
+void* operator new(size_t size) { return checked_alloc(size); }
+void* operator new[](size_t size) { return checked_alloc(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    try { return checked_alloc(size); } catch (...) { return nullptr; }
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    try { return checked_alloc(size); } catch (...) { return nullptr; }
+}
+void* operator new(size_t size, std::align_val_t align) { return checked_aligned_alloc(size, static_cast<size_t>(align)); }
+void* operator new[](size_t size, std::align_val_t align) { return checked_aligned_alloc(size, static_cast<size_t>(align)); }
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+#endif
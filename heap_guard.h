@@ -0,0 +1,40 @@
+#pragma once
+
+// Debug check that a stretch of code never reaches the global heap. When built with
+// RENDERER_HEAP_GUARD (make HEAP_GUARD=1), operator new is replaced and any allocation
+// made on a thread inside a HeapGuard scope prints a backtrace and aborts. Without the
+// flag every member is an empty inline function.
+//
+// The guard is per thread. Code that fans out to worker threads re-arms them with
+// HeapGuard(HeapGuard::armed()) so the check follows the work.
+class HeapGuard {
+public:
+#ifdef RENDERER_HEAP_GUARD
+    explicit HeapGuard(bool arm = true);
+    ~HeapGuard();
+    static bool armed();
+
+    // Lifts the guard for a known allocating path that is not part of the steady state
+    class Allow {
+    public:
+        Allow();
+        ~Allow();
+    };
+#else
+    explicit HeapGuard(bool = true) {}
+    static bool armed() { return false; }
+
+    class Allow {
+    public:
+        Allow() {}
+    };
+#endif
+
+    HeapGuard(const HeapGuard&) = delete;
+    HeapGuard& operator=(const HeapGuard&) = delete;
+
+#ifdef RENDERER_HEAP_GUARD
+private:
+    bool active;
+#endif
+};
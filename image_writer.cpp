@@ -0,0 +1,461 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+
+#include "image_writer.h"
+#include "kernels.h"
+
+namespace {
+
+void put_u32be(std::vector<uint8_t>& out, uint32_t v) {
+    out.push_back(static_cast<uint8_t>(v >> 24));
+    out.push_back(static_cast<uint8_t>(v >> 16));
+    out.push_back(static_cast<uint8_t>(v >> 8));
+    out.push_back(static_cast<uint8_t>(v));
+}
+
+const std::array<uint32_t, 256>& crc_table() {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t{};
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    return table;
+}
+
+uint32_t crc32(const uint8_t* data, size_t len, uint32_t crc = 0) {
+    const std::array<uint32_t, 256>& table = crc_table();
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t adler32(const uint8_t* data, size_t len) {
+    uint32_t a = 1, b = 0;
+    while (len > 0) {
+        size_t block = std::min<size_t>(len, 5552); // largest run that cannot overflow before the modulo
+        for (size_t i = 0; i < block; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += block;
+        len -= block;
+    }
+    return (b << 16) | a;
+}
+
+void png_chunk(std::vector<uint8_t>& out, const char type[4], const uint8_t* data, size_t len) {
+    put_u32be(out, static_cast<uint32_t>(len));
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + len);
+    put_u32be(out, crc32(&out[start], len + 4));
+}
+
+// LSB-first bit packer for deflate
+struct BitWriter {
+    std::vector<uint8_t>& out;
+    uint32_t bits = 0;
+    int count = 0;
+
+    explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+
+    void put(uint32_t value, int n) {
+        bits |= value << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back(static_cast<uint8_t>(bits));
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+    // Huffman codes are defined MSB-first
+    void put_code(uint32_t code, int n) {
+        uint32_t rev = 0;
+        for (int i = 0; i < n; i++) rev |= ((code >> i) & 1) << (n - 1 - i);
+        put(rev, n);
+    }
+    void finish() {
+        if (count > 0) out.push_back(static_cast<uint8_t>(bits));
+        bits = 0;
+        count = 0;
+    }
+};
+
+void put_literal(BitWriter& bw, int sym) {
+    if (sym < 144) bw.put_code(0x30 + sym, 8);
+    else if (sym < 256) bw.put_code(0x190 + (sym - 144), 9);
+    else if (sym < 280) bw.put_code(sym - 256, 7);
+    else bw.put_code(0xc0 + (sym - 280), 8);
+}
+
+void put_match(BitWriter& bw, int length, int distance) {
+    static const int lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const int lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const int distBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const int distExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+    int l = 28;
+    while (lengthBase[l] > length) l--;
+    put_literal(bw, 257 + l);
+    bw.put(length - lengthBase[l], lengthExtra[l]);
+
+    int d = 29;
+    while (distBase[d] > distance) d--;
+    bw.put_code(d, 5);
+    bw.put(distance - distBase[d], distExtra[d]);
+}
+
+// zlib stream of stored blocks (compress = false) or one fixed-Huffman block fed by a greedy hash-chain-free LZ77
+void zlib_compress(const uint8_t* data, size_t len, bool compress, std::vector<uint8_t>& out) {
+    out.push_back(0x78);
+    out.push_back(0x01);
+
+    if (!compress) {
+        size_t pos = 0;
+        do {
+            size_t block = std::min<size_t>(len - pos, 65535);
+            bool last = pos + block == len;
+            out.push_back(last ? 1 : 0);
+            out.push_back(static_cast<uint8_t>(block));
+            out.push_back(static_cast<uint8_t>(block >> 8));
+            out.push_back(static_cast<uint8_t>(~block));
+            out.push_back(static_cast<uint8_t>(~block >> 8));
+            out.insert(out.end(), data + pos, data + pos + block);
+            pos += block;
+        } while (pos < len);
+    }
+    else {
+        constexpr int HASH_BITS = 15;
+        constexpr size_t WINDOW = 32768;
+        std::vector<int64_t> head(size_t(1) << HASH_BITS, -1); // last position seen for each 3-byte hash
+
+        BitWriter bw(out);
+        bw.put(1, 1); // final block
+        bw.put(1, 2); // fixed Huffman codes
+
+        size_t pos = 0;
+        while (pos < len) {
+            int bestLen = 0;
+            size_t bestDist = 0;
+            if (pos + 3 <= len) {
+                uint32_t h = ((data[pos] << 16) | (data[pos + 1] << 8) | data[pos + 2]) * 2654435761u >> (32 - HASH_BITS);
+                int64_t candidate = head[h];
+                head[h] = static_cast<int64_t>(pos);
+                if (candidate >= 0 && pos - candidate <= WINDOW) {
+                    size_t maxLen = std::min<size_t>(258, len - pos);
+                    size_t n = 0;
+                    while (n < maxLen && data[candidate + n] == data[pos + n]) n++;
+                    if (n >= 3) {
+                        bestLen = static_cast<int>(n);
+                        bestDist = pos - candidate;
+                    }
+                }
+            }
+            if (bestLen > 0) {
+                put_match(bw, bestLen, static_cast<int>(bestDist));
+                pos += bestLen;
+            }
+            else {
+                put_literal(bw, data[pos]);
+                pos++;
+            }
+        }
+        put_literal(bw, 256); // end of block
+        bw.finish();
+    }
+
+    put_u32be(out, adler32(data, len));
+}
+
+void write_file(const std::string& path, const std::vector<uint8_t>& data) {
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs) {
+        std::cerr << "Could not open " << path << " for writing" << std::endl;
+        return;
+    }
+    ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+}
+
+void encode_ppm(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out) {
+    std::string header = "P6\n" + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+    out.insert(out.end(), header.begin(), header.end());
+    out.insert(out.end(), rgb, rgb + size_t(width) * height * 3);
+}
+
+void encode_qoi(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out) {
+    out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+    put_u32be(out, width);
+    put_u32be(out, height);
+    out.push_back(3); // channels
+    out.push_back(0); // sRGB with linear alpha
+
+    uint8_t index[64][4] = {};
+    uint8_t prev[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    size_t count = size_t(width) * height;
+
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t* px = rgb + i * 3;
+        if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+            if (++run == 62 || i + 1 == count) {
+                out.push_back(0xc0 | (run - 1)); // QOI_OP_RUN
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+
+        int slot = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+        if (index[slot][0] == px[0] && index[slot][1] == px[1] && index[slot][2] == px[2] && index[slot][3] == 255) {
+            out.push_back(static_cast<uint8_t>(slot)); // QOI_OP_INDEX
+        }
+        else {
+            index[slot][0] = px[0];
+            index[slot][1] = px[1];
+            index[slot][2] = px[2];
+            index[slot][3] = 255;
+
+            int8_t dr = static_cast<int8_t>(px[0] - prev[0]);
+            int8_t dg = static_cast<int8_t>(px[1] - prev[1]);
+            int8_t db = static_cast<int8_t>(px[2] - prev[2]);
+            int8_t drg = static_cast<int8_t>(dr - dg);
+            int8_t dbg = static_cast<int8_t>(db - dg);
+
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out.push_back(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2)); // QOI_OP_DIFF
+            }
+            else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                out.push_back(0x80 | (dg + 32)); // QOI_OP_LUMA
+                out.push_back(((drg + 8) << 4) | (dbg + 8));
+            }
+            else {
+                out.insert(out.end(), { 0xfe, px[0], px[1], px[2] }); // QOI_OP_RGB
+            }
+        }
+        prev[0] = px[0];
+        prev[1] = px[1];
+        prev[2] = px[2];
+    }
+
+    out.insert(out.end(), { 0, 0, 0, 0, 0, 0, 0, 1 }); // end marker
+}
+
+void encode_png(const uint8_t* rgb, int width, int height, bool compress, std::vector<uint8_t>& out) {
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    out.insert(out.end(), signature, signature + 8);
+
+    std::vector<uint8_t> ihdr;
+    put_u32be(ihdr, width);
+    put_u32be(ihdr, height);
+    ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 }); // 8-bit RGB, deflate, adaptive filtering, no interlace
+    png_chunk(out, "IHDR", ihdr.data(), ihdr.size());
+
+    // Every scanline gets filter type 0 (none)
+    size_t stride = size_t(width) * 3;
+    std::vector<uint8_t> raw((stride + 1) * height);
+    for (int y = 0; y < height; y++) {
+        raw[y * (stride + 1)] = 0;
+        std::memcpy(&raw[y * (stride + 1) + 1], rgb + y * stride, stride);
+    }
+
+    std::vector<uint8_t> idat;
+    idat.reserve(compress ? raw.size() / 4 : raw.size() + raw.size() / 65535 * 5 + 16);
+    zlib_compress(raw.data(), raw.size(), compress, idat);
+    png_chunk(out, "IDAT", idat.data(), idat.size());
+    png_chunk(out, "IEND", nullptr, 0);
+}
+
+void encode_image(ImageFormat format, const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out) {
+    switch (format) {
+    case ImageFormat::PPM:
+        encode_ppm(rgb, width, height, out);
+        break;
+    case ImageFormat::QOI:
+        encode_qoi(rgb, width, height, out);
+        break;
+    case ImageFormat::PNG:
+        encode_png(rgb, width, height, false, out);
+        break;
+    case ImageFormat::PNG_FAST:
+        encode_png(rgb, width, height, true, out);
+        break;
+    }
+}
+
+ImageFormat format_from_path(const std::string& path) {
+    auto ends_with = [&](const char* ext) {
+        size_t n = std::strlen(ext);
+        return path.size() >= n && path.compare(path.size() - n, n, ext) == 0;
+    };
+    if (ends_with(".qoi")) return ImageFormat::QOI;
+    if (ends_with(".png")) return ImageFormat::PNG_FAST;
+    return ImageFormat::PPM;
+}
+
+void depth_to_rgb(const float* zbuffer, size_t count, uint8_t* rgb) {
+    kernels().depth_to_rgb(zbuffer, count, rgb);
+}
+
+OutputQueue::OutputQueue(size_t capacity) : capacity(capacity), jobs(capacity), writer([this] {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        cv.wait(lock, [this] { return stopping || queued > 0; });
+        if (queued == 0) return; // stopping and drained
+        std::function<void()> job = std::move(jobs[head]);
+        jobs[head] = nullptr;
+        head = (head + 1) % this->capacity;
+        queued--;
+        busy = true;
+        cv.notify_all(); // a slot is free
+        lock.unlock();
+        job();
+        lock.lock();
+        busy = false;
+        cv.notify_all();
+    }
+}) {}
+
+OutputQueue::~OutputQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    writer.join();
+}
+
+void OutputQueue::push(std::function<void()> job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return queued < capacity; });
+    jobs[(head + queued) % capacity] = std::move(job);
+    queued++;
+    cv.notify_all();
+}
+
+void OutputQueue::flush() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return queued == 0 && !busy; });
+}
+
+void ImageWriter::write(const std::string& path, const Color* pixels, int width, int height) {
+    write(path, format_from_path(path), pixels, width, height);
+}
+
+void ImageWriter::write(const std::string& path, ImageFormat format, const Color* pixels, int width, int height) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(pixels);
+    std::vector<uint8_t> rgb(bytes, bytes + size_t(width) * height * sizeof(Color));
+    queue.push([path, format, width, height, rgb = std::move(rgb)] {
+        std::vector<uint8_t> encoded;
+        encode_image(format, rgb.data(), width, height, encoded);
+        write_file(path, encoded);
+    });
+}
+
+void ImageWriter::write_depth(const std::string& path, const float* zbuffer, int width, int height) {
+    std::vector<float> depth(zbuffer, zbuffer + size_t(width) * height);
+    ImageFormat format = format_from_path(path);
+    queue.push([path, format, width, height, depth = std::move(depth)] {
+        std::vector<uint8_t> rgb(depth.size() * 3);
+        depth_to_rgb(depth.data(), depth.size(), rgb.data());
+        std::vector<uint8_t> encoded;
+        encode_image(format, rgb.data(), width, height, encoded);
+        write_file(path, encoded);
+    });
+}
+
+bool VideoWriter::open(const std::string& path, int width, int height, int fps, Format format) {
+    close();
+    file.open(path, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Could not open " << path << " for writing" << std::endl;
+        return false;
+    }
+    this->width = width;
+    this->height = height;
+    this->format = format;
+    this->frames = 0;
+    this->opened = true;
+
+    size_t frameBytes = size_t(width) * height * sizeof(Color);
+    this->framePool.assign(this->poolSize, std::vector<uint8_t>(frameBytes));
+    this->freeFrames.clear();
+    for (std::vector<uint8_t>& frame : this->framePool) this->freeFrames.push_back(&frame);
+    this->yuv.resize(format == Format::Y4M ? size_t(width) * height * 3 : 0);
+    if (format == Format::Y4M) {
+        file << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C444 XCOLORRANGE=LIMITED\n";
+    }
+    return true;
+}
+
+void VideoWriter::add_frame(const Color* pixels) {
+    if (!opened) return;
+    std::vector<uint8_t>* rgb = acquire_frame();
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(pixels);
+    std::copy(bytes, bytes + rgb->size(), rgb->data());
+    submit_frame(rgb);
+}
+
+void VideoWriter::add_frame(const uint32_t* pixels, ColorFormat pixelFormat) {
+    if (!opened) return;
+    std::vector<uint8_t>* rgb = acquire_frame();
+    Color* out = reinterpret_cast<Color*>(rgb->data());
+    for (size_t i = 0; i < size_t(width) * height; i++) out[i] = unpack_color(pixels[i], pixelFormat);
+    submit_frame(rgb);
+}
+
+std::vector<uint8_t>* VideoWriter::acquire_frame() {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    std::vector<uint8_t>* rgb = freeFrames.back(); // never empty, see poolSize
+    freeFrames.pop_back();
+    return rgb;
+}
+
+void VideoWriter::submit_frame(std::vector<uint8_t>* rgb) {
+    frames++;
+
+    // Two pointers fit std::function's inline storage, so the job itself does not allocate either
+    queue.push([this, rgb] {
+        if (format == Format::RAW) {
+            file.write(reinterpret_cast<const char*>(rgb->data()), rgb->size());
+        }
+        else {
+            // Limited-range BT.601 (Y 16-235, Cb and Cr 16-240), what players assume for Y4M,
+            // in 8.8 fixed point with the offsets folded in so every sum stays non-negative
+            size_t count = size_t(width) * height;
+            const uint8_t* src = rgb->data();
+            uint8_t* Y = yuv.data();
+            uint8_t* U = Y + count;
+            uint8_t* V = U + count;
+            for (size_t i = 0; i < count; i++) {
+                int r = src[i * 3], g = src[i * 3 + 1], b = src[i * 3 + 2];
+                Y[i] = static_cast<uint8_t>((66 * r + 129 * g + 25 * b + 4224) >> 8);
+                U[i] = static_cast<uint8_t>((-38 * r - 74 * g + 112 * b + 32896) >> 8);
+                V[i] = static_cast<uint8_t>((112 * r - 94 * g - 18 * b + 32896) >> 8);
+            }
+            file << "FRAME\n";
+            file.write(reinterpret_cast<const char*>(yuv.data()), yuv.size());
+        }
+        std::lock_guard<std::mutex> lock(poolMutex);
+        freeFrames.push_back(rgb);
+    });
+}
+
+void VideoWriter::close() {
+    if (!opened) return;
+    queue.flush();
+    file.close();
+    opened = false;
+}
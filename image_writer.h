@@ -0,0 +1,103 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "color.h"
+
+enum class ImageFormat {
+    PPM,
+    QOI,
+    PNG,       // stored (uncompressed) deflate blocks, the fastest to write
+    PNG_FAST,  // single-pass LZ77 with fixed Huffman codes
+};
+
+// Encoders take tightly packed 8-bit RGB rows and append the encoded file to out
+void encode_ppm(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out);
+void encode_qoi(const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out);
+void encode_png(const uint8_t* rgb, int width, int height, bool compress, std::vector<uint8_t>& out);
+void encode_image(ImageFormat format, const uint8_t* rgb, int width, int height, std::vector<uint8_t>& out);
+ImageFormat format_from_path(const std::string& path); // by extension, PPM when unknown
+
+// Maps drawn depths to gray levels, nearest = white; pixels never written stay black.
+// One vectorizable reduction finds the depth range, one pass writes RGB straight into rgb.
+void depth_to_rgb(const float* zbuffer, size_t count, uint8_t* rgb);
+
+// Bounded FIFO drained by a single writer thread. push() blocks while the queue is full,
+// so a slow disk applies back-pressure instead of buffering frames without limit.
+class OutputQueue {
+public:
+    explicit OutputQueue(size_t capacity = 4);
+    ~OutputQueue();
+
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue& operator=(const OutputQueue&) = delete;
+
+    void push(std::function<void()> job);
+    void flush(); // returns once every queued job has run
+
+private:
+    size_t capacity;
+    std::vector<std::function<void()>> jobs; // ring buffer, so a steady stream of pushes never allocates
+    size_t head = 0, queued = 0;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool busy = false;
+    bool stopping = false;
+    std::thread writer;
+};
+
+// Writes still images in the background. The pixels are copied before write() returns.
+class ImageWriter {
+public:
+    explicit ImageWriter(size_t capacity = 4) : queue(capacity) {}
+
+    void write(const std::string& path, const Color* pixels, int width, int height);
+    void write(const std::string& path, ImageFormat format, const Color* pixels, int width, int height);
+    void write_depth(const std::string& path, const float* zbuffer, int width, int height);
+    void flush() { queue.flush(); }
+
+private:
+    OutputQueue queue;
+};
+
+// Streams a frame sequence to a single file, either as Y4M (4:4:4, playable by
+// ffmpeg/mpv) or as headerless rgb24 frames.
+class VideoWriter {
+public:
+    enum class Format { Y4M, RAW };
+
+    explicit VideoWriter(size_t capacity = 8) : queue(capacity), poolSize(capacity + 2) {}
+    ~VideoWriter() { close(); }
+
+    bool open(const std::string& path, int width, int height, int fps, Format format);
+    void add_frame(const Color* pixels);
+    void add_frame(const uint32_t* pixels, ColorFormat pixelFormat); // RGBA8 or BGRA8, converted while copying
+    void close();
+    bool is_open() const { return opened; }
+    int frame_count() const { return frames; }
+
+private:
+    OutputQueue queue;
+    std::ofstream file;
+    int width = 0, height = 0;
+    Format format = Format::Y4M;
+    bool opened = false;
+    int frames = 0;
+
+    // Frame copies are recycled once written, so a recording does not allocate per frame.
+    // poolSize covers a full queue, the frame being written and the one being filled.
+    size_t poolSize;
+    std::vector<std::vector<uint8_t>> framePool;
+    std::vector<std::vector<uint8_t>*> freeFrames;
+    std::mutex poolMutex;
+    std::vector<uint8_t> yuv; // Y4M conversion scratch, only touched by the writer thread
+
+    std::vector<uint8_t>* acquire_frame();
+    void submit_frame(std::vector<uint8_t>* rgb);
+};
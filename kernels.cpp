@@ -0,0 +1,222 @@
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+#include "kernels.h"
+
+// Built once per ISA by the Makefile with -DKERNEL_ISA=<name> and matching -m flags.
+// Only C library calls and file-local helpers are used here: an inline function from
+// a shared header could be emitted as a weak symbol carrying AVX-512 code and then
+// picked by the linker for the generic callers too.
+
+#ifndef KERNEL_ISA
+#define KERNEL_ISA generic
+#endif
+
+#define KERNEL_CONCAT2(a, b) a##b
+#define KERNEL_CONCAT(a, b) KERNEL_CONCAT2(a, b)
+#define KERNEL_STRING2(a) #a
+#define KERNEL_STRING(a) KERNEL_STRING2(a)
+
+namespace {
+
+inline float min_f(float a, float b) { return b < a ? b : a; }
+inline float max_f(float a, float b) { return a < b ? b : a; }
+
+inline float rsqrt_fast(float x) {
+    uint32_t i;
+    std::memcpy(&i, &x, sizeof(i));
+    i = 0x5f3759df - (i >> 1);
+    float y;
+    std::memcpy(&y, &i, sizeof(y));
+    return y * (1.5f - 0.5f * x * y * y);
+}
+
+// Lighting shared by both Phong entry points, from positions and normals per lane
+void phong_lighting(const PhongKernelInput& in, const float p[3][KERNEL_BATCH_SIZE], const float n[3][KERNEL_BATCH_SIZE], float intensity[KERNEL_BATCH_SIZE]) {
+    constexpr int N = KERNEL_BATCH_SIZE;
+    float l[3][N], v[3][N];
+
+    // Every loop below runs over all lanes with no branches so the compiler can vectorize it;
+    // lanes outside the mask carry harmless values and are simply not written back.
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < N; i++) {
+            l[c][i] = in.light[c] - p[c][i];
+            v[c][i] = in.eye[c] - p[c][i];
+        }
+    }
+
+    float invL[N], invV[N];
+    for (int i = 0; i < N; i++) {
+        float ll = l[0][i] * l[0][i] + l[1][i] * l[1][i] + l[2][i] * l[2][i];
+        float vv = v[0][i] * v[0][i] + v[1][i] * v[1][i] + v[2][i] * v[2][i];
+        invL[i] = in.fastRsqrt ? rsqrt_fast(ll) : 1.0f / sqrtf(ll);
+        invV[i] = in.fastRsqrt ? rsqrt_fast(vv) : 1.0f / sqrtf(vv);
+    }
+
+    float specBase[N];
+    for (int i = 0; i < N; i++) {
+        float nl = (n[0][i] * l[0][i] + n[1][i] * l[1][i] + n[2][i] * l[2][i]) * invL[i];
+        float nv = (n[0][i] * v[0][i] + n[1][i] * v[1][i] + n[2][i] * v[2][i]) * invV[i];
+        float lv = (l[0][i] * v[0][i] + l[1][i] * v[1][i] + l[2][i] * v[2][i]) * invL[i] * invV[i];
+        // dot(viewDir, reflect(-lightDir, normal)) expanded, so the reflected vector is never formed
+        float vr = 2.0f * nl * nv - lv;
+        intensity[i] = 0.1f + max_f(nl, 0.0f);
+        specBase[i] = max_f(vr, 0.0f);
+    }
+
+    if (in.specTable) {
+        const float* table = in.specTable;
+        int size = in.specTableSize;
+        for (int i = 0; i < N; i++) {
+            float f = min_f(specBase[i], 1.0f) * size;
+            int idx = static_cast<int>(f);
+            idx = idx < size - 1 ? idx : size - 1;
+            intensity[i] += table[idx] + (f - idx) * (table[idx + 1] - table[idx]);
+        }
+    }
+    else {
+        for (int i = 0; i < N; i++) intensity[i] += powf(specBase[i], in.shininess);
+    }
+}
+
+void phong_intensity(const PhongKernelInput& in, float intensity[KERNEL_BATCH_SIZE]) {
+    constexpr int N = KERNEL_BATCH_SIZE;
+    float b[3][N], p[3][N], n[3][N];
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < N; i++) b[k][i] = static_cast<float>(in.bar[k][i]);
+    }
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < N; i++) {
+            p[c][i] = b[0][i] * in.pos[0][c] + b[1][i] * in.pos[1][c] + b[2][i] * in.pos[2][c];
+            n[c][i] = b[0][i] * in.norm[0][c] + b[1][i] * in.norm[1][c] + b[2][i] * in.norm[2][c];
+        }
+    }
+    phong_lighting(in, p, n, intensity);
+}
+
+void phong_intensity_interpolated(const PhongKernelInput& in, const float pos[3][KERNEL_BATCH_SIZE], const float norm[3][KERNEL_BATCH_SIZE], float intensity[KERNEL_BATCH_SIZE]) {
+    phong_lighting(in, pos, norm, intensity);
+}
+
+// One light's contribution to a block, added to intensity. Kept out of line: inside the
+// light loop GCC unrolls the lane loops before it gets to vectorize them.
+struct LightBlock {
+    float p[3][KERNEL_BATCH_SIZE], n[3][KERNEL_BATCH_SIZE];
+    float v[3][KERNEL_BATCH_SIZE]; // unit vector to the eye
+    float nv[KERNEL_BATCH_SIZE];
+    float intensity[KERNEL_BATCH_SIZE];
+};
+
+__attribute__((noinline)) void add_point_light(const PointLightKernelInput& in, uint32_t light, LightBlock& block) {
+    constexpr int N = KERNEL_BATCH_SIZE;
+    float lx = in.lightX[light], ly = in.lightY[light], lz = in.lightZ[light];
+    float invR2 = in.lightInvRadius2[light], strength = in.lightIntensity[light];
+
+    float l[3][N], ll[N], weight[N];
+    for (int i = 0; i < N; i++) {
+        l[0][i] = lx - block.p[0][i];
+        l[1][i] = ly - block.p[1][i];
+        l[2][i] = lz - block.p[2][i];
+        ll[i] = max_f(l[0][i] * l[0][i] + l[1][i] * l[1][i] + l[2][i] * l[2][i], 1e-12f); // a light exactly on the surface adds nothing instead of NaN
+        float falloff = max_f(1.0f - ll[i] * invR2, 0.0f);
+        weight[i] = strength * falloff * falloff;
+    }
+    // Clusters are conservative, so many of their lights end short of the whole block
+    float reach = 0.0f;
+    for (int i = 0; i < N; i++) reach = max_f(reach, weight[i]);
+    if (reach == 0.0f) return;
+
+    float specBase[N];
+    for (int i = 0; i < N; i++) {
+        float invL = 1.0f / sqrtf(ll[i]);
+        float nl = (block.n[0][i] * l[0][i] + block.n[1][i] * l[1][i] + block.n[2][i] * l[2][i]) * invL;
+        float lv = (l[0][i] * block.v[0][i] + l[1][i] * block.v[1][i] + l[2][i] * block.v[2][i]) * invL;
+        block.intensity[i] += weight[i] * max_f(nl, 0.0f);
+        specBase[i] = max_f(2.0f * nl * block.nv[i] - lv, 0.0f);
+    }
+
+    if (in.specTable) {
+        const float* table = in.specTable;
+        int size = in.specTableSize;
+        for (int i = 0; i < N; i++) {
+            float f = min_f(specBase[i], 1.0f) * size;
+            int idx = static_cast<int>(f);
+            idx = idx < size - 1 ? idx : size - 1;
+            block.intensity[i] += weight[i] * (table[idx] + (f - idx) * (table[idx + 1] - table[idx]));
+        }
+    }
+    else {
+        for (int i = 0; i < N; i++) {
+            if (weight[i] > 0.0f) block.intensity[i] += weight[i] * powf(specBase[i], in.shininess); // powf is a call per lane anyway
+        }
+    }
+}
+
+void point_lights_intensity(const PointLightKernelInput& in, float intensity[KERNEL_BATCH_SIZE]) {
+    constexpr int N = KERNEL_BATCH_SIZE;
+    float b[3][N];
+    LightBlock block;
+
+    for (int k = 0; k < 3; k++) {
+        for (int i = 0; i < N; i++) b[k][i] = static_cast<float>(in.bar[k][i]);
+    }
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < N; i++) {
+            block.p[c][i] = b[0][i] * in.pos[0][c] + b[1][i] * in.pos[1][c] + b[2][i] * in.pos[2][c];
+            block.n[c][i] = b[0][i] * in.norm[0][c] + b[1][i] * in.norm[1][c] + b[2][i] * in.norm[2][c];
+            block.v[c][i] = in.eye[c] - block.p[c][i];
+        }
+    }
+
+    // What does not depend on the light is computed once
+    for (int i = 0; i < N; i++) {
+        float invV = 1.0f / sqrtf(block.v[0][i] * block.v[0][i] + block.v[1][i] * block.v[1][i] + block.v[2][i] * block.v[2][i]);
+        for (int c = 0; c < 3; c++) block.v[c][i] *= invV;
+        block.nv[i] = block.n[0][i] * block.v[0][i] + block.n[1][i] * block.v[1][i] + block.n[2][i] * block.v[2][i];
+        block.intensity[i] = 0.0f;
+    }
+
+    for (int k = 0; k < in.lightCount; k++) add_point_light(in, in.lights[k], block);
+    for (int i = 0; i < N; i++) intensity[i] = block.intensity[i];
+}
+
+void depth_to_rgb(const float* zbuffer, size_t count, uint8_t* rgb) {
+    const float empty = -FLT_MAX + 1e-6f; // anything at or below was never drawn
+
+    float min_depth = FLT_MAX;
+    float max_depth = -FLT_MAX;
+    for (size_t i = 0; i < count; i++) {
+        float z = zbuffer[i];
+        bool drawn = z > empty;
+        min_depth = min_f(min_depth, drawn ? z : FLT_MAX);
+        max_depth = max_f(max_depth, drawn ? z : -FLT_MAX);
+    }
+
+    if (max_depth <= min_depth) {
+        min_depth = 0.0f;
+        max_depth = 1.0f;
+    }
+
+    float depth_range = max_depth - min_depth;
+    if (depth_range < 1e-6) depth_range = 1.0f;
+
+    for (size_t i = 0; i < count; i++) {
+        float z = zbuffer[i];
+        float normalized = (z - min_depth) / depth_range;
+        uint8_t gray = static_cast<uint8_t>(z > empty ? normalized * 255.0f : 0.0f);
+        rgb[i * 3 + 0] = gray;
+        rgb[i * 3 + 1] = gray;
+        rgb[i * 3 + 2] = gray;
+    }
+}
+
+}
+
+extern const KernelTable KERNEL_CONCAT(kernel_table_, KERNEL_ISA) = {
+    KERNEL_STRING(KERNEL_ISA),
+    phong_intensity,
+    phong_intensity_interpolated,
+    point_lights_intensity,
+    depth_to_rgb,
+};
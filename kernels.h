@@ -0,0 +1,54 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Hot loops compiled once per instruction set from kernels.cpp and picked at startup
+// by CPUID. This header stays free of the rest of the renderer so that no inline
+// code from other headers gets instantiated with wider instructions than the CPU has.
+
+constexpr int KERNEL_BATCH_SIZE = 8; // must match Pipeline::BATCH_SIZE
+
+// One triangle's lighting setup plus a block of barycentrics
+struct PhongKernelInput {
+    const double (*bar)[KERNEL_BATCH_SIZE];
+    float pos[3][3], norm[3][3];
+    float eye[3], light[3];
+    float shininess;
+    const float* specTable; // nullptr = exact powf(), else specTableSize + 1 samples over [0, 1]
+    int specTableSize;
+    bool fastRsqrt;
+};
+
+// One triangle's setup plus a list of point lights in structure-of-arrays form. Each light
+// adds intensity * (1 - d^2 / radius^2)^2 * (diffuse + specular), zero past its radius.
+struct PointLightKernelInput {
+    const double (*bar)[KERNEL_BATCH_SIZE];
+    float pos[3][3], norm[3][3];
+    float eye[3];
+    float shininess;
+    const float* specTable; // as in PhongKernelInput
+    int specTableSize;
+    const float *lightX, *lightY, *lightZ, *lightInvRadius2, *lightIntensity;
+    const uint32_t* lights; // indices into the arrays above
+    int lightCount;
+};
+
+struct KernelTable {
+    const char* isa;
+    void (*phong_intensity)(const PhongKernelInput& in, float intensity[KERNEL_BATCH_SIZE]);
+    // The same lighting for positions and normals already interpolated per lane; in's bar, pos and norm are unused
+    void (*phong_intensity_interpolated)(const PhongKernelInput& in, const float pos[3][KERNEL_BATCH_SIZE], const float norm[3][KERNEL_BATCH_SIZE], float intensity[KERNEL_BATCH_SIZE]);
+    // Sum of the lights' contributions, without ambient
+    void (*point_lights_intensity)(const PointLightKernelInput& in, float intensity[KERNEL_BATCH_SIZE]);
+    void (*depth_to_rgb)(const float* zbuffer, size_t count, uint8_t* rgb);
+};
+
+// Best table for this CPU; RENDERER_ISA=<name> in the environment forces a supported one
+const KernelTable& kernels();
+
+// Every table this CPU can run, generic first
+std::vector<const KernelTable*> supported_kernels();
+
+// Override the selection, e.g. to compare ISAs. Not safe while other threads render.
+void use_kernels(const KernelTable& table);
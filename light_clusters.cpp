@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "heap_guard.h"
+#include "light_clusters.h"
+
+void LightClusters::set_depth_range(double nearDistance, double farDistance) {
+    this->nearDistance = nearDistance;
+    this->farDistance = farDistance;
+}
+
+int LightClusters::slice_of(double distance) const {
+    if (distance <= this->sliceNear) return 0;
+    double s = std::log(distance / this->sliceNear) * this->sliceScale;
+    return s >= DEPTH_SLICES - 1 ? DEPTH_SLICES - 1 : static_cast<int>(s);
+}
+
+double LightClusters::view_distance(const vec3& p) const {
+    // The eye sits at view z = f, looking down -z
+    vec4 v = this->modelView * vec4{ p.x, p.y, p.z, 1.0 };
+    return this->focal - v.z;
+}
+
+int LightClusters::cluster_at(int x, int y, double distance) const {
+    int tx = std::clamp(x / TILE_SIZE, 0, this->tilesX - 1);
+    int ty = std::clamp(y / TILE_SIZE, 0, this->tilesY - 1);
+    return cluster_index(tx, ty, slice_of(distance));
+}
+
+LightClusters::LightBounds LightClusters::bound_light(const PointLight& light, const Pipeline& pipeline) const {
+    const LightBounds offScreen{ 0, -1, 0, -1, 0, -1 };
+    vec4 c = this->modelView * vec4{ light.position.x, light.position.y, light.position.z, 1.0 };
+    double r = light.radius;
+    double nearest = this->focal - c.z - r, farthest = this->focal - c.z + r;
+    if (farthest <= 0) return offScreen; // entirely behind the eye
+
+    LightBounds b{ 0, this->tilesX - 1, 0, this->tilesY - 1, slice_of(nearest), slice_of(farthest) };
+    if (nearest <= this->focal * 1e-3) return b; // the sphere reaches the eye and may cover the whole screen
+
+    // The sphere projects inside the hull of its bounding box's corners, all in front of the eye
+    mat<4, 4> toScreen = pipeline.get_viewport() * pipeline.get_perspective();
+    double x0 = INFINITY, x1 = -INFINITY, y0 = INFINITY, y1 = -INFINITY;
+    for (int i = 0; i < 8; i++) {
+        vec4 corner{ c.x + ((i & 1) ? r : -r), c.y + ((i & 2) ? r : -r), c.z + ((i & 4) ? r : -r), 1.0 };
+        vec4 s = toScreen * corner;
+        x0 = std::min(x0, s.x / s.w);
+        x1 = std::max(x1, s.x / s.w);
+        y0 = std::min(y0, s.y / s.w);
+        y1 = std::max(y1, s.y / s.w);
+    }
+    int width = pipeline.get_width(), height = pipeline.get_height();
+    if (x1 < 0 || y1 < 0 || x0 >= width || y0 >= height) return offScreen;
+    // Clamped in double first so far off-screen corners never overflow the int conversion
+    b.tx0 = static_cast<int>(std::max(x0, 0.0)) / TILE_SIZE;
+    b.tx1 = static_cast<int>(std::min(x1, width - 1.0)) / TILE_SIZE;
+    b.ty0 = static_cast<int>(std::max(y0, 0.0)) / TILE_SIZE;
+    b.ty1 = static_cast<int>(std::min(y1, height - 1.0)) / TILE_SIZE;
+    return b;
+}
+
+void LightClusters::build(const Pipeline& pipeline, const std::vector<PointLight>& lights) {
+    auto start = std::chrono::steady_clock::now();
+
+    this->tilesX = (pipeline.get_width() + TILE_SIZE - 1) / TILE_SIZE;
+    this->tilesY = (pipeline.get_height() + TILE_SIZE - 1) / TILE_SIZE;
+    this->modelView = pipeline.get_modelview();
+    this->focal = -1 / pipeline.get_perspective()(3, 2);
+    double nearSlice = this->nearDistance > 0 ? this->nearDistance : this->focal / 16;
+    double farSlice = this->farDistance > nearSlice ? this->farDistance : this->focal * 16;
+    this->sliceNear = nearSlice;
+    this->sliceScale = DEPTH_SLICES / std::log(farSlice / nearSlice);
+
+    int count = static_cast<int>(lights.size());
+    int clusters = this->tilesX * this->tilesY * DEPTH_SLICES;
+    int rows = this->tilesY * DEPTH_SLICES;
+    if (this->source.size() != lights.size() || this->offsets.size() != size_t(clusters) + 1) {
+        HeapGuard::Allow allow; // a new light count or screen size; the same scene again allocates nothing
+        this->source.resize(count);
+        for (std::vector<float>* v : { &data.x, &data.y, &data.z, &data.invRadius2, &data.intensity }) v->resize(count);
+        this->bounds.resize(count);
+        this->offsets.resize(clusters + 1);
+        this->cursor.resize(clusters);
+    }
+    std::copy(lights.begin(), lights.end(), this->source.begin());
+
+    const bool guarded = HeapGuard::armed();
+#pragma omp parallel for schedule(static)
+    for (int i = 0; i < count; i++) {
+        HeapGuard guard(guarded);
+        const PointLight& light = lights[i];
+        this->data.x[i] = static_cast<float>(light.position.x);
+        this->data.y[i] = static_cast<float>(light.position.y);
+        this->data.z[i] = static_cast<float>(light.position.z);
+        this->data.invRadius2[i] = static_cast<float>(1 / (light.radius * light.radius));
+        this->data.intensity[i] = static_cast<float>(light.intensity);
+        this->bounds[i] = bound_light(light, pipeline);
+    }
+
+    // Each (slice, tile row) owns tilesX consecutive clusters; counts go one slot up for the prefix sum
+    std::fill(this->offsets.begin(), this->offsets.end(), 0);
+    auto for_each_hit = [&](int row, auto&& visit) {
+        int slice = row / this->tilesY, ty = row % this->tilesY;
+        for (int i = 0; i < count; i++) {
+            const LightBounds& b = this->bounds[i];
+            if (ty < b.ty0 || ty > b.ty1 || slice < b.slice0 || slice > b.slice1) continue;
+            for (int tx = b.tx0; tx <= b.tx1; tx++) visit(cluster_index(tx, ty, slice), i);
+        }
+    };
+#pragma omp parallel for schedule(dynamic, 4)
+    for (int row = 0; row < rows; row++) {
+        HeapGuard guard(guarded);
+        for_each_hit(row, [&](int cluster, int) { this->offsets[cluster + 1]++; });
+    }
+
+    Stats stats;
+    for (int c = 0; c < clusters; c++) {
+        uint32_t n = this->offsets[c + 1];
+        stats.occupiedClusters += n > 0;
+        stats.maxLights = std::max(stats.maxLights, static_cast<int>(n));
+        this->offsets[c + 1] += this->offsets[c];
+    }
+    size_t references = this->offsets[clusters];
+    if (references > this->indices.capacity()) {
+        HeapGuard::Allow allow; // more overlap than any frame so far, e.g. the camera moved into the lights
+        this->indices.reserve(references + references / 2);
+    }
+    this->indices.resize(references);
+
+    // Same walk, now writing; within a cluster the lights stay in input order
+    std::copy(this->offsets.begin(), this->offsets.end() - 1, this->cursor.begin());
+#pragma omp parallel for schedule(dynamic, 4)
+    for (int row = 0; row < rows; row++) {
+        HeapGuard guard(guarded);
+        for_each_hit(row, [&](int cluster, int light) { this->indices[this->cursor[cluster]++] = static_cast<uint32_t>(light); });
+    }
+
+    for (int i = 0; i < count; i++) stats.visibleLights += this->bounds[i].tx0 <= this->bounds[i].tx1;
+    stats.lights = count;
+    stats.clusters = clusters;
+    stats.references = references;
+    stats.buildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    this->frameStats = stats;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+#include "geometry.h"
+#include "pipeline.h"
+
+// A point light whose contribution falls smoothly to exactly zero at radius, so a
+// fragment only needs the lights whose sphere it lies in.
+struct PointLight {
+    vec3 position; // world space, like the shader's positions
+    double radius;
+    double intensity;
+};
+
+// Assigns point lights to clusters, the cells of a grid of TILE_SIZE screen tiles times
+// DEPTH_SLICES slices of view depth, once per frame. Slices are spaced exponentially
+// between the near and far distances so they stay about as deep as they are wide.
+//
+// build() first bounds every light in tiles and slices, then fills the clusters in
+// parallel over (slice, tile row) pairs: every pair owns its clusters, so the lists come
+// out in light order whatever the thread count. A cluster's lights are a range of one
+// shared index array.
+class LightClusters {
+public:
+    static constexpr int TILE_SIZE = Pipeline::TILE_SIZE; // the same tiles the pipeline tracks
+    static constexpr int DEPTH_SLICES = 16;
+
+    // Distances from the eye the slices span; 0 derives them from the perspective's focal
+    // length like Pipeline::set_depth_range() does (f / 16 and 16 f). Fragments outside
+    // fall into the first or last slice.
+    void set_depth_range(double nearDistance, double farDistance);
+
+    // Uses the pipeline's current camera and viewport
+    void build(const Pipeline& pipeline, const std::vector<PointLight>& lights);
+
+    int cluster_at(int x, int y, double distance) const; // screen x, y (y up) and distance along the view axis
+    double view_distance(const vec3& p) const;           // of a world-space point, for cluster_at()
+
+    // The lights of one cluster as indices into light_data()
+    const uint32_t* cluster_lights(int cluster, int& count) const {
+        count = static_cast<int>(offsets[cluster + 1] - offsets[cluster]);
+        return indices.data() + offsets[cluster];
+    }
+
+    // Lights in structure-of-arrays float form for the batch kernel
+    struct LightData {
+        std::vector<float> x, y, z;
+        std::vector<float> invRadius2; // 1 / radius^2
+        std::vector<float> intensity;
+    };
+    const LightData& light_data() const { return data; }
+    const std::vector<PointLight>& lights() const { return source; }
+
+    struct Stats {
+        int lights = 0;
+        int visibleLights = 0;    // assigned to at least one cluster
+        int clusters = 0;
+        int occupiedClusters = 0; // with at least one light
+        int maxLights = 0;        // in the fullest cluster
+        size_t references = 0;    // total entries over all clusters
+        double buildMs = 0;
+    };
+    const Stats& stats() const { return frameStats; }
+
+private:
+    struct LightBounds {
+        int tx0, tx1, ty0, ty1, slice0, slice1; // inclusive, tx0 > tx1 when off screen
+    };
+
+    int tilesX = 0, tilesY = 0;
+    double nearDistance = 0, farDistance = 0;
+    double sliceNear = 1, sliceScale = 1; // slice = log(distance / sliceNear) * sliceScale
+    double focal = 1;
+    mat<4, 4> modelView;
+
+    std::vector<PointLight> source;
+    LightData data;
+    std::vector<LightBounds> bounds;
+    std::vector<uint32_t> offsets; // clusters + 1 entries
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> cursor;  // next free entry of each cluster while filling
+    Stats frameStats;
+
+    int slice_of(double distance) const;
+    LightBounds bound_light(const PointLight& light, const Pipeline& pipeline) const;
+    int cluster_index(int tx, int ty, int slice) const { return (slice * tilesY + ty) * tilesX + tx; }
+};
@@ -1,12 +1,19 @@
 #include <algorithm>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <limits>
+#include <random>
 #include <sstream>
 #include <vector>
 
+#ifdef __APPLE__
 #include <OpenGL/gl.h>
+#else
+#include <GL/gl.h>
+#endif
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
 
@@ -14,114 +21,53 @@
 #include "imgui/backends/imgui_impl_glfw.h"
 #include "imgui/backends/imgui_impl_opengl2.h"
 
+#include "bvh.h"
+#include "chunked_mesh.h"
 #include "color.h"
 #include "file_parser.h"
+#include "heap_guard.h"
+#include "image_writer.h"
+#include "kernels.h"
+#include "light_clusters.h"
+#include "mesh.h"
+#include "mesh_loader.h"
+#include "mesh_streamer.h"
 #include "pipeline.h"
+#include "regression.h"
+#include "render_cluster.h"
+#include "render_server.h"
+#include "renderer.h"
+#include "shader.h"
+#include "thread_pool.h"
 
 constexpr int width = 800;
 constexpr int height = 800;
 
-constexpr Color white = { 255, 255, 255 }; // attention, BGRA order
+constexpr Color white = { 255, 255, 255 };
 constexpr Color green = { 0, 255, 0 };
 constexpr Color red = { 255, 0, 0 };
 constexpr Color blue = { 64, 128, 255 };
 constexpr Color yellow = { 255, 200, 0 };
 
-struct Shader : Pipeline::IShader {
-    std::vector<vec3> vertices;
-    std::vector<vec3> normals;
-    Color color;
-    vec3 tri_pos[3];
-    vec3 tri_norm[3];
-    vec3 eye;
-    vec3 lightPos;
-
-    Shader(const std::vector<vec3>& vertices) : vertices(vertices) {}
-
-    Pipeline::VertexOutput vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) override {
-        // Transform vertex to clip space
-        vec4 clipPos = perspective * modelview * vec4{ v.x, v.y, v.z, 1.0 };
-
-        // Transform normal by inverse transpose
-        vec4 normalTransformed = normalMatrix * vec4{ n.x, n.y, n.z, 0.0 };
-        vec3 normalVec = normalize(vec3{ normalTransformed.x, normalTransformed.y, normalTransformed.z });
-
-        // Return all outputs
-        Pipeline::VertexOutput output;
-        output.clipPos = clipPos;
-        output.worldPos = v;  // Store world-space position (after model rotation, before ModelView)
-        output.normal = normalVec;
-        return output;
+// Point lights scattered through a shell around the model, from a fixed seed so runs compare.
+// Intensity shrinks with the count so the overlap stays about as bright.
+std::vector<PointLight> scatter_lights(int count) {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<PointLight> lights(count);
+    for (PointLight& light : lights) {
+        double azimuth = unit(rng) * 2 * M_PI, height = unit(rng) * 2 - 1, distance = 0.4 + unit(rng) * 0.8;
+        double ring = std::sqrt(1 - height * height);
+        light.position = vec3{ distance * ring * std::cos(azimuth), distance * height, distance * ring * std::sin(azimuth) };
+        light.radius = 0.25 + unit(rng) * 0.3;
+        light.intensity = 40.0 / std::max(count, 40);
     }
-
-    void setup_triangle(const vec3 pos[3], const vec3 norm[3]) override {
-        tri_pos[0] = pos[0];
-        tri_pos[1] = pos[1];
-        tri_pos[2] = pos[2];
-        tri_norm[0] = norm[0];
-        tri_norm[1] = norm[1];
-        tri_norm[2] = norm[2];
-    }
-
-    std::pair<bool, Color> fragment(const vec3& bar) const override {
-        Color baseColor = this->color;
-
-        vec3 normal = bar[0] * tri_norm[0] + bar[1] * tri_norm[1] + bar[2] * tri_norm[2];
-        vec3 fragPos = bar[0] * tri_pos[0] + bar[1] * tri_pos[1] + bar[2] * tri_pos[2];
-
-        vec3 lightDir = normalize(lightPos - fragPos);
-        vec3 viewDir = normalize(eye - fragPos);
-        vec3 reflectDir = reflect(-lightDir, normal);
-
-        float ambient = 0.1;
-        float diff = std::max(dot(normal, lightDir), 0.0);
-        float spec = std::pow(std::max(dot(viewDir, reflectDir), 0.0), 32);
-
-        float intensity = ambient + diff + spec;
-        Color result = baseColor * intensity;
-
-        return { false, result };
-    }
-};
-
-void visualize_zbuffer(const std::vector<float>& zbuffer, const std::string& filename) {
-    // Find min and max depth values
-    float min_depth = std::numeric_limits<float>::max();
-    float max_depth = std::numeric_limits<float>::lowest();
-
-    for (float z : zbuffer) {
-        if (z > std::numeric_limits<float>::lowest() + 1e-6) { // Check if pixel was drawn
-            min_depth = std::min(min_depth, z);
-            max_depth = std::max(max_depth, z);
-        }
-    }
-
-    if (max_depth <= min_depth) {
-        min_depth = 0.0f;
-        max_depth = 1.0f;
-    }
-
-    float depth_range = max_depth - min_depth;
-    if (depth_range < 1e-6) depth_range = 1.0f;
-
-    // Convert to grayscale image
-    std::vector<Color> zbuffer_image(width * height);
-    for (int i = 0; i < width * height; i++) {
-        if (zbuffer[i] > std::numeric_limits<float>::lowest() + 1e-6) {
-            float normalized = (zbuffer[i] - min_depth) / depth_range;
-            unsigned char gray = static_cast<unsigned char>(normalized * 255.0f);
-            zbuffer_image[i] = { gray, gray, gray };
-        }
-    }
-
-    // Write PPM file
-    std::ofstream ofs(filename, std::ios::binary);
-    ofs << "P6\n" << width << " " << height << "\n255\n";
-    ofs.write(reinterpret_cast<char*>(zbuffer_image.data()), zbuffer_image.size() * sizeof(Color));
-    ofs.close();
+    return lights;
 }
 
-void realtime_render() {
+// With streamPath set, draws a chunked mesh through MeshStreamer instead of loading test2.obj.
+// lightCount > 0 replaces the single light with that many clustered point lights.
+void realtime_render(const std::string& streamPath = "", size_t streamBudget = 0, int lightCount = 0) {
     // Initialize GLFW
     if (!glfwInit()) {
         std::cerr << "Failed to initialize GLFW" << std::endl;
@@ -164,26 +110,66 @@ void realtime_render() {
     float rotation = 0.0f;
     float zoom = 2.0f;
 
-    // Load model once
-    file_parser fp;
-    fp.load("./test2.obj");
-    std::vector<vec3> vertices = fp.get_vertices();
-    std::vector<vec3> normals = fp.get_normals();
-    std::vector<Face> faces = fp.get_faces();
+    // Load the model in the background and hot-reload it when the file changes.
+    // Until the first load finishes a placeholder cube is drawn.
+    ThreadPool loaderPool(2);
+    MeshLoader loader(loaderPool);
+    MeshStreamer streamer(loaderPool, streamBudget);
+    bool streaming = !streamPath.empty();
+    if (streaming) {
+        if (!streamer.open(streamPath)) streaming = false;
+    }
+    else {
+        loader.load("./test2.obj");
+        loader.watch("./test2.obj");
+    }
+    const std::shared_ptr<const Mesh> placeholder = std::make_shared<const Mesh>(make_placeholder_mesh());
+    std::shared_ptr<const Mesh> mesh = placeholder;
+    uint64_t meshVersion = 0;
 
     std::cout << "Controls:" << std::endl;
     std::cout << "  Left/Right Arrow: Rotate model" << std::endl;
     std::cout << "  Up/Down Arrow: Zoom in/out" << std::endl;
     std::cout << "  W/S: Move camera up/down" << std::endl;
     std::cout << "  A/D: Move camera left/right" << std::endl;
+    std::cout << "  R: Start/stop recording to capture.y4m" << std::endl;
+    std::cout << "  Left click: Pick a triangle" << std::endl;
     std::cout << "  ESC: Exit" << std::endl;
 
     double lastTime = glfwGetTime();
     int frameCount = 0;
     int currentFPS = 0;
 
-    // Main render loop
+    // The pipeline lives across frames so an unchanged scene can reuse the last framebuffer.
+    // Any change to the camera, model rotation or lights bumps sceneVersion and forces a redraw.
+    // BGRA8 is what glDrawPixels takes without converting, reversed-Z float keeps depth precise
+    Pipeline pipeline(width, height, target_preset(TargetPreset::DISPLAY));
+    const vec3 lightPos{ 2, 2, 3 };
+    const std::vector<PointLight> lights = scatter_lights(lightCount);
+    LightClusters lightClusters;
+    uint64_t sceneVersion = 1;
+    uint64_t renderedVersion = 0;
+    // Outside the mesh there is only background, so a change redraws the tiles under where it
+    // was drawn last and where it is drawn now, and the rest of the frame is kept
+    Rect drawnBounds{ 0, 0, -1, -1 };
+    bool boundsKnown = false;
+
+    VideoWriter recorder;
+    bool recordKeyDown = false;
+
+    // Picking: the BVH is built on the first click on a new mesh and refit when only the rotation changed
+    Bvh bvh;
+    std::shared_ptr<const Mesh> bvhMesh;
+    bool mouseDown = false;
+    bool hasPick = false;
+    BvhHit picked;
+    vec3 pickedPoint;
+
+    // Main render loop. Everything in it runs without touching the heap once started;
+    // build with HEAP_GUARD=1 to abort on the first allocation that breaks this.
     while (!glfwWindowShouldClose(window)) {
+        HeapGuard heapGuard;
+
         // Calculate FPS
         double currentTime = glfwGetTime();
         frameCount++;
@@ -199,114 +185,190 @@ void realtime_render() {
         ImGui::NewFrame();
 
         // Handle input
+        bool changed = false;
         if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
             glfwSetWindowShouldClose(window, GLFW_TRUE);
         }
         if (glfwGetKey(window, GLFW_KEY_LEFT) == GLFW_PRESS) {
             rotation -= 0.02f;
+            changed = true;
         }
         if (glfwGetKey(window, GLFW_KEY_RIGHT) == GLFW_PRESS) {
             rotation += 0.02f;
+            changed = true;
         }
         if (glfwGetKey(window, GLFW_KEY_UP) == GLFW_PRESS) {
             zoom -= 0.02f;
             if (zoom < 0.5f) zoom = 0.5f;
+            changed = true;
         }
         if (glfwGetKey(window, GLFW_KEY_DOWN) == GLFW_PRESS) {
             zoom += 0.02f;
             if (zoom > 5.0f) zoom = 5.0f;
+            changed = true;
         }
         if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
             eye.y += 0.02f;
+            changed = true;
         }
         if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
             eye.y -= 0.02f;
+            changed = true;
         }
         if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
             eye.x -= 0.02f;
+            changed = true;
         }
         if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
             eye.x += 0.02f;
+            changed = true;
+        }
+        bool recordKey = glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS;
+        if (recordKey && !recordKeyDown) {
+            HeapGuard::Allow allow; // opening a recording sets up its file and frame pool
+            if (recorder.is_open()) {
+                recorder.close();
+                std::cout << "Recorded " << recorder.frame_count() << " frames to capture.y4m" << std::endl;
+            }
+            else {
+                recorder.open("capture.y4m", width, height, 60, VideoWriter::Format::Y4M);
+            }
+        }
+        recordKeyDown = recordKey;
+
+        bool mouse = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+        if (mouse && !mouseDown && !io.WantCaptureMouse && !streaming) {
+            HeapGuard::Allow allow; // a (re)build allocates, and only happens on a click
+            if (bvhMesh != mesh) {
+                bvh.build(*mesh, rotation);
+                bvhMesh = mesh;
+            }
+            else if (bvh.rotation() != rotation) {
+                bvh.refit(*mesh, rotation);
+            }
+            // The pipeline still holds the camera of the frame that was clicked on
+            double cursorX, cursorY;
+            int windowW, windowH;
+            glfwGetCursorPos(window, &cursorX, &cursorY);
+            glfwGetWindowSize(window, &windowW, &windowH);
+            double x = cursorX * width / windowW, y = height - cursorY * height / windowH;
+            vec3 origin, direction;
+            screen_ray(pipeline, x, y, origin, direction);
+            picked = bvh.intersect(origin, direction);
+            pickedPoint = origin + direction * picked.t;
+            hasPick = true;
         }
+        mouseDown = mouse;
+
+        if (loader.version() != meshVersion) {
+            meshVersion = loader.version();
+            mesh = loader.current();
+            changed = true;
+        }
+        if (changed) sceneVersion++;
 
         // Update camera position with zoom
         eye.z = zoom;
 
-        // Create pipeline for this frame
-        Pipeline pipeline(width, height);
-        pipeline.lookat(eye, center, up);
-        pipeline.init_perspective(magnitude(eye - center));  // Smaller focal length = wider FOV = larger model
-        pipeline.init_viewport(0, 0, width, height);
-
-        // Create shader
-        Shader shader(vertices);
-        shader.eye = eye;
-        shader.lightPos = vec3{ 2, 2, 3 };
-        shader.color = Color{ 200, 200, 200 };
-
-        // Render all faces
-        for (size_t f = 0; f < faces.size(); f++) {
-            const Face& face = faces[f];
-
-            vec3 v0 = vertices[face[0].v_idx - 1];
-            vec3 v1 = vertices[face[1].v_idx - 1];
-            vec3 v2 = vertices[face[2].v_idx - 1];
-
-            bool hasVertexNormals =
-                !normals.empty() &&
-                face[0].n_idx > 0 && face[1].n_idx > 0 && face[2].n_idx > 0 &&
-                face[0].n_idx <= (int)normals.size() &&
-                face[1].n_idx <= (int)normals.size() &&
-                face[2].n_idx <= (int)normals.size();
-
-            vec3 n0, n1, n2;
-            if (hasVertexNormals) {
-                n0 = normals[face[0].n_idx - 1];
-                n1 = normals[face[1].n_idx - 1];
-                n2 = normals[face[2].n_idx - 1];
+        if (sceneVersion != renderedVersion) {
+            pipeline.lookat(eye, center, up);
+            pipeline.init_perspective(magnitude(eye - center));  // Smaller focal length = wider FOV = larger model
+            pipeline.init_viewport(0, 0, width, height);
+            Rect bounds;
+            bool known = !streaming && mesh_screen_bounds(pipeline, *mesh, rotation, bounds);
+            if (known && boundsKnown) {
+                pipeline.invalidate(drawnBounds);
+                pipeline.invalidate(bounds);
             }
             else {
-                // Fallback: geometric face normal
-                vec3 faceNormal = normalize(cross(v1 - v0, v2 - v0));
-                n0 = n1 = n2 = faceNormal;
+                pipeline.invalidate();
             }
+            drawnBounds = bounds;
+            boundsKnown = known;
+        }
+        // Chunks that finished loading or got evicted change the image without any input
+        if (streaming && streamer.update(pipeline, eye, rotation)) {
+            pipeline.invalidate();
+        }
 
-            // Apply rotation around Y axis
-            float cosR = cos(rotation);
-            float sinR = sin(rotation);
-            auto rotate_y = [&](vec3 v) {
-                return vec3{ v.x * cosR + v.z * sinR, v.y, -v.x * sinR + v.z * cosR };
-                };
-            v0 = rotate_y(v0);
-            v1 = rotate_y(v1);
-            v2 = rotate_y(v2);
-            n0 = normalize(rotate_y(n0));
-            n1 = normalize(rotate_y(n1));
-            n2 = normalize(rotate_y(n2));
-
-            // Transform triangle (vertex shader handles ModelView/Perspective and normal transformation)
-            auto clip = pipeline.transform_triangle(shader, v0, v1, v2, n0, n1, n2);
-            pipeline.rasterize(clip, shader);
+        if (pipeline.begin_frame()) {
+            PhongShader single;
+            ClusteredPhongShader clustered;
+            PhongShader& shader = lights.empty() ? single : clustered;
+            shader.eye = eye;
+            shader.lightPos = lightPos;
+            shader.color = Color{ 200, 200, 200 };
+            if (!lights.empty()) {
+                lightClusters.build(pipeline, lights);
+                clustered.clusters = &lightClusters;
+                clustered.specularLUT = true; // pow() per light and lane is most of the shading otherwise
+            }
+
+            if (streaming) {
+                streamer.draw(pipeline, shader, rotation);
+            }
+            else {
+                draw_mesh(pipeline, shader, *mesh, rotation);
+            }
+            renderedVersion = sceneVersion;
+        }
+        pipeline.end_frame();
+
+        // Every displayed frame goes to the recording, including ones reused from the last redraw
+        if (recorder.is_open()) {
+            recorder.add_frame(pipeline.get_packed_framebuffer(), pipeline.get_format().color);
         }
 
         // Display framebuffer using OpenGL
         glClear(GL_COLOR_BUFFER_BIT);
         glRasterPos2f(-1.0f, 1.0f);
         glPixelZoom(2.0f, -2.0f);
-        glDrawPixels(width, height, GL_RGB, GL_UNSIGNED_BYTE, pipeline.get_framebuffer_data());
+        glDrawPixels(width, height, GL_BGRA, GL_UNSIGNED_BYTE, pipeline.get_packed_framebuffer());
 
         // Render ImGui on top
         ImGui::SetNextWindowPos(ImVec2(10, 10), ImGuiCond_Always);
         ImGui::SetNextWindowBgAlpha(0.35f); // Transparent background
         ImGui::Begin("FPS", nullptr, ImGuiWindowFlags_NoTitleBar | ImGuiWindowFlags_NoResize | ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoSavedSettings);
         ImGui::Text("FPS: %d", currentFPS);
+        ImGui::Text("Kernels: %s", kernels().isa);
+        if (recorder.is_open()) {
+            ImGui::Text("REC %d", recorder.frame_count());
+        }
+        if (loader.loading()) {
+            ImGui::Text("Loading mesh...");
+        }
+        if (hasPick && picked.hit()) {
+            ImGui::Text("Picked: triangle %u at (%.3f, %.3f, %.3f)", picked.triangle, pickedPoint.x, pickedPoint.y, pickedPoint.z);
+        }
+        else if (hasPick) {
+            ImGui::Text("Picked: nothing");
+        }
+        if (!lights.empty()) {
+            const LightClusters::Stats& stats = lightClusters.stats();
+            ImGui::Text("Lights: %d, %d on screen, assigned in %.2f ms", stats.lights, stats.visibleLights, stats.buildMs);
+            ImGui::Text("Clusters: %d of %d lit, %.1f lights on average, %d at most", stats.occupiedClusters, stats.clusters,
+                stats.occupiedClusters > 0 ? double(stats.references) / stats.occupiedClusters : 0.0, stats.maxLights);
+        }
+        if (streaming) {
+            MeshStreamer::Stats stats = streamer.stats();
+            ImGui::Text("Chunks: %d visible, %d drawn (%d at full level), %d loading", stats.visible, stats.drawn, stats.exact, stats.loading);
+            ImGui::Text("Resident: %.1f / %.1f MB", stats.residentBytes / 1048576.0, stats.budgetBytes / 1048576.0);
+        }
         ImGui::End();
 
         ImGui::Render();
         ImGui_ImplOpenGL2_RenderDrawData(ImGui::GetDrawData());
 
         glfwSwapBuffers(window);
-        glfwPollEvents();
+
+        // Nothing is moving: sleep until input arrives instead of spinning on vsync.
+        // The timeout keeps the FPS overlay ticking.
+        if (changed || recorder.is_open() || (streaming && streamer.stats().loading > 0)) {
+            glfwPollEvents();
+        }
+        else {
+            glfwWaitEventsTimeout(0.25);
+        }
     }
 
     // Cleanup ImGui
@@ -330,57 +392,143 @@ void file_load() {
     pipeline.init_perspective(magnitude(eye - center));
     pipeline.init_viewport(width / 16, height / 16, width * 7 / 8, height * 7 / 8);
 
-    file_parser fp;
-
-    fp.load("./test.obj");
+    Mesh mesh;
+    if (!load_mesh("./test.obj", mesh)) return;
 
-    Shader shader(fp.get_vertices());
+    PhongShader shader;
     shader.eye = eye;
     shader.lightPos = vec3{ 0, 0.5, 1 };
+    shader.color = Color{ 150, 150, 150 };
 
-    std::vector<vec3> vertices = fp.get_vertices();
-    std::vector<vec3> normals = fp.get_normals();
-    std::vector<Face> faces = fp.get_faces();
-
-    for (size_t f = 0; f < faces.size(); f++) {
-        shader.color = Color{ 150, 150, 150 };
-
-        vec3 v0 = vertices[faces[f][0].v_idx - 1];
-        vec3 v1 = vertices[faces[f][1].v_idx - 1];
-        vec3 v2 = vertices[faces[f][2].v_idx - 1];
-
-        // Get normals (or compute face normal if not available)
-        vec3 n0, n1, n2;
-        bool hasVertexNormals = !normals.empty() &&
-            faces[f][0].n_idx > 0 && faces[f][1].n_idx > 0 && faces[f][2].n_idx > 0 &&
-            faces[f][0].n_idx <= (int)normals.size() &&
-            faces[f][1].n_idx <= (int)normals.size() &&
-            faces[f][2].n_idx <= (int)normals.size();
-
-        if (hasVertexNormals) {
-            n0 = normals[faces[f][0].n_idx - 1];
-            n1 = normals[faces[f][1].n_idx - 1];
-            n2 = normals[faces[f][2].n_idx - 1];
-        }
-        else {
-            vec3 faceNormal = normalize(cross(v1 - v0, v2 - v0));
-            n0 = n1 = n2 = faceNormal;
-        }
+    draw_mesh(pipeline, shader, mesh, 0.0f);
+
+    ImageWriter writer;
+    writer.write("framebuffer.ppm", pipeline.get_framebuffer_data(), width, height);
+    writer.write("framebuffer.png", pipeline.get_framebuffer_data(), width, height);
+    writer.write_depth("zbuffer.ppm", pipeline.get_zbuffer().data(), width, height);
+    writer.write_depth("zbuffer.png", pipeline.get_zbuffer().data(), width, height);
+    writer.flush();
+}
 
-        auto clip = pipeline.transform_triangle(shader, v0, v1, v2, n0, n1, n2);
-        pipeline.rasterize(clip, shader);
+// Renders one set of cameras with a single multi-view pass and writes them as a grid
+void render_views(ImageWriter& writer, const Mesh& mesh, const std::vector<Camera>& cameras, int size, int columns, const std::string& filename) {
+    std::vector<std::unique_ptr<Pipeline>> targets;
+    std::vector<PhongShader> shaders(cameras.size());
+    std::vector<RenderView> views;
+    for (size_t i = 0; i < cameras.size(); i++) {
+        targets.push_back(std::make_unique<Pipeline>(size, size));
+        apply_camera(*targets[i], cameras[i]);
+        targets[i]->begin_frame();
+
+        shaders[i].eye = cameras[i].eye;
+        shaders[i].lightPos = vec3{ 2, 2, 3 };
+        shaders[i].color = Color{ 200, 200, 200 };
+        views.push_back(RenderView{ targets[i].get(), &shaders[i], cameras[i].eye });
     }
 
-    std::ofstream ofs("framebuffer.ppm", std::ios::binary);
-    ofs << "P6\n"
-        << width << " " << height << "\n255\n";
-    ofs.write(reinterpret_cast<const char*>(pipeline.get_framebuffer_data()), pipeline.get_framebuffer_size() * sizeof(Color));
-    ofs.close();
+    draw_mesh_multiview(views, mesh, 0.0f);
+
+    std::vector<const Pipeline*> tiles(targets.size());
+    for (size_t i = 0; i < targets.size(); i++) tiles[i] = targets[i].get();
+    int sheetW, sheetH;
+    std::vector<Color> sheet = compose_grid(tiles, columns, sheetW, sheetH);
+    writer.write(filename, sheet.data(), sheetW, sheetH);
+}
+
+void multiview_render() {
+    Mesh mesh;
+    if (!load_mesh("./test2.obj", mesh)) return;
+
+    ImageWriter writer;
+    const Camera camera{ vec3{ -1, 0, 2 }, vec3{ 0, 0, 0 }, vec3{ 0, 1, 0 } };
+    render_views(writer, mesh, stereo_cameras(camera, 0.065), 400, 2, "stereo.png");
+    render_views(writer, mesh, cube_map_cameras(vec3{ 0, 0, 3 }), 256, 3, "cubemap.png");
+    render_views(writer, mesh, orbit_cameras(vec3{ 0, 0, 0 }, 2.0, 0.5, 12), 160, 4, "contact_sheet.png");
+    writer.flush();
+}
+
+// Renders a turning model on local worker processes and prints how the bands rebalance
+int distributed_render(int workers, int frameWidth, int frameHeight, const std::string& filename) {
+    RenderCluster cluster;
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency() / workers);
+    if (!cluster.spawn_local(workers, threads)) return 1; // before this process starts any threads
+
+    Mesh mesh;
+    if (!load_mesh("./test2.obj", mesh)) return 1;
+    if (!cluster.upload_mesh("model", mesh)) return 1;
+
+    RenderRequest request;
+    request.mesh = "model";
+    request.width = frameWidth;
+    request.height = frameHeight;
+
+    std::vector<Color> color;
+    std::vector<float> depth;
+    for (int frame = 0; frame < 8; frame++) {
+        request.rotation = frame * 0.1f;
+        if (!cluster.render(request, color, depth)) return 1;
+        std::cout << "frame " << frame << ":";
+        for (const RenderCluster::Band& band : cluster.last_frame()) {
+            std::cout << "  " << band.height << " rows " << band.renderMs << " ms";
+        }
+        std::cout << std::endl;
+    }
 
-    visualize_zbuffer(pipeline.get_zbuffer(), "zbuffer.ppm");
+    ImageWriter writer;
+    writer.write(filename, color.data(), frameWidth, frameHeight);
+    writer.write_depth("distributed_depth.png", depth.data(), frameWidth, frameHeight);
+    writer.flush();
+    return 0;
 }
 
-int main() {
+int main(int argc, char** argv) {
+    // --serve            render requests from stdin, replies on stdout
+    // --serve <socket>   render requests from clients of a Unix domain socket
+    //                    either way mesh=<path> loads from the current directory, or from
+    //                    the directory given with a trailing --assets <dir>
+    // --regress [--update] compare every backend against the goldens in ./golden
+    // --build-chunks <obj> <out>  convert a model to the chunked streaming format
+    // --stream <file> [budget MB] view a chunked model, keeping at most the budget in memory
+    // --distributed <workers> [WxH] [out.png]  render on local worker processes and composite
+    // --lights <count>   view the model lit by that many clustered point lights
+    if (argc >= 2 && std::string(argv[1]) == "--serve") {
+        RenderServer server;
+        bool assets = argc >= 4 && std::string(argv[argc - 2]) == "--assets";
+        if (!server.set_asset_root(assets ? argv[argc - 1] : ".")) return 1;
+        int rest = assets ? argc - 2 : argc;
+        return rest >= 3 ? server.serve_socket(argv[2]) : server.serve_stdio();
+    }
+    if (argc >= 2 && std::string(argv[1]) == "--regress") {
+        bool update = argc >= 3 && std::string(argv[2]) == "--update";
+        return run_regression("golden", update) == 0 ? 0 : 1;
+    }
+    if (argc >= 4 && std::string(argv[1]) == "--build-chunks") {
+        if (!build_chunked_mesh_from_obj(argv[2], argv[3])) {
+            std::cerr << "Could not write " << argv[3] << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (argc >= 3 && std::string(argv[1]) == "--stream") {
+        size_t budgetMB = argc >= 4 ? std::stoul(argv[3]) : 256;
+        realtime_render(argv[2], budgetMB * 1024 * 1024);
+        return 0;
+    }
+
+    if (argc >= 3 && std::string(argv[1]) == "--lights") {
+        realtime_render("", 0, std::max(1, std::atoi(argv[2])));
+        return 0;
+    }
+
+    if (argc >= 3 && std::string(argv[1]) == "--distributed") {
+        int frameWidth = 1024, frameHeight = 1024;
+        if (argc >= 4 && std::sscanf(argv[3], "%dx%d", &frameWidth, &frameHeight) != 2) {
+            std::cerr << "Bad size " << argv[3] << std::endl;
+            return 1;
+        }
+        return distributed_render(std::max(1, std::atoi(argv[2])), frameWidth, frameHeight, argc >= 5 ? argv[4] : "distributed.png");
+    }
+
     switch (2) {
     case 1:
         file_load();
@@ -388,5 +536,8 @@ int main() {
     case 2:
         realtime_render();
         break;
+    case 3:
+        multiview_render();
+        break;
     }
 }
\ No newline at end of file
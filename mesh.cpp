@@ -0,0 +1,144 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <unordered_map>
+
+#include "file_parser.h"
+#include "mesh.h"
+
+Mesh build_mesh(const file_parser& fp) {
+    const std::vector<vec3>& vertices = fp.get_vertices();
+    const std::vector<vec3>& normals = fp.get_normals();
+    const std::vector<Face>& faces = fp.get_faces();
+
+    Mesh mesh;
+    mesh.positions.reserve(vertices.size());
+    mesh.normals.reserve(vertices.size());
+    mesh.indices.reserve(faces.size() * 3);
+
+    std::unordered_map<uint64_t, uint32_t> remap; // (v_idx, n_idx) -> mesh vertex
+    remap.reserve(vertices.size());
+
+    auto valid_vertex = [&](const FaceVertex& fv) { return fv.v_idx > 0 && fv.v_idx <= (int)vertices.size(); };
+    auto valid_normal = [&](const FaceVertex& fv) { return fv.n_idx > 0 && fv.n_idx <= (int)normals.size(); };
+
+    for (const Face& face : faces) {
+        // Polygons are split into a triangle fan around their first corner
+        for (size_t k = 1; k + 1 < face.size(); k++) {
+            const FaceVertex corners[3] = { face[0], face[k], face[k + 1] };
+            if (!valid_vertex(corners[0]) || !valid_vertex(corners[1]) || !valid_vertex(corners[2])) continue;
+
+            bool hasVertexNormals = valid_normal(corners[0]) && valid_normal(corners[1]) && valid_normal(corners[2]);
+            if (hasVertexNormals) {
+                for (const FaceVertex& fv : corners) {
+                    uint64_t key = (static_cast<uint64_t>(fv.v_idx) << 32) | static_cast<uint32_t>(fv.n_idx);
+                    auto [it, inserted] = remap.try_emplace(key, static_cast<uint32_t>(mesh.positions.size()));
+                    if (inserted) {
+                        mesh.positions.push_back(vertices[fv.v_idx - 1]);
+                        mesh.normals.push_back(normals[fv.n_idx - 1]);
+                    }
+                    mesh.indices.push_back(it->second);
+                }
+            }
+            else {
+                // Fallback: geometric face normal, which cannot be shared with neighbouring faces
+                vec3 v0 = vertices[corners[0].v_idx - 1];
+                vec3 v1 = vertices[corners[1].v_idx - 1];
+                vec3 v2 = vertices[corners[2].v_idx - 1];
+                vec3 faceNormal = normalize(cross(v1 - v0, v2 - v0));
+                for (const FaceVertex& fv : corners) {
+                    mesh.indices.push_back(static_cast<uint32_t>(mesh.positions.size()));
+                    mesh.positions.push_back(vertices[fv.v_idx - 1]);
+                    mesh.normals.push_back(faceNormal);
+                }
+            }
+        }
+    }
+
+    return mesh;
+}
+
+Mesh make_placeholder_mesh() {
+    Mesh mesh;
+    const double s = 0.25;
+    const vec3 axes[3] = { {1, 0, 0}, {0, 1, 0}, {0, 0, 1} };
+    for (int a = 0; a < 3; a++) {
+        for (double sign : { -1.0, 1.0 }) {
+            // one quad per cube face, wound counter-clockwise when seen from outside
+            vec3 n = axes[a] * sign;
+            vec3 u = axes[(a + 1) % 3] * sign;
+            vec3 v = axes[(a + 2) % 3];
+            uint32_t base = static_cast<uint32_t>(mesh.positions.size());
+            mesh.positions.push_back((n - u - v) * s);
+            mesh.positions.push_back((n + u - v) * s);
+            mesh.positions.push_back((n + u + v) * s);
+            mesh.positions.push_back((n - u + v) * s);
+            for (int i = 0; i < 4; i++) mesh.normals.push_back(n);
+            for (uint32_t i : { 0u, 1u, 2u, 0u, 2u, 3u }) mesh.indices.push_back(base + i);
+        }
+    }
+    return mesh;
+}
+
+namespace {
+
+const char MESH_CACHE_MAGIC[4] = { 'R', 'M', 'S', 'H' };
+const uint32_t MESH_CACHE_VERSION = 1;
+
+}
+
+void serialize_mesh(const Mesh& mesh, std::vector<uint8_t>& out) {
+    uint32_t header[3] = { MESH_CACHE_VERSION, static_cast<uint32_t>(mesh.positions.size()), static_cast<uint32_t>(mesh.indices.size()) };
+    auto append = [&](const void* data, size_t bytes) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        out.insert(out.end(), p, p + bytes);
+    };
+    out.reserve(out.size() + sizeof(MESH_CACHE_MAGIC) + sizeof(header) + mesh.positions.size() * 2 * sizeof(vec3) + mesh.indices.size() * sizeof(uint32_t));
+    append(MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+    append(header, sizeof(header));
+    append(mesh.positions.data(), mesh.positions.size() * sizeof(vec3));
+    append(mesh.normals.data(), mesh.normals.size() * sizeof(vec3));
+    append(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t));
+}
+
+bool deserialize_mesh(const uint8_t* data, size_t size, Mesh& mesh) {
+    uint32_t header[3];
+    if (size < sizeof(MESH_CACHE_MAGIC) + sizeof(header) || std::memcmp(data, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) != 0) return false;
+    std::memcpy(header, data + sizeof(MESH_CACHE_MAGIC), sizeof(header));
+    if (header[0] != MESH_CACHE_VERSION) return false;
+
+    size_t offset = sizeof(MESH_CACHE_MAGIC) + sizeof(header);
+    size_t vertexBytes = size_t(header[1]) * sizeof(vec3);
+    size_t indexBytes = size_t(header[2]) * sizeof(uint32_t);
+    if (size - offset != 2 * vertexBytes + indexBytes) return false;
+
+    mesh.positions.resize(header[1]);
+    mesh.normals.resize(header[1]);
+    mesh.indices.resize(header[2]);
+    std::memcpy(mesh.positions.data(), data + offset, vertexBytes);
+    std::memcpy(mesh.normals.data(), data + offset + vertexBytes, vertexBytes);
+    std::memcpy(mesh.indices.data(), data + offset + 2 * vertexBytes, indexBytes);
+
+    for (uint32_t i : mesh.indices) {
+        if (i >= header[1]) return false; // corrupt or foreign data
+    }
+    return true;
+}
+
+bool save_mesh_cache(const Mesh& mesh, const std::string& path) {
+    std::ofstream ofs(path, std::ios::binary);
+    if (!ofs) return false;
+
+    std::vector<uint8_t> bytes;
+    serialize_mesh(mesh, bytes);
+    ofs.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return static_cast<bool>(ofs);
+}
+
+bool load_mesh_cache(const std::string& path, Mesh& mesh) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) return false;
+
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    return deserialize_mesh(bytes.data(), bytes.size(), mesh);
+}
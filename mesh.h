@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "geometry.h"
+
+class file_parser;
+
+// Render-ready form of an OBJ: one vertex per unique position/normal pair and
+// triangles stored as index triples, so the draw loop never has to resolve
+// OBJ indices or fall back to face normals per frame.
+struct Mesh {
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<uint32_t> indices; // three per triangle
+
+    size_t triangle_count() const { return indices.size() / 3; }
+};
+
+Mesh build_mesh(const file_parser& fp);
+Mesh make_placeholder_mesh(); // small cube shown while the real mesh is loading
+
+// Binary snapshot of a preprocessed mesh, so reloading skips OBJ parsing and optimization.
+// The same bytes are what the render server protocol uses to upload a mesh.
+void serialize_mesh(const Mesh& mesh, std::vector<uint8_t>& out);
+bool deserialize_mesh(const uint8_t* data, size_t size, Mesh& mesh);
+bool save_mesh_cache(const Mesh& mesh, const std::string& path);
+bool load_mesh_cache(const std::string& path, Mesh& mesh);
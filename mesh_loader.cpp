@@ -0,0 +1,114 @@
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+
+#include "file_parser.h"
+#include "mesh_loader.h"
+#include "mesh_optimizer.h"
+
+bool load_mesh(const std::string& path, Mesh& mesh, bool writeCache) {
+    namespace fs = std::filesystem;
+    std::string cachePath = path + ".meshcache";
+
+    std::error_code ec, cacheEc;
+    fs::file_time_type objTime = fs::last_write_time(path, ec);
+    fs::file_time_type cacheTime = fs::last_write_time(cachePath, cacheEc);
+    if (!ec && !cacheEc && cacheTime >= objTime && load_mesh_cache(cachePath, mesh)) {
+        return true;
+    }
+
+    file_parser fp;
+    if (!fp.load(path.c_str())) return false;
+    mesh = build_mesh(fp);
+
+    double before = compute_acmr(mesh);
+    optimize_mesh(mesh);
+    double after = compute_acmr(mesh);
+    std::cout << path << ": " << mesh.triangle_count() << " triangles, ACMR " << before << " -> " << after << std::endl;
+
+    if (writeCache && !save_mesh_cache(mesh, cachePath)) {
+        std::cerr << "Could not write mesh cache " << cachePath << std::endl;
+    }
+    return true;
+}
+
+MeshLoader::~MeshLoader() {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+    cv.notify_all();
+    if (watcher.joinable()) {
+        lock.unlock();
+        watcher.join();
+        lock.lock();
+    }
+    cv.wait(lock, [this] { return pending == 0; }); // jobs still reference this loader
+}
+
+void MeshLoader::load(const std::string& path) {
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        generation = ++requested;
+        pending++;
+    }
+
+    pool.submit([this, path, generation] {
+        std::shared_ptr<const Mesh> loaded;
+        Mesh result;
+        if (load_mesh(path, result)) {
+            loaded = std::make_shared<const Mesh>(std::move(result));
+        }
+        else {
+            std::cerr << "Failed to load mesh " << path << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        // A newer request may have finished first; never replace it with older data
+        if (loaded && generation > installed) {
+            mesh = std::move(loaded);
+            installed = generation;
+            meshVersion++;
+        }
+        pending--;
+        cv.notify_all();
+    });
+}
+
+void MeshLoader::watch(const std::string& path, double intervalSeconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (watcher.joinable()) return; // one watched file per loader
+
+    watcher = std::thread([this, path, intervalSeconds] {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::file_time_type lastWrite = fs::last_write_time(path, ec);
+        auto interval = std::chrono::duration<double>(intervalSeconds);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            fs::file_time_type stamp = fs::last_write_time(path, ec);
+            if (!ec && stamp != lastWrite) {
+                lastWrite = stamp;
+                std::cout << "Reloading " << path << std::endl;
+                load(path);
+            }
+            lock.lock();
+        }
+    });
+}
+
+std::shared_ptr<const Mesh> MeshLoader::current() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return mesh;
+}
+
+uint64_t MeshLoader::version() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return meshVersion;
+}
+
+bool MeshLoader::loading() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending > 0;
+}
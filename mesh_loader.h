@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "mesh.h"
+#include "thread_pool.h"
+
+// Loads an OBJ into the optimized render form. A "<path>.meshcache" file newer than
+// the OBJ is used directly; otherwise the OBJ is parsed, optimized and, with writeCache,
+// the cache rewritten.
+bool load_mesh(const std::string& path, Mesh& mesh, bool writeCache = true);
+
+// Loads and preprocesses meshes on a thread pool. The viewer keeps drawing
+// whatever current() returns; a finished load replaces it in one swap.
+class MeshLoader {
+public:
+    explicit MeshLoader(ThreadPool& pool) : pool(pool) {}
+    ~MeshLoader();
+
+    void load(const std::string& path);                                 // queue an asynchronous (re)load
+    void watch(const std::string& path, double intervalSeconds = 0.5);  // reload whenever the file changes on disk
+
+    std::shared_ptr<const Mesh> current() const; // latest finished mesh, nullptr until the first load completes
+    uint64_t version() const;                    // bumped every time current() changes
+    bool loading() const;
+
+private:
+    ThreadPool& pool;
+
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    std::shared_ptr<const Mesh> mesh;
+    uint64_t meshVersion = 0;
+    uint64_t requested = 0;  // generation of the latest load request
+    uint64_t installed = 0;  // generation of the mesh in `mesh`
+    int pending = 0;
+
+    std::thread watcher;
+    bool stopping = false;
+};
@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+#include "mesh_optimizer.h"
+
+namespace {
+
+uint32_t spread_bits(uint32_t v) { // 10 bits -> every third bit of 30
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Applies newIndex[old] to the vertex arrays and the index buffer
+void remap_vertices(Mesh& mesh, const std::vector<uint32_t>& newIndex) {
+    std::vector<vec3> positions(mesh.positions.size());
+    std::vector<vec3> normals(mesh.normals.size());
+    for (size_t v = 0; v < newIndex.size(); v++) {
+        positions[newIndex[v]] = mesh.positions[v];
+        normals[newIndex[v]] = mesh.normals[v];
+    }
+    mesh.positions.swap(positions);
+    mesh.normals.swap(normals);
+    for (uint32_t& i : mesh.indices) i = newIndex[i];
+}
+
+void sort_vertices_spatially(Mesh& mesh) {
+    if (mesh.positions.empty()) return;
+
+    vec3 lo = mesh.positions[0], hi = mesh.positions[0];
+    for (const vec3& p : mesh.positions) {
+        for (int c = 0; c < 3; c++) {
+            lo[c] = std::min(lo[c], p[c]);
+            hi[c] = std::max(hi[c], p[c]);
+        }
+    }
+
+    std::vector<uint32_t> codes(mesh.positions.size());
+    for (size_t v = 0; v < mesh.positions.size(); v++) {
+        uint32_t q[3];
+        for (int c = 0; c < 3; c++) {
+            double extent = hi[c] - lo[c];
+            q[c] = extent > 0 ? static_cast<uint32_t>((mesh.positions[v][c] - lo[c]) / extent * 1023.0) : 0;
+        }
+        codes[v] = spread_bits(q[0]) | (spread_bits(q[1]) << 1) | (spread_bits(q[2]) << 2);
+    }
+
+    std::vector<uint32_t> order(mesh.positions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return codes[a] < codes[b]; });
+
+    std::vector<uint32_t> newIndex(order.size());
+    for (size_t i = 0; i < order.size(); i++) newIndex[order[i]] = static_cast<uint32_t>(i);
+    remap_vertices(mesh, newIndex);
+}
+
+void tipsify(Mesh& mesh, int cacheSize) {
+    size_t vertexCount = mesh.positions.size();
+    size_t triCount = mesh.triangle_count();
+    if (triCount == 0) return;
+
+    // Vertex -> triangle adjacency in CSR form
+    std::vector<uint32_t> offsets(vertexCount + 1, 0);
+    for (uint32_t i : mesh.indices) offsets[i + 1]++;
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+    std::vector<uint32_t> adjacency(mesh.indices.size());
+    std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t t = 0; t < triCount; t++) {
+        for (int k = 0; k < 3; k++) adjacency[fill[mesh.indices[t * 3 + k]]++] = static_cast<uint32_t>(t);
+    }
+
+    std::vector<int> live(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++) live[v] = offsets[v + 1] - offsets[v];
+
+    std::vector<int> cacheTime(vertexCount, 0);
+    std::vector<uint8_t> emitted(triCount, 0);
+    std::vector<uint32_t> deadEnd;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> output;
+    output.reserve(mesh.indices.size());
+
+    int timestamp = cacheSize + 1;
+    size_t cursor = 0;
+
+    auto skip_dead_end = [&]() -> int64_t {
+        while (!deadEnd.empty()) {
+            uint32_t d = deadEnd.back();
+            deadEnd.pop_back();
+            if (live[d] > 0) return d;
+        }
+        for (; cursor < vertexCount; cursor++) {
+            if (live[cursor] > 0) return static_cast<int64_t>(cursor);
+        }
+        return -1;
+    };
+
+    int64_t fan = skip_dead_end();
+    while (fan >= 0) {
+        candidates.clear();
+        for (uint32_t a = offsets[fan]; a < offsets[fan + 1]; a++) {
+            uint32_t t = adjacency[a];
+            if (emitted[t]) continue;
+            for (int k = 0; k < 3; k++) {
+                uint32_t v = mesh.indices[t * 3 + k];
+                output.push_back(v);
+                deadEnd.push_back(v);
+                candidates.push_back(v);
+                live[v]--;
+                if (timestamp - cacheTime[v] > cacheSize) {
+                    cacheTime[v] = timestamp++;
+                }
+            }
+            emitted[t] = 1;
+        }
+
+        // Next fan: the candidate still in cache with the most live triangles that will stay in cache
+        int64_t best = -1;
+        int bestPriority = -1;
+        for (uint32_t v : candidates) {
+            if (live[v] <= 0) continue;
+            int priority = 0;
+            if (timestamp - cacheTime[v] + 2 * live[v] <= cacheSize) priority = timestamp - cacheTime[v];
+            if (priority > bestPriority) {
+                bestPriority = priority;
+                best = v;
+            }
+        }
+        fan = best >= 0 ? best : skip_dead_end();
+    }
+
+    mesh.indices.swap(output);
+}
+
+void sort_vertices_by_first_use(Mesh& mesh) {
+    const uint32_t unused = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> newIndex(mesh.positions.size(), unused);
+    uint32_t next = 0;
+    for (uint32_t i : mesh.indices) {
+        if (newIndex[i] == unused) newIndex[i] = next++;
+    }
+    for (uint32_t& n : newIndex) {
+        if (n == unused) n = next++; // unreferenced vertices go last
+    }
+    remap_vertices(mesh, newIndex);
+}
+
+}
+
+double compute_acmr(const Mesh& mesh, int cacheSize) {
+    if (mesh.triangle_count() == 0) return 0.0;
+
+    std::vector<uint32_t> fifo(cacheSize, std::numeric_limits<uint32_t>::max());
+    size_t head = 0;
+    size_t misses = 0;
+    for (uint32_t i : mesh.indices) {
+        if (std::find(fifo.begin(), fifo.end(), i) != fifo.end()) continue;
+        fifo[head] = i;
+        head = (head + 1) % fifo.size();
+        misses++;
+    }
+    return static_cast<double>(misses) / mesh.triangle_count();
+}
+
+void optimize_mesh(Mesh& mesh, int cacheSize) {
+    sort_vertices_spatially(mesh);
+    tipsify(mesh, cacheSize);
+    sort_vertices_by_first_use(mesh);
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include "mesh.h"
+
+// Size of the FIFO post-transform cache used by draw_mesh and assumed by the optimizer
+constexpr int POST_TRANSFORM_CACHE_SIZE = 16;
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO cache of the given size.
+// 3.0 means no reuse at all, 0.5 is the ideal for a large regular grid.
+double compute_acmr(const Mesh& mesh, int cacheSize = POST_TRANSFORM_CACHE_SIZE);
+
+// Reorders the mesh in place without changing what it draws:
+//  1. vertices are sorted along a Morton curve, so restarts after dead ends land near the last triangle
+//  2. triangles are reordered with Tipsify (Sander et al. 2007) for post-transform cache reuse
+//  3. vertices are renumbered in first-use order for sequential fetches
+void optimize_mesh(Mesh& mesh, int cacheSize = POST_TRANSFORM_CACHE_SIZE);
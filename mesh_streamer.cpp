@@ -0,0 +1,266 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+#include "heap_guard.h"
+#include "mesh_streamer.h"
+#include "renderer.h"
+
+namespace {
+
+struct ChunkVisibility {
+    bool visible;
+    double minW; // smallest clip w over the bounds, i.e. the nearest depth in focal units
+};
+
+// Tests the chunk's bounds, rotated like the model and shifted by -offset in world space,
+// against the clip-space frustum planes. A box is culled only when all eight corners lie
+// outside the same plane, which is exact for planes and conservative for the frustum.
+ChunkVisibility classify(const ChunkRecord& chunk, const mat<4, 4>& clip, double cosR, double sinR, const vec3& offset) {
+    int outside[5] = { 0, 0, 0, 0, 0 }; // x < -w, x > w, y < -w, y > w, w <= 0
+    double minW = std::numeric_limits<double>::max();
+    for (int i = 0; i < 8; i++) {
+        double x = (i & 1) ? chunk.boundsMax[0] : chunk.boundsMin[0];
+        double y = (i & 2) ? chunk.boundsMax[1] : chunk.boundsMin[1];
+        double z = (i & 4) ? chunk.boundsMax[2] : chunk.boundsMin[2];
+        vec4 c = clip * vec4{ x * cosR + z * sinR - offset.x, y - offset.y, -x * sinR + z * cosR - offset.z, 1.0 };
+        outside[0] += c.x < -c.w;
+        outside[1] += c.x > c.w;
+        outside[2] += c.y < -c.w;
+        outside[3] += c.y > c.w;
+        outside[4] += c.w <= 0;
+        minW = std::min(minW, c.w);
+    }
+    bool visible = std::none_of(outside, outside + 5, [](int n) { return n == 8; });
+    return { visible, minW };
+}
+
+}
+
+MeshStreamer::~MeshStreamer() {
+    wait_idle(); // pending decodes still reference this streamer
+}
+
+void MeshStreamer::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [this] { return outstanding == 0; });
+}
+
+bool MeshStreamer::open(const std::string& path) {
+    wait_idle();
+    if (!file.open(path)) return false;
+
+    this->lodCount = file.lod_count();
+    int chunks = file.chunk_count();
+    this->slots.assign(size_t(chunks) * this->lodCount, Slot{});
+    for (int c = 0; c < chunks; c++) {
+        for (int lod = 0; lod < this->lodCount; lod++) {
+            this->slots[slot_index(c, lod)].bytes = file.decoded_bytes(c, lod);
+        }
+    }
+    this->lruHead = this->lruTail = -1;
+    this->residentBytes = this->loadingBytes = 0;
+    this->loadingCount = 0;
+    this->hasLastView = false;
+    this->frameStats = Stats{};
+    this->frameStats.chunks = chunks;
+    this->frameStats.budgetBytes = this->budget;
+
+    // Sized once, so update() never grows them
+    this->drawList.clear();
+    this->drawList.reserve(chunks);
+    this->lastDrawList.clear();
+    this->lastDrawList.reserve(chunks);
+    this->requests.clear();
+    this->requests.reserve(size_t(chunks) * 3);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->completed.clear();
+        this->completed.reserve(MAX_LOADS_IN_FLIGHT);
+    }
+    return true;
+}
+
+void MeshStreamer::lru_unlink(int s) {
+    Slot& slot = this->slots[s];
+    if (slot.prev >= 0) this->slots[slot.prev].next = slot.next;
+    else this->lruHead = slot.next;
+    if (slot.next >= 0) this->slots[slot.next].prev = slot.prev;
+    else this->lruTail = slot.prev;
+    slot.prev = slot.next = -1;
+}
+
+void MeshStreamer::lru_push_front(int s) {
+    Slot& slot = this->slots[s];
+    slot.prev = -1;
+    slot.next = this->lruHead;
+    if (this->lruHead >= 0) this->slots[this->lruHead].prev = s;
+    this->lruHead = s;
+    if (this->lruTail < 0) this->lruTail = s;
+}
+
+void MeshStreamer::touch(int s) {
+    this->slots[s].lastUsed = this->frame;
+    if (this->lruHead != s) {
+        lru_unlink(s);
+        lru_push_front(s);
+    }
+}
+
+bool MeshStreamer::make_room(size_t bytes) {
+    while (this->residentBytes + this->loadingBytes + bytes > this->budget) {
+        int s = this->lruTail;
+        // The tail is the least recently used; once it is needed this frame, so is everything else
+        if (s < 0 || this->slots[s].lastUsed == this->frame) return false;
+        lru_unlink(s);
+        Slot& slot = this->slots[s];
+        slot.mesh.reset();
+        slot.state = SlotState::EMPTY;
+        this->residentBytes -= slot.bytes;
+        this->frameStats.resident--;
+        this->frameStats.evictions++;
+    }
+    return true;
+}
+
+void MeshStreamer::load(int s) {
+    Slot& slot = this->slots[s];
+    slot.state = SlotState::LOADING;
+    this->loadingBytes += slot.bytes;
+    this->loadingCount++;
+    this->frameStats.loads++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->outstanding++;
+    }
+
+    int chunk = s / this->lodCount, lod = s % this->lodCount;
+    HeapGuard::Allow allow; // queuing the job allocates; frames that stream nothing never get here
+    pool.submit([this, s, chunk, lod] {
+        auto mesh = std::make_shared<Mesh>();
+        std::shared_ptr<const Mesh> result;
+        if (file.read_chunk(chunk, lod, *mesh)) {
+            result = std::move(mesh);
+        }
+        else {
+            std::cerr << "Chunk " << chunk << " level " << lod << " is corrupt" << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        completed.emplace_back(s, std::move(result));
+        outstanding--;
+        cv.notify_all();
+    });
+}
+
+bool MeshStreamer::update(const Pipeline& pipeline, const vec3& eye, float rotation) {
+    if (!file.is_open()) return false;
+    this->frame++;
+
+    // Install decodes that finished since the last frame
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& [s, mesh] : this->completed) {
+            Slot& slot = this->slots[s];
+            this->loadingBytes -= slot.bytes;
+            this->loadingCount--;
+            if (!mesh) {
+                slot.state = SlotState::FAILED; // never retried
+                continue;
+            }
+            slot.mesh = std::move(mesh);
+            slot.state = SlotState::RESIDENT;
+            this->residentBytes += slot.bytes;
+            this->frameStats.resident++;
+            lru_push_front(s);
+        }
+        this->completed.clear();
+    }
+
+    mat<4, 4> clip = pipeline.get_perspective() * pipeline.get_modelview();
+    mat<4, 4> viewport = pipeline.get_viewport();
+    double pixelScale = std::max(std::abs(viewport(0, 0)), std::abs(viewport(1, 1))); // pixels per unit of ndc
+    double cosR = std::cos(rotation), sinR = std::sin(rotation);
+    const vec3 noOffset{ 0, 0, 0 };
+
+    // Coarsest level whose clustering error stays under pixelError at the chunk's nearest depth
+    auto wanted_lod = [&](int c, double minW) {
+        if (minW <= 1e-6) return 0; // reaches behind the eye
+        int lod = 0;
+        for (int l = 1; l < this->lodCount; l++) {
+            if (file.chunk(c).lods[l].error * pixelScale / minW <= this->pixelError) lod = l;
+        }
+        return lod;
+    };
+
+    std::swap(this->drawList, this->lastDrawList);
+    this->drawList.clear();
+    this->requests.clear();
+    this->frameStats.visible = this->frameStats.drawn = this->frameStats.exact = 0;
+
+    for (int c = 0; c < file.chunk_count(); c++) {
+        ChunkVisibility view = classify(file.chunk(c), clip, cosR, sinR, noOffset);
+        if (!view.visible) continue;
+        this->frameStats.visible++;
+
+        int want = wanted_lod(c, view.minW);
+        // Nearest resident level, coarser first since it is cheaper to draw
+        int drawLod = -1;
+        for (int d = 0; d < this->lodCount && drawLod < 0; d++) {
+            if (want + d < this->lodCount && this->slots[slot_index(c, want + d)].state == SlotState::RESIDENT) drawLod = want + d;
+            else if (d > 0 && want - d >= 0 && this->slots[slot_index(c, want - d)].state == SlotState::RESIDENT) drawLod = want - d;
+        }
+
+        if (drawLod >= 0) {
+            int s = slot_index(c, drawLod);
+            this->drawList.push_back(s);
+            touch(s);
+            this->frameStats.drawn++;
+            if (drawLod == want) this->frameStats.exact++;
+        }
+        else {
+            // Nothing to show yet: the coarsest level is small and fills the hole quickly
+            this->requests.push_back(Request{ 0, view.minW, slot_index(c, this->lodCount - 1) });
+        }
+        if (drawLod != want) this->requests.push_back(Request{ 1, view.minW, slot_index(c, want) });
+    }
+
+    // Prefetch for where the camera will be if it keeps moving like it did since the last frame
+    if (this->hasLastView && this->prefetchFrames > 0) {
+        vec3 offset = (eye - this->lastEye) * this->prefetchFrames;
+        double ahead = rotation + (rotation - this->lastRotation) * this->prefetchFrames;
+        if (magnitude(offset) > 1e-9 || ahead != rotation) {
+            double cosA = std::cos(ahead), sinA = std::sin(ahead);
+            for (int c = 0; c < file.chunk_count(); c++) {
+                ChunkVisibility view = classify(file.chunk(c), clip, cosA, sinA, offset);
+                if (!view.visible) continue;
+                this->requests.push_back(Request{ 2, view.minW, slot_index(c, wanted_lod(c, view.minW)) });
+            }
+        }
+    }
+    this->lastEye = eye;
+    this->lastRotation = rotation;
+    this->hasLastView = true;
+
+    // Most urgent first, nearest first within a class
+    std::sort(this->requests.begin(), this->requests.end(), [](const Request& a, const Request& b) {
+        return a.priority != b.priority ? a.priority < b.priority : a.minW < b.minW;
+    });
+    for (const Request& r : this->requests) {
+        if (this->loadingCount >= MAX_LOADS_IN_FLIGHT) break;
+        if (this->slots[r.slot].state != SlotState::EMPTY) continue;
+        if (!make_room(this->slots[r.slot].bytes)) break; // the budget is taken by what this frame draws
+        load(r.slot);
+    }
+
+    this->frameStats.loading = this->loadingCount;
+    this->frameStats.residentBytes = this->residentBytes;
+    return this->drawList != this->lastDrawList;
+}
+
+void MeshStreamer::draw(Pipeline& pipeline, Pipeline::IShader& shader, float rotation) const {
+    for (int s : this->drawList) {
+        draw_mesh(pipeline, shader, *this->slots[s].mesh, rotation);
+    }
+}
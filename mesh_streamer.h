@@ -0,0 +1,111 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "chunked_mesh.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+// Draws a chunked mesh (chunked_mesh.h) that can be far larger than memory.
+//
+// update() runs once per frame after the camera is applied. It keeps the chunks whose
+// bounds touch the view frustum and picks for each one the coarsest level whose error
+// projects below pixelError pixels. Missing levels are decoded on the thread pool.
+// Chunks the camera is heading towards are prefetched, extrapolating the last eye and
+// rotation change by prefetchFrames frames. The decoded chunks form a cache of at most
+// budgetBytes with least-recently-used eviction, so memory use is bounded by the budget
+// and not by the model. Until its level arrives, a chunk is drawn at the nearest
+// resident level, or skipped when none is resident.
+class MeshStreamer {
+public:
+    static constexpr int MAX_LOADS_IN_FLIGHT = 4;
+
+    MeshStreamer(ThreadPool& pool, size_t budgetBytes) : pool(pool), budget(budgetBytes) {}
+    ~MeshStreamer();
+
+    MeshStreamer(const MeshStreamer&) = delete;
+    MeshStreamer& operator=(const MeshStreamer&) = delete;
+
+    bool open(const std::string& path);
+
+    // eye is the world-space camera position, rotation the model's Y rotation as in draw_mesh().
+    // Returns true when newly decoded chunks change what draw() produces.
+    bool update(const Pipeline& pipeline, const vec3& eye, float rotation);
+    void draw(Pipeline& pipeline, Pipeline::IShader& shader, float rotation) const;
+
+    struct Stats {
+        int chunks = 0;          // in the file
+        int visible = 0;         // inside the frustum this frame
+        int drawn = 0;           // visible and resident at some level
+        int exact = 0;           // drawn at the level they asked for
+        int resident = 0;
+        int loading = 0;
+        size_t residentBytes = 0;
+        size_t budgetBytes = 0;
+        uint64_t loads = 0;      // total decodes issued, prefetches included
+        uint64_t evictions = 0;
+    };
+    Stats stats() const { return frameStats; }
+
+    double pixelError = 1.0;
+    int prefetchFrames = 8;
+
+private:
+    enum class SlotState : uint8_t { EMPTY, LOADING, RESIDENT, FAILED };
+
+    // One (chunk, lod) pair. Slots are allocated once in open() so that a frame whose
+    // working set is already resident does not touch the heap.
+    struct Slot {
+        std::shared_ptr<const Mesh> mesh;
+        size_t bytes = 0;
+        SlotState state = SlotState::EMPTY;
+        uint64_t lastUsed = 0;
+        int prev = -1, next = -1; // LRU list of resident slots, head = most recent
+    };
+
+    ThreadPool& pool;
+    size_t budget;
+    ChunkedMeshFile file;
+    int lodCount = 0;
+
+    std::vector<Slot> slots;
+    int lruHead = -1, lruTail = -1;
+    size_t residentBytes = 0;
+    size_t loadingBytes = 0;
+    int loadingCount = 0;
+    uint64_t frame = 0;
+
+    struct Request {
+        int priority;  // 0 = chunk has nothing resident, 1 = wanted level, 2 = prefetch
+        double minW;   // nearer chunks first within a priority
+        int slot;
+    };
+
+    std::vector<int> drawList;     // slots chosen by the last update()
+    std::vector<int> lastDrawList; // the frame before, to tell whether anything changed
+    std::vector<Request> requests;
+
+    bool hasLastView = false;
+    vec3 lastEye;
+    float lastRotation = 0;
+
+    // Finished decodes, handed from the pool threads to update()
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::pair<int, std::shared_ptr<const Mesh>>> completed;
+    int outstanding = 0;
+
+    Stats frameStats;
+
+    int slot_index(int chunk, int lod) const { return chunk * lodCount + lod; }
+    void lru_unlink(int s);
+    void lru_push_front(int s);
+    void touch(int s);
+    bool make_room(size_t bytes);
+    void load(int s);
+    void wait_idle();
+};
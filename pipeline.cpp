@@ -1,17 +1,119 @@
 #include <algorithm>
+#include <cmath>
 #include <limits>
 #include "pipeline.h"
 
+TargetFormat target_preset(TargetPreset preset) {
+    switch (preset) {
+    case TargetPreset::DISPLAY:
+        return TargetFormat{ ColorFormat::BGRA8, DepthFormat::FLOAT32_REVERSED };
+    case TargetPreset::COMPACT:
+        return TargetFormat{ ColorFormat::BGRA8, DepthFormat::UNORM16 };
+    default:
+        return TargetFormat{};
+    }
+}
+
+TargetFormat target_preset_for(int width, int height) {
+    // Past a few megapixels clears and depth tests are bound by memory traffic, not shading
+    return target_preset(size_t(width) * height <= 4 * 1024 * 1024 ? TargetPreset::DISPLAY : TargetPreset::COMPACT);
+}
+
+size_t bytes_per_pixel(const TargetFormat& format) {
+    size_t color = format.color == ColorFormat::RGB8 ? sizeof(Color) : sizeof(uint32_t);
+    size_t depth = format.depth == DepthFormat::UNORM16 ? sizeof(uint16_t) : sizeof(uint32_t);
+    return color + depth;
+}
+
+void Pipeline::allocate_target() {
+    size_t pixels = size_t(this->width) * this->height;
+    if (this->format.color == ColorFormat::RGB8) this->framebuffer.assign(pixels, Color{ 0, 0, 0 });
+    else this->packedFramebuffer.assign(pixels, pack_color(Color{ 0, 0, 0 }, this->format.color));
+    switch (this->format.depth) {
+    case DepthFormat::FLOAT32:
+        this->zbuffer.assign(pixels, std::numeric_limits<float>::lowest());
+        break;
+    case DepthFormat::FLOAT32_REVERSED:
+        this->zbuffer.assign(pixels, 0.0f);
+        break;
+    case DepthFormat::UNORM24:
+        this->depth24.assign(pixels, 0);
+        break;
+    case DepthFormat::UNORM16:
+        this->depth16.assign(pixels, 0);
+        break;
+    }
+}
+
+// Fills pixels [first, first + count) of the memory rows with black and the farthest depth
+void Pipeline::clear_span(size_t first, size_t count) {
+    if (this->format.color == ColorFormat::RGB8) {
+        std::fill_n(this->framebuffer.begin() + first, count, Color{ 0, 0, 0 });
+    }
+    else {
+        std::fill_n(this->packedFramebuffer.begin() + first, count, pack_color(Color{ 0, 0, 0 }, this->format.color));
+    }
+    switch (this->format.depth) {
+    case DepthFormat::FLOAT32:
+        std::fill_n(this->zbuffer.begin() + first, count, std::numeric_limits<float>::lowest());
+        break;
+    case DepthFormat::FLOAT32_REVERSED:
+        std::fill_n(this->zbuffer.begin() + first, count, 0.0f);
+        break;
+    case DepthFormat::UNORM24:
+        std::fill_n(this->depth24.begin() + first, count, 0u);
+        break;
+    case DepthFormat::UNORM16:
+        std::fill_n(this->depth16.begin() + first, count, uint16_t(0));
+        break;
+    }
+}
+
+void Pipeline::update_depth_mapping() {
+    // The eye sits at distance f * w along the view axis and 1 / w = (z + f) / f,
+    // so 1 / distance = z / f^2 + 1 / f: affine in ndc z
+    double f = this->focal;
+    double nearDistance = this->depthNear > 0 ? this->depthNear : f / 16;
+    double farDistance = this->depthFar > nearDistance ? this->depthFar : f * 16;
+    switch (this->format.depth) {
+    case DepthFormat::FLOAT32:
+        this->depthScale = 1.0;
+        this->depthBias = 0.0;
+        break;
+    case DepthFormat::FLOAT32_REVERSED:
+        this->depthScale = nearDistance / (f * f);
+        this->depthBias = nearDistance / f;
+        break;
+    case DepthFormat::UNORM24:
+    case DepthFormat::UNORM16: {
+        double range = 1 / nearDistance - 1 / farDistance;
+        this->depthScale = 1 / (f * f * range);
+        this->depthBias = (1 / f - 1 / farDistance) / range;
+        break;
+    }
+    }
+    this->depthMax = this->format.depth == DepthFormat::UNORM24 ? 16777215.0 : this->format.depth == DepthFormat::UNORM16 ? 65535.0 : 1.0;
+}
+
+void Pipeline::set_depth_range(double nearDistance, double farDistance) {
+    this->depthNear = nearDistance;
+    this->depthFar = farDistance;
+    update_depth_mapping();
+}
+
 void Pipeline::lookat(const vec3 eye, const vec3 center, const vec3 up) {
     vec3 n = normalize(eye - center);
     vec3 l = normalize(cross(up, n));
     vec3 m = normalize(cross(n, l));
     this->ModelView = mat<4, 4>{ {{l.x,l.y,l.z,0}, {m.x,m.y,m.z,0}, {n.x,n.y,n.z,0}, {0,0,0,1}} } *
         mat<4, 4>{{{1, 0, 0, -center.x}, { 0,1,0,-center.y }, { 0,0,1,-center.z }, { 0,0,0,1 }}};
+    this->NormalMatrix = this->ModelView.invert_transpose();
 }
 
 void Pipeline::init_perspective(const double f) {
     this->Perspective = { {{1,0,0,0}, {0,1,0,0}, {0,0,1,0}, {0,0, -1 / f,1}} };
+    this->focal = f;
+    update_depth_mapping();
 }
 
 void Pipeline::init_viewport(const int x, const int y, const int w, const int h) {
@@ -22,24 +124,143 @@ void Pipeline::init_zbuffer(const int width, const int height) {
     this->zbuffer.resize(width * height, -1000.);
 }
 
+namespace {
+
+// Clip-space polygon of a triangle after clipping, at most one extra vertex per plane
+struct ClipPolygon {
+    static constexpr int MAX_VERTICES = 3 + 5;
+    vec4 position[MAX_VERTICES];
+    vec3 bary[MAX_VERTICES]; // barycentric coordinates in the original triangle
+    int count = 0;
+};
+
+// Signed distance to plane p: 0 = near (w >= wNear), 1..4 = guard band (|x|, |y| <= g w)
+double plane_distance(const vec4& v, int p, double wNear, double g) {
+    switch (p) {
+    case 0: return v.w - wNear;
+    case 1: return g * v.w - v.x;
+    case 2: return g * v.w + v.x;
+    case 3: return g * v.w - v.y;
+    default: return g * v.w + v.y;
+    }
+}
+
+// Sutherland-Hodgman against one plane; attributes are linear in clip space
+void clip_polygon(const ClipPolygon& in, ClipPolygon& out, int p, double wNear, double g) {
+    out.count = 0;
+    for (int i = 0; i < in.count; i++) {
+        int j = (i + 1) % in.count;
+        double di = plane_distance(in.position[i], p, wNear, g);
+        double dj = plane_distance(in.position[j], p, wNear, g);
+        if (di >= 0) {
+            out.position[out.count] = in.position[i];
+            out.bary[out.count++] = in.bary[i];
+        }
+        if ((di >= 0) != (dj >= 0)) {
+            double t = di / (di - dj);
+            out.position[out.count] = in.position[i] + (in.position[j] - in.position[i]) * t;
+            out.bary[out.count++] = in.bary[i] + (in.bary[j] - in.bary[i]) * t;
+        }
+    }
+}
+
+}
+
+int Pipeline::clip_triangle(const Triangle& clip, ClippedTriangle& out) const {
+    // Which planes the triangle crosses; fully outside any one of them means nothing to draw
+    double wNear = this->depthNear > 0 ? this->depthNear / this->focal : 1.0 / 16; // same near distance the depth formats use
+    int crossed = 0;
+    out.count = 0;
+    out.clipped = false;
+    for (int p = 0; p < 5; p++) {
+        int outside = 0;
+        for (int i = 0; i < 3; i++) outside += plane_distance(clip[i], p, wNear, GUARD_BAND) < 0;
+        if (outside == 3) return 0;
+        if (outside > 0) crossed |= 1 << p;
+    }
+    if (crossed == 0) {
+        // The common case: in front of the near plane and inside the guard band, scissored by the screen bounds
+        out.piece[0] = clip;
+        out.count = 1;
+        return 1;
+    }
+
+    ClipPolygon polygons[2];
+    ClipPolygon* poly = &polygons[0];
+    for (int i = 0; i < 3; i++) {
+        poly->position[i] = clip[i];
+        poly->bary[i] = vec3{ double(i == 0), double(i == 1), double(i == 2) };
+    }
+    poly->count = 3;
+    for (int p = 0; p < 5; p++) {
+        if (!(crossed & (1 << p))) continue;
+        ClipPolygon* next = poly == &polygons[0] ? &polygons[1] : &polygons[0];
+        clip_polygon(*poly, *next, p, wNear, GUARD_BAND);
+        poly = next;
+        if (poly->count < 3) return 0;
+    }
+
+    // Fan of the convex polygon; each piece keeps its corners' barycentrics in the original triangle
+    out.clipped = true;
+    for (int i = 1; i + 1 < poly->count; i++) {
+        out.piece[out.count] = { poly->position[0], poly->position[i], poly->position[i + 1] };
+        out.bary[out.count][0] = poly->bary[0];
+        out.bary[out.count][1] = poly->bary[i];
+        out.bary[out.count][2] = poly->bary[i + 1];
+        out.count++;
+    }
+    return out.count;
+}
+
 void Pipeline::rasterize(const Triangle& clip, IShader& shader) {
+    if (dirtyCount == 0) return; // nothing on screen needs redrawing
+
+    ClippedTriangle pieces;
+    clip_triangle(clip, pieces);
+    for (int p = 0; p < pieces.count; p++) {
+        rasterize_triangle(pieces.piece[p], pieces.clipped ? pieces.bary[p] : nullptr, shader);
+    }
+}
+
+bool Pipeline::raster_setup(const Triangle& clip, bool clipped, RasterSetup& s) const {
     vec4 ndc[3] = { clip[0] / clip[0].w, clip[1] / clip[1].w, clip[2] / clip[2].w };                // normalized device coordinates
     vec2 screen[3] = { (this->Viewport * ndc[0]).xy(), (this->Viewport * ndc[1]).xy(), (this->Viewport * ndc[2]).xy() }; // screen coordinates
 
     mat<3, 3> ABC = { { {screen[0].x, screen[0].y, 1.}, {screen[1].x, screen[1].y, 1.}, {screen[2].x, screen[2].y, 1.} } };
-    if (ABC.det() < 1) return; // backface culling + discarding triangles that cover less than a pixel
+    if (ABC.det() < (clipped ? 1e-9 : 1)) return false; // backface culling + discarding triangles that cover less than a pixel; clipped pieces are kept down to slivers so the polygon has no cracks
 
     auto [bbminx, bbmaxx] = std::minmax({ screen[0].x, screen[1].x, screen[2].x }); // bounding box for the triangle
     auto [bbminy, bbmaxy] = std::minmax({ screen[0].y, screen[1].y, screen[2].y }); // defined by its top left and bottom right corners
 
-    mat<3, 3> ABC_inv = ABC.invert_transpose();
-#pragma omp parallel for
-    for (int x = std::max<int>(bbminx, 0); x <= std::min<int>(bbmaxx, this->width - 1); x++) {         // clip the bounding box by the screen
-        for (int y = std::max<int>(bbminy, 0); y <= std::min<int>(bbmaxy, this->height - 1); y++) {
-            vec3 bc = ABC_inv * vec3{ static_cast<double>(x), static_cast<double>(y), 1. }; // barycentric coordinates of {x,y} w.r.t the triangle
-            if (bc.x < 0 || bc.y < 0 || bc.z < 0) continue;                                                    // negative barycentric coordinate => the pixel is outside the triangle
-            double z = bc * vec3{ ndc[0].z, ndc[1].z, ndc[2].z };  // linear interpolation of the depth
-            if (z <= get_depth(x, y)) continue;
+    s.xmin = std::max<int>(bbminx, 0), s.xmax = std::min<int>(bbmaxx, this->width - 1);   // clip the bounding box by the screen
+    s.ymin = std::max<int>(bbminy, 0), s.ymax = std::min<int>(bbmaxy, this->height - 1);
+    if (s.xmin > s.xmax || s.ymin > s.ymax) return false;
+
+    s.ndcZ = vec3{ ndc[0].z, ndc[1].z, ndc[2].z };
+    s.ABC_inv = ABC.invert_transpose();
+    return true;
+}
+
+void Pipeline::rasterize_triangle(const Triangle& clip, const vec3* bary, IShader& shader) {
+    if (referenceMode) {
+        rasterize_reference(clip, bary, shader);
+        return;
+    }
+    RasterSetup s;
+    if (!raster_setup(clip, bary != nullptr, s)) return;
+    raster_tiles(s, bary, [&](FragmentBatch& batch, int count) { flush(batch, count, shader); });
+}
+
+void Pipeline::rasterize_reference(const Triangle& clip, const vec3* bary, IShader& shader) {
+    RasterSetup s;
+    if (!raster_setup(clip, bary != nullptr, s)) return;
+    for (int x = s.xmin; x <= s.xmax; x++) {
+        for (int y = s.ymin; y <= s.ymax; y++) {
+            vec3 bc = s.ABC_inv * vec3{ static_cast<double>(x), static_cast<double>(y), 1. }; // barycentric coordinates of {x,y} w.r.t the triangle
+            if (bc.x < 0 || bc.y < 0 || bc.z < 0) continue;                                                      // negative barycentric coordinate => the pixel is outside the triangle
+            double z = encode_depth(bc * s.ndcZ); // linear interpolation of the depth
+            if (z <= stored_depth(x, y)) continue;
+            if (bary) bc = bary[0] * bc.x + bary[1] * bc.y + bary[2] * bc.z;
             auto [discard, color] = shader.fragment(bc);
             if (discard) continue;
             set(x, y, static_cast<float>(z));
@@ -48,6 +269,100 @@ void Pipeline::rasterize(const Triangle& clip, IShader& shader) {
     }
 }
 
+void Pipeline::flush(FragmentBatch& batch, int count, const IShader& shader) {
+    for (int i = count; i < BATCH_SIZE; i++) { // keep unused lanes harmless for shaders that compute every lane
+        batch.bar[0][i] = batch.bar[1][i] = batch.bar[2][i] = 1. / 3;
+    }
+    batch.mask = (1u << count) - 1;
+    shader.fragment_batch(batch);
+    store(batch, count);
+}
+
+void Pipeline::store(const FragmentBatch& batch, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!(batch.mask & (1u << i))) continue;
+        set(batch.x[i], batch.y[i], batch.z[i]);
+        set(batch.x[i], batch.y[i], batch.color[i]);
+    }
+}
+
+void Pipeline::IShader::fragment_batch(FragmentBatch& batch) const {
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        if (!(batch.mask & (1u << i))) continue;
+        auto [discard, color] = fragment(vec3{ batch.bar[0][i], batch.bar[1][i], batch.bar[2][i] });
+        if (discard) {
+            batch.mask &= ~(1u << i);
+            continue;
+        }
+        batch.color[i] = color;
+    }
+}
+
+void Pipeline::invalidate() {
+    std::fill(this->dirty.begin(), this->dirty.end(), 1);
+    this->dirtyCount = tilesX * tilesY;
+}
+
+void Pipeline::invalidate(const Rect& r) {
+    if (r.x1 < 0 || r.y1 < 0 || r.x0 >= this->width || r.y0 >= this->height || r.x0 > r.x1 || r.y0 > r.y1) return;
+    int tx0 = std::max(r.x0, 0) / TILE_SIZE, tx1 = std::min(r.x1, this->width - 1) / TILE_SIZE;
+    int ty0 = std::max(r.y0, 0) / TILE_SIZE, ty1 = std::min(r.y1, this->height - 1) / TILE_SIZE;
+    for (int ty = ty0; ty <= ty1; ty++) {
+        for (int tx = tx0; tx <= tx1; tx++) {
+            uint8_t& flag = this->dirty[ty * tilesX + tx];
+            if (!flag) {
+                flag = 1;
+                this->dirtyCount++;
+            }
+        }
+    }
+}
+
+bool Pipeline::begin_frame() {
+    if (dirtyCount == 0) return false;
+    this->arena.reset();
+    if (dirtyCount == tilesX * tilesY) {
+        clear_span(0, size_t(this->width) * this->height);
+        return true;
+    }
+    for (int ty = 0; ty < tilesY; ty++) {
+        for (int tx = 0; tx < tilesX; tx++) {
+            if (!tile_dirty(tx, ty)) continue;
+            int x0 = tx * TILE_SIZE, x1 = std::min(x0 + TILE_SIZE, this->width);
+            for (int y = ty * TILE_SIZE; y < std::min((ty + 1) * TILE_SIZE, this->height); y++) {
+                int row = (this->height - 1 - y) * this->width;
+                clear_span(row + x0, x1 - x0);
+            }
+        }
+    }
+    return true;
+}
+
+void Pipeline::end_frame() {
+    std::fill(this->dirty.begin(), this->dirty.end(), 0);
+    this->dirtyCount = 0;
+}
+
+bool Pipeline::screen_bounds(const Triangle& clip, Rect& out) const {
+    return screen_bounds(clip.data(), 3, out);
+}
+
+bool Pipeline::screen_bounds(const vec4* clip, int count, Rect& out) const {
+    double bbminx = INFINITY, bbmaxx = -INFINITY, bbminy = INFINITY, bbmaxy = -INFINITY;
+    for (int i = 0; i < count; i++) {
+        if (clip[i].w <= 0) return false; // behind the camera, bounds are meaningless
+        vec2 screen = (this->Viewport * (clip[i] / clip[i].w)).xy();
+        bbminx = std::min(bbminx, screen.x);
+        bbmaxx = std::max(bbmaxx, screen.x);
+        bbminy = std::min(bbminy, screen.y);
+        bbmaxy = std::max(bbmaxy, screen.y);
+    }
+    // Clamped well outside the screen first, so the int conversion cannot overflow
+    auto to_int = [](double v) { return static_cast<int>(std::clamp(v, -1e6, 1e6)); };
+    out = { to_int(std::floor(bbminx)), to_int(std::floor(bbminy)), to_int(std::ceil(bbmaxx)), to_int(std::ceil(bbmaxy)) };
+    return true;
+}
+
 mat<4, 4> Pipeline::get_modelview() const {
     return this->ModelView;
 }
@@ -61,36 +376,107 @@ mat<4, 4> Pipeline::get_perspective() const {
 }
 
 const Color* Pipeline::get_framebuffer_data() const {
-    return this->framebuffer.data();
+    return this->format.color == ColorFormat::RGB8 ? this->framebuffer.data() : nullptr;
+}
+
+const uint32_t* Pipeline::get_packed_framebuffer() const {
+    return this->format.color == ColorFormat::RGB8 ? nullptr : this->packedFramebuffer.data();
 }
 
 size_t Pipeline::get_framebuffer_size() const {
-    return this->framebuffer.size();
+    return size_t(this->width) * this->height;
+}
+
+void Pipeline::read_rgb(Color* out) const {
+    if (this->format.color == ColorFormat::RGB8) {
+        std::copy(this->framebuffer.begin(), this->framebuffer.end(), out);
+        return;
+    }
+    for (size_t i = 0; i < this->packedFramebuffer.size(); i++) {
+        out[i] = unpack_color(this->packedFramebuffer[i], this->format.color);
+    }
+}
+
+void Pipeline::read_depth(float* out) const {
+    const float empty = std::numeric_limits<float>::lowest();
+    switch (this->format.depth) {
+    case DepthFormat::FLOAT32:
+        std::copy(this->zbuffer.begin(), this->zbuffer.end(), out);
+        break;
+    case DepthFormat::FLOAT32_REVERSED:
+        for (size_t i = 0; i < this->zbuffer.size(); i++) out[i] = this->zbuffer[i] > 0 ? this->zbuffer[i] : empty;
+        break;
+    case DepthFormat::UNORM24:
+        for (size_t i = 0; i < this->depth24.size(); i++) out[i] = this->depth24[i] ? float(this->depth24[i] / this->depthMax) : empty;
+        break;
+    case DepthFormat::UNORM16:
+        for (size_t i = 0; i < this->depth16.size(); i++) out[i] = this->depth16[i] ? float(this->depth16[i] / this->depthMax) : empty;
+        break;
+    }
 }
 
 std::vector<float>& Pipeline::get_zbuffer() {
-    return this->zbuffer;
+    return this->zbuffer; // empty for the unorm formats
 }
 
 // Helper Functions
 void Pipeline::set(int x, int y, Color c) {
     int idx = (this->height - 1 - y) * this->width + x;
     if (idx >= 0 && idx < this->width * this->height) {
-        this->framebuffer[idx] = c;
+        if (this->format.color == ColorFormat::RGB8) this->framebuffer[idx] = c;
+        else this->packedFramebuffer[idx] = pack_color(c, this->format.color);
     }
 };
 
+// depth is already encoded by encode_depth()
 void Pipeline::set(int x, int y, float depth) {
     int idx = (this->height - 1 - y) * this->width + x;
     if (idx >= 0 && idx < this->width * this->height) {
-        this->zbuffer[idx] = depth;
+        switch (this->format.depth) {
+        case DepthFormat::FLOAT32:
+        case DepthFormat::FLOAT32_REVERSED:
+            this->zbuffer[idx] = depth;
+            break;
+        case DepthFormat::UNORM24:
+            this->depth24[idx] = static_cast<uint32_t>(depth);
+            break;
+        case DepthFormat::UNORM16:
+            this->depth16[idx] = static_cast<uint16_t>(depth);
+            break;
+        }
     }
 };
 
-float Pipeline::get_depth(int x, int y) {
+double Pipeline::stored_depth(int x, int y) const {
     int idx = (this->height - 1 - y) * this->width + x;
-    if (idx >= 0 && idx < this->width * this->height) {
+    if (idx < 0 || idx >= this->width * this->height) return std::numeric_limits<double>::max(); // never passes
+    switch (this->format.depth) {
+    case DepthFormat::UNORM24:
+        return this->depth24[idx];
+    case DepthFormat::UNORM16:
+        return this->depth16[idx];
+    default:
         return this->zbuffer[idx];
     }
-    return std::numeric_limits<float>::lowest();
-};
+}
+
+float Pipeline::get_depth(int x, int y) {
+    int idx = (this->height - 1 - y) * this->width + x;
+    if (idx < 0 || idx >= this->width * this->height) return std::numeric_limits<float>::lowest();
+    float depth;
+    switch (this->format.depth) {
+    case DepthFormat::UNORM24:
+        depth = this->depth24[idx] ? float(this->depth24[idx] / this->depthMax) : std::numeric_limits<float>::lowest();
+        break;
+    case DepthFormat::UNORM16:
+        depth = this->depth16[idx] ? float(this->depth16[idx] / this->depthMax) : std::numeric_limits<float>::lowest();
+        break;
+    case DepthFormat::FLOAT32_REVERSED:
+        depth = this->zbuffer[idx] > 0 ? this->zbuffer[idx] : std::numeric_limits<float>::lowest();
+        break;
+    default:
+        depth = this->zbuffer[idx];
+        break;
+    }
+    return depth;
+}
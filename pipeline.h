@@ -1,19 +1,68 @@
 #pragma once
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include "arena.h"
 #include "color.h"
 #include "geometry.h"
+#include "heap_guard.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct Rect {
+    int x0, y0, x1, y1; // inclusive pixel bounds in screen space (y up)
+};
+
+// Depth buffer encodings, all greater-is-closer. The reduced ones store a value affine in
+// 1 / distance from the eye, which interpolates linearly in screen space like ndc z does.
+enum class DepthFormat : uint8_t {
+    FLOAT32,          // ndc z as float, unbounded
+    FLOAT32_REVERSED, // near / distance: 1 at the near plane, towards 0 at infinity; float keeps far precision
+    UNORM24,          // (1/distance - 1/far) / (1/near - 1/far) in the low 24 bits of a uint32
+    UNORM16,          // the same mapping in a uint16
+};
+
+struct TargetFormat {
+    ColorFormat color = ColorFormat::RGB8;
+    DepthFormat depth = DepthFormat::FLOAT32;
+};
+
+// REFERENCE is RGB8 + FLOAT32, what the goldens are rendered with (7 bytes per pixel).
+// DISPLAY is BGRA8 + FLOAT32_REVERSED: aligned color that uploads as is (8 bytes per pixel).
+// COMPACT is BGRA8 + UNORM16, the least memory traffic for large targets (6 bytes per pixel)
+// at the cost of depth precision and of dropping fragments beyond the far distance.
+enum class TargetPreset { REFERENCE, DISPLAY, COMPACT };
+TargetFormat target_preset(TargetPreset preset);
+TargetFormat target_preset_for(int width, int height); // DISPLAY up to 4 megapixels, COMPACT above
+size_t bytes_per_pixel(const TargetFormat& format);
 
 class Pipeline {
 public:
-    Pipeline(int w, int h) : width(w), height(h) {
-        framebuffer.resize(width * height, { 0, 0, 0 });
-        zbuffer.resize(width * height, std::numeric_limits<float>::lowest());
+    static constexpr int TILE_SIZE = 32;  // granularity of dirty-region tracking
+    static constexpr int BATCH_SIZE = 8;  // fragments per IShader::fragment_batch call
+    static constexpr double GUARD_BAND = 8.0; // clip-space |x|, |y| limit in units of w, i.e. 8x the viewport
+
+    Pipeline(int w, int h, TargetFormat targetFormat = {}) : width(w), height(h), format(targetFormat) {
+        allocate_target();
+        update_depth_mapping();
+        tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+        tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+        dirty.resize(tilesX * tilesY, 1);
+        dirtyCount = tilesX * tilesY;
     }
 
     void lookat(const vec3 eye, const vec3 center, const vec3 up);
     void init_perspective(const double f);
     void init_viewport(const int x, const int y, const int w, const int h);
     void init_zbuffer(const int width, const int height);
+    // Distances from the eye that the reduced depth formats map to their range; 0 derives
+    // them from the perspective's focal length (f / 16 and 16 f). FLOAT32 ignores them.
+    void set_depth_range(double nearDistance, double farDistance);
 
     struct VertexOutput {
         vec4 clipPos;
@@ -21,24 +70,52 @@ public:
         vec3 normal;
     };
 
+    // A block of fragments of one triangle in structure-of-arrays form.
+    // Bit i of mask is set when lane i holds a covered fragment that passed the depth test;
+    // the shader clears bits to discard and writes color for the lanes it keeps.
+    struct FragmentBatch {
+        double bar[3][BATCH_SIZE]; // barycentric coordinates, one array per vertex
+        int x[BATCH_SIZE], y[BATCH_SIZE];
+        float z[BATCH_SIZE];
+        uint32_t mask;
+        Color color[BATCH_SIZE];
+    };
+
+    // Varying path: a shader passes a block of N floats per vertex, fixed at compile time, and
+    // gets them back per fragment interpolated with perspective correction. Such a shader is
+    // any type with
+    //   static constexpr int VARYINGS;
+    //   VaryingVertex<VARYINGS> vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) const;
+    //   void fragment(const VaryingBatch<VARYINGS>& in, FragmentBatch& batch) const;
+    // and is called directly, never through a vtable, and never handed the triangle.
+    template<int N>
+    struct VaryingVertex {
+        vec4 clipPos;
+        float varyings[N];
+    };
+
+    template<int N>
+    struct VaryingBatch {
+        float value[N][BATCH_SIZE]; // lanes past the batch's count repeat lane 0
+    };
+
     struct IShader {
         virtual Pipeline::VertexOutput vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) = 0;
         virtual void setup_triangle(const vec3 pos[3], const vec3 norm[3]) = 0;
         virtual std::pair<bool, Color> fragment(const vec3& bar) const = 0;
+        // The rasterizer always shades through this. The default runs fragment() lane by lane,
+        // shaders override it to light the whole block with SIMD-friendly float math.
+        virtual void fragment_batch(FragmentBatch& batch) const;
     };
 
     typedef std::array<vec4, 3> Triangle; // a triangle primitive is made of three ordered points
 
-    Triangle transform_triangle(IShader& shader, const vec3& v0, const vec3& v1, const vec3& v2,
-        const vec3& n0, const vec3& n1, const vec3& n2) {
-        mat<4, 4> normalMatrix = ModelView.invert_transpose();
-
-        // Process all three vertices and collect outputs
-        VertexOutput out0 = shader.vertex(v0, n0, ModelView, Perspective, normalMatrix);
-        VertexOutput out1 = shader.vertex(v1, n1, ModelView, Perspective, normalMatrix);
-        VertexOutput out2 = shader.vertex(v2, n2, ModelView, Perspective, normalMatrix);
+    VertexOutput transform_vertex(IShader& shader, const vec3& v, const vec3& n) {
+        return shader.vertex(v, n, ModelView, Perspective, NormalMatrix);
+    }
 
-        // Build clip space triangle
+    // Builds the clip space triangle from already shaded vertices and hands their attributes to the shader
+    Triangle assemble_triangle(IShader& shader, const VertexOutput& out0, const VertexOutput& out1, const VertexOutput& out2) {
         Triangle clip;
         clip[0] = out0.clipPos;
         clip[1] = out1.clipPos;
@@ -52,24 +129,242 @@ public:
         return clip;
     }
 
+    Triangle transform_triangle(IShader& shader, const vec3& v0, const vec3& v1, const vec3& v2,
+        const vec3& n0, const vec3& n1, const vec3& n2) {
+        // Process all three vertices and collect outputs
+        VertexOutput out0 = transform_vertex(shader, v0, n0);
+        VertexOutput out1 = transform_vertex(shader, v1, n1);
+        VertexOutput out2 = transform_vertex(shader, v2, n2);
+        return assemble_triangle(shader, out0, out1, out2);
+    }
+
+    // Triangles are clipped in homogeneous space against the near plane (the near distance of
+    // set_depth_range()) and the guard band only; everything else is scissored to the screen
+    // while rasterizing. Crossing triangles become a fan of pieces whose fragments report
+    // barycentrics of the original triangle, so shaders never see the clipping.
     void rasterize(const Triangle& clip, IShader& shader);
 
-    float get_depth(int x, int y);
-    const Color* get_framebuffer_data() const;
-    size_t get_framebuffer_size() const;
+    // The same clipping, tiles and depth test for a varying shader. A varying divided by w, and
+    // 1 / w itself, is affine in screen space, so every triangle gets one plane per varying and
+    // the fragments evaluate those, no barycentrics involved. Reference mode does not apply here.
+    template<class Shader>
+    void rasterize(const VaryingVertex<Shader::VARYINGS> vertices[3], const Shader& shader);
+
+    // Reference mode routes rasterize() through the plain scalar loop: one fragment() call per
+    // pixel in double precision, single-threaded, no tiles or batches. It is the oracle the
+    // regression harness checks every optimized path against.
+    void set_reference_mode(bool enabled) { referenceMode = enabled; }
+    void set_threads(int count) { threads = count; } // 0 = OpenMP default
+
+    // Dirty-region tracking. Only dirty tiles are cleared by begin_frame() and
+    // touched by rasterize(), so an unchanged frame costs nothing and a small
+    // change only re-renders the tiles it covers.
+    void invalidate();
+    void invalidate(const Rect& r);
+    bool begin_frame();  // clears the dirty tiles, returns false if there is nothing to redraw
+    void end_frame();    // marks every tile clean
+    bool screen_bounds(const Triangle& clip, Rect& out) const;
+    bool screen_bounds(const vec4* clip, int count, Rect& out) const; // false if any point is behind the camera
 
+    // Scratch memory for whatever a draw needs for the current frame only; reset by begin_frame()
+    FrameArena& frame_arena() { return arena; }
+
+    float get_depth(int x, int y); // as read_depth() reports it
+    int get_width() const { return width; }
+    int get_height() const { return height; }
+    TargetFormat get_format() const { return format; }
+
+    // Direct access to the target memory, rows from the top. get_framebuffer_data() is only
+    // valid for RGB8 targets, get_packed_framebuffer() for RGBA8/BGRA8 and get_zbuffer()
+    // for the float depth formats; the others return null or an empty vector.
+    const Color* get_framebuffer_data() const;
+    const uint32_t* get_packed_framebuffer() const;
+    size_t get_framebuffer_size() const; // in pixels
     std::vector<float>& get_zbuffer();
 
+    // Format-independent copies, width * height values from the top row. read_depth() gives
+    // the stored value for float formats and the unorm value scaled to [0, 1] otherwise;
+    // pixels nothing was drawn to are lowest() in every format.
+    void read_rgb(Color* out) const;
+    void read_depth(float* out) const;
+
     mat<4, 4> get_modelview() const;
     mat<4, 4> get_viewport() const;
     mat<4, 4> get_perspective() const;
+    mat<4, 4> get_normal_matrix() const { return NormalMatrix; }
 
 private:
     int width, height;
-    std::vector<Color> framebuffer;
-    std::vector<float> zbuffer;
+    TargetFormat format;
+    std::vector<Color> framebuffer;         // RGB8
+    std::vector<uint32_t> packedFramebuffer; // RGBA8, BGRA8
+    std::vector<float> zbuffer;             // FLOAT32, FLOAT32_REVERSED
+    std::vector<uint32_t> depth24;          // UNORM24
+    std::vector<uint16_t> depth16;          // UNORM16
     mat<4, 4> ModelView, Viewport, Perspective;
+    mat<4, 4> NormalMatrix; // inverse transpose of ModelView, refreshed by lookat()
+
+    int tilesX, tilesY;
+    std::vector<uint8_t> dirty; // one flag per tile
+    int dirtyCount = 0;         // number of dirty tiles, tilesX * tilesY means a full redraw
+
+    FrameArena arena;
+
+    // ndc z -> stored depth: z * depthScale + depthBias, then scaled by depthMax and rounded for unorm formats
+    double focal = 1.0;
+    double depthNear = 0.0, depthFar = 0.0;
+    double depthScale = 1.0, depthBias = 0.0, depthMax = 1.0;
+
+    bool tile_dirty(int tx, int ty) const { return dirty[ty * tilesX + tx] != 0; }
+
+    void allocate_target();
+    void update_depth_mapping();
+    void clear_span(size_t first, size_t count);
+
+    // Depth in the target's encoding; unorm codes are whole numbers, exact in float
+    double encode_depth(double z) const {
+        if (format.depth == DepthFormat::FLOAT32) return z;
+        double d = z * depthScale + depthBias;
+        if (format.depth == DepthFormat::FLOAT32_REVERSED) return d;
+        return std::round(std::clamp(d, 0.0, 1.0) * depthMax);
+    }
+    double stored_depth(int x, int y) const;
 
     void set(int x, int y, Color c);
     void set(int x, int y, float depth);
-};
\ No newline at end of file
+    void store(const FragmentBatch& batch, int count); // the lanes still in the mask
+    void flush(FragmentBatch& batch, int count, const IShader& shader);
+
+    // A triangle after near plane and guard band clipping: itself, or a fan of pieces
+    struct ClippedTriangle {
+        static constexpr int MAX_PIECES = 6; // five planes add at most five corners
+        Triangle piece[MAX_PIECES];
+        vec3 bary[MAX_PIECES][3]; // corners in barycentrics of the original triangle, when clipped
+        int count = 0;
+        bool clipped = false;
+    };
+    int clip_triangle(const Triangle& clip, ClippedTriangle& out) const; // number of pieces
+
+    // Screen-space setup shared by every rasterization loop
+    struct RasterSetup {
+        vec3 ndcZ;           // per corner, interpolated linearly for depth
+        mat<3, 3> ABC_inv;   // screen point -> barycentrics
+        int xmin, xmax, ymin, ymax; // bounding box clipped to the screen
+    };
+    bool raster_setup(const Triangle& clip, bool clipped, RasterSetup& s) const; // false when culled or off screen
+
+    // Walks the dirty tiles under the box in parallel, depth tests every covered pixel and
+    // hands full batches, then the remainder of each tile, to flush(batch, count)
+    template<typename Flush>
+    void raster_tiles(const RasterSetup& s, const vec3* bary, Flush&& flush);
+
+    // bary: corners of clip in barycentrics of the triangle the shader was set up with, null when unclipped
+    void rasterize_triangle(const Triangle& clip, const vec3* bary, IShader& shader);
+    void rasterize_reference(const Triangle& clip, const vec3* bary, IShader& shader);
+
+    bool referenceMode = false;
+    int threads = 0;
+};
+
+template<typename Flush>
+void Pipeline::raster_tiles(const RasterSetup& s, const vec3* bary, Flush&& flush) {
+    bool fullRedraw = dirtyCount == tilesX * tilesY;
+    int tx0 = s.xmin / TILE_SIZE, tx1 = s.xmax / TILE_SIZE;
+    int ty0 = s.ymin / TILE_SIZE, ty1 = s.ymax / TILE_SIZE;
+#ifdef _OPENMP
+    int threadCount = this->threads > 0 ? this->threads : omp_get_max_threads();
+#endif
+    // Every pixel is owned by exactly one tile column, so the result does not depend on the thread count
+    const bool guarded = HeapGuard::armed();
+#pragma omp parallel for num_threads(threadCount) if(threadCount > 1 && tx1 > tx0)
+    for (int tx = tx0; tx <= tx1; tx++) {
+        HeapGuard guard(guarded);
+        for (int ty = ty0; ty <= ty1; ty++) {
+            if (!fullRedraw && !tile_dirty(tx, ty)) continue; // tile still holds last frame's pixels
+            int x0 = std::max(s.xmin, tx * TILE_SIZE), x1 = std::min(s.xmax, tx * TILE_SIZE + TILE_SIZE - 1);
+            int y0 = std::max(s.ymin, ty * TILE_SIZE), y1 = std::min(s.ymax, ty * TILE_SIZE + TILE_SIZE - 1);
+            FragmentBatch batch;
+            int count = 0;
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    vec3 bc = s.ABC_inv * vec3{ static_cast<double>(x), static_cast<double>(y), 1. }; // barycentric coordinates of {x,y} w.r.t the triangle
+                    if (bc.x < 0 || bc.y < 0 || bc.z < 0) continue;                                   // negative barycentric coordinate => the pixel is outside the triangle
+                    double z = encode_depth(bc * s.ndcZ); // linear interpolation of the depth
+                    if (z <= stored_depth(x, y)) continue;
+                    if (bary) bc = bary[0] * bc.x + bary[1] * bc.y + bary[2] * bc.z; // back to the unclipped triangle the shader was set up with
+                    batch.bar[0][count] = bc.x;
+                    batch.bar[1][count] = bc.y;
+                    batch.bar[2][count] = bc.z;
+                    batch.x[count] = x;
+                    batch.y[count] = y;
+                    batch.z[count] = static_cast<float>(z);
+                    if (++count == BATCH_SIZE) {
+                        flush(batch, count);
+                        count = 0;
+                    }
+                }
+            }
+            if (count > 0) flush(batch, count);
+        }
+    }
+}
+
+template<class Shader>
+void Pipeline::rasterize(const VaryingVertex<Shader::VARYINGS> vertices[3], const Shader& shader) {
+    constexpr int N = Shader::VARYINGS;
+    if (dirtyCount == 0) return;
+
+    ClippedTriangle pieces;
+    if (clip_triangle(Triangle{ vertices[0].clipPos, vertices[1].clipPos, vertices[2].clipPos }, pieces) == 0) return;
+
+    for (int p = 0; p < pieces.count; p++) {
+        const Triangle& clip = pieces.piece[p];
+        RasterSetup s;
+        if (!raster_setup(clip, pieces.clipped, s)) continue;
+
+        // Plane k gives varying k / w at a pixel as a * dx + b * dy + c, offsets from the box
+        // corner keeping float precise; plane N is 1 / w. Clipped corners interpolate the
+        // original vertices linearly, which is exact in clip space.
+        float a[N + 1], b[N + 1], c[N + 1];
+        for (int k = 0; k <= N; k++) {
+            vec3 corner;
+            for (int i = 0; i < 3; i++) {
+                double value = 1;
+                if (k < N) {
+                    value = 0;
+                    for (int v = 0; v < 3; v++) {
+                        double weight = pieces.clipped ? pieces.bary[p][i][v] : double(v == i);
+                        value += weight * vertices[v].varyings[k];
+                    }
+                }
+                corner[i] = value / clip[i].w;
+            }
+            double da = 0, db = 0, dc = 0;
+            for (int i = 0; i < 3; i++) {
+                da += corner[i] * s.ABC_inv(i, 0);
+                db += corner[i] * s.ABC_inv(i, 1);
+                dc += corner[i] * s.ABC_inv(i, 2);
+            }
+            a[k] = static_cast<float>(da);
+            b[k] = static_cast<float>(db);
+            c[k] = static_cast<float>(dc + da * s.xmin + db * s.ymin);
+        }
+
+        raster_tiles(s, nullptr, [&](FragmentBatch& batch, int count) {
+            float dx[BATCH_SIZE], dy[BATCH_SIZE], w[BATCH_SIZE];
+            for (int i = 0; i < BATCH_SIZE; i++) {
+                int lane = i < count ? i : 0;
+                dx[i] = static_cast<float>(batch.x[lane] - s.xmin);
+                dy[i] = static_cast<float>(batch.y[lane] - s.ymin);
+            }
+            for (int i = 0; i < BATCH_SIZE; i++) w[i] = 1.0f / (a[N] * dx[i] + b[N] * dy[i] + c[N]);
+            VaryingBatch<N> in;
+            for (int k = 0; k < N; k++) {
+                for (int i = 0; i < BATCH_SIZE; i++) in.value[k][i] = (a[k] * dx[i] + b[k] * dy[i] + c[k]) * w[i];
+            }
+            batch.mask = (1u << count) - 1;
+            shader.fragment(in, batch);
+            store(batch, count);
+        });
+    }
+}
@@ -0,0 +1,15 @@
+#include <iostream>
+#include <string>
+
+#include "regression.h"
+
+// Headless driver for the golden-image harness, built by make test without GL or GLFW.
+// Run from the repository root: the scenes load ./test.obj and ./test2.obj.
+int main(int argc, char** argv) {
+    bool update = argc >= 2 && std::string(argv[1]) == "--update";
+    if (argc >= 2 && !update) {
+        std::cerr << "Usage: " << argv[0] << " [--update]" << std::endl;
+        return 2;
+    }
+    return run_regression("golden", update) == 0 ? 0 : 1;
+}
@@ -0,0 +1,427 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "image_writer.h"
+#include "kernels.h"
+#include "light_clusters.h"
+#include "mesh_loader.h"
+#include "regression.h"
+#include "renderer.h"
+#include "shader.h"
+
+namespace {
+
+constexpr int SIZE = 256;
+
+struct Scene {
+    const char* name;
+    const char* mesh;
+    Camera camera;
+    float rotation;
+    vec3 light;
+    Color color;
+    bool inset; // viewport with a 1/16 margin, as in file_load
+};
+
+const Scene scenes[] = {
+    { "head_front", "./test.obj", { { -1, 0, 2 }, { 0, 0, 0 }, { 0, 1, 0 } }, 0.0f, { 0, 0.5, 1 }, { 150, 150, 150 }, true },
+    { "head2_rotated", "./test2.obj", { { -1, 0, 2 }, { 0, 0, 0 }, { 0, 1, 0 } }, 0.5f, { 2, 2, 3 }, { 200, 200, 200 }, false },
+    { "head2_closeup", "./test2.obj", { { -0.3, 0.1, 0.6 }, { 0, 0.05, 0 }, { 0, 1, 0 } }, -0.8f, { 2, 2, 3 }, { 200, 200, 200 }, false },
+};
+
+// Hides the batch override of the wrapped shader, so the pipeline uses the default per-lane fallback
+struct ScalarOnlyShader : Pipeline::IShader {
+    Pipeline::IShader& inner;
+    explicit ScalarOnlyShader(Pipeline::IShader& inner) : inner(inner) {}
+
+    Pipeline::VertexOutput vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) override {
+        return inner.vertex(v, n, modelview, perspective, normalMatrix);
+    }
+    void setup_triangle(const vec3 pos[3], const vec3 norm[3]) override { inner.setup_triangle(pos, norm); }
+    std::pair<bool, Color> fragment(const vec3& bar) const override { return inner.fragment(bar); }
+};
+
+struct Backend {
+    const char* name;
+    int colorTolerance; // per channel
+    bool threaded;
+    bool usesKernels; // rerun under every ISA this CPU supports
+    std::function<void(Pipeline&, const Scene&, const Mesh&)> draw;
+    TargetFormat format = {};
+    // Reduced depth formats resolve near-ties differently and store other values, so their
+    // depth is not compared and a few pixels may pick the other surface
+    double allowedBadFraction = 0.0;
+};
+
+PhongShader make_shader(const Scene& scene) {
+    PhongShader shader;
+    shader.eye = scene.camera.eye;
+    shader.lightPos = scene.light;
+    shader.color = scene.color;
+    return shader;
+}
+
+const std::vector<Backend>& backends() {
+    static const std::vector<Backend> list = {
+        { "reference", 0, false, false, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            p.set_reference_mode(true);
+            draw_mesh(p, shader, m, s.rotation);
+        } },
+        { "scalar-batch", 0, true, false, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            ScalarOnlyShader scalar(shader);
+            draw_mesh(p, scalar, m, s.rotation);
+        } },
+        { "simd-float", 2, true, true, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            draw_mesh(p, shader, m, s.rotation);
+        } },
+        { "simd-fast", 16, true, true, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            shader.specularLUT = true;
+            shader.fastRsqrt = true;
+            draw_mesh(p, shader, m, s.rotation);
+        } },
+        { "multiview", 2, true, true, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            draw_mesh_multiview({ RenderView{ &p, &shader, s.camera.eye } }, m, s.rotation);
+        } },
+        // Perspective-correct where the goldens interpolate in screen space; the close-up's larger
+        // triangles show the difference in the specular highlight. The loose tolerance cannot
+        // tell the two apart, check_perspective_varyings() does
+        { "varyings", 20, true, true, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongVaryingShader shader;
+            shader.eye = s.camera.eye;
+            shader.lightPos = s.light;
+            shader.color = s.color;
+            draw_mesh_varyings(p, shader, m, s.rotation);
+        } },
+        { "bgra8", 2, true, false, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            draw_mesh(p, shader, m, s.rotation);
+        }, TargetFormat{ ColorFormat::BGRA8, DepthFormat::FLOAT32 } },
+        { "display", 2, true, false, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            draw_mesh(p, shader, m, s.rotation);
+        }, target_preset(TargetPreset::DISPLAY), 0.001 },
+        { "unorm24", 2, true, false, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            draw_mesh(p, shader, m, s.rotation);
+        }, TargetFormat{ ColorFormat::RGBA8, DepthFormat::UNORM24 }, 0.001 },
+        { "compact", 2, true, false, [](Pipeline& p, const Scene& s, const Mesh& m) {
+            PhongShader shader = make_shader(s);
+            draw_mesh(p, shader, m, s.rotation);
+        }, target_preset(TargetPreset::COMPACT), 0.002 },
+    };
+    return list;
+}
+
+// Fixed point lights on a spiral around the head, some out of reach of the surface and
+// some behind the camera, so the clusters have empty, shared and culled lights alike
+std::vector<PointLight> test_lights() {
+    const int count = 48;
+    std::vector<PointLight> lights;
+    for (int i = 0; i < count; i++) {
+        double height = 1 - 2 * (i + 0.5) / count;
+        double ring = std::sqrt(1 - height * height), azimuth = i * 2.399963; // golden angle
+        double distance = 0.5 + 0.25 * (i % 3);
+        lights.push_back(PointLight{ vec3{ distance * ring * std::cos(azimuth), distance * height, distance * ring * std::sin(azimuth) },
+            0.3 + 0.1 * (i % 4), 0.6 });
+    }
+    return lights;
+}
+
+// Clustered lighting against the same lights summed in full: the reference mode calls
+// ClusteredPhongShader::fragment(), which loops over every light in double
+Backend clustered_backend(const char* name, const std::vector<PointLight>& lights, bool reference) {
+    return { name, 1, !reference, !reference, [&lights, reference](Pipeline& p, const Scene& s, const Mesh& m) {
+        LightClusters clusters;
+        clusters.build(p, lights);
+        ClusteredPhongShader shader;
+        shader.eye = s.camera.eye;
+        shader.color = s.color;
+        shader.clusters = &clusters;
+        p.set_reference_mode(reference);
+        draw_mesh(p, shader, m, s.rotation);
+    } };
+}
+
+struct Frame {
+    std::vector<Color> color;
+    std::vector<float> depth;
+};
+
+bool identical(const Frame& a, const Frame& b) {
+    return a.color.size() == b.color.size() && a.depth.size() == b.depth.size() &&
+        std::memcmp(a.color.data(), b.color.data(), a.color.size() * sizeof(Color)) == 0 &&
+        std::memcmp(a.depth.data(), b.depth.data(), a.depth.size() * sizeof(float)) == 0;
+}
+
+Frame render(const Scene& scene, const Mesh& mesh, const Backend& backend, int threads) {
+    Pipeline pipeline(SIZE, SIZE, backend.format);
+    apply_camera(pipeline, scene.camera);
+    if (scene.inset) {
+        pipeline.init_viewport(SIZE / 16, SIZE / 16, SIZE * 7 / 8, SIZE * 7 / 8);
+    }
+    pipeline.set_threads(threads);
+    pipeline.begin_frame();
+    backend.draw(pipeline, scene, mesh);
+
+    Frame frame;
+    frame.color.resize(pipeline.get_framebuffer_size());
+    frame.depth.resize(pipeline.get_framebuffer_size());
+    pipeline.read_rgb(frame.color.data());
+    pipeline.read_depth(frame.depth.data());
+    return frame;
+}
+
+// Depth goldens are PFM: a standard float image format, stored little-endian
+void write_pfm(const std::string& path, const std::vector<float>& depth) {
+    std::ofstream ofs(path, std::ios::binary);
+    ofs << "Pf\n" << SIZE << " " << SIZE << "\n-1.0\n";
+    for (int y = SIZE - 1; y >= 0; y--) { // PFM rows go bottom to top
+        ofs.write(reinterpret_cast<const char*>(&depth[size_t(y) * SIZE]), SIZE * sizeof(float));
+    }
+}
+
+bool read_pfm(const std::string& path, std::vector<float>& depth) {
+    std::ifstream ifs(path, std::ios::binary);
+    std::string magic;
+    int w, h;
+    double scale;
+    if (!(ifs >> magic >> w >> h >> scale) || magic != "Pf" || w != SIZE || h != SIZE || scale >= 0) return false;
+    ifs.get();
+    depth.resize(size_t(SIZE) * SIZE);
+    for (int y = SIZE - 1; y >= 0; y--) {
+        ifs.read(reinterpret_cast<char*>(&depth[size_t(y) * SIZE]), SIZE * sizeof(float));
+    }
+    return static_cast<bool>(ifs);
+}
+
+bool read_ppm(const std::string& path, std::vector<Color>& color) {
+    std::ifstream ifs(path, std::ios::binary);
+    std::string magic;
+    int w, h, maxval;
+    if (!(ifs >> magic >> w >> h >> maxval) || magic != "P6" || w != SIZE || h != SIZE || maxval != 255) return false;
+    ifs.get();
+    color.resize(size_t(SIZE) * SIZE);
+    ifs.read(reinterpret_cast<char*>(color.data()), color.size() * sizeof(Color));
+    return static_cast<bool>(ifs);
+}
+
+struct Comparison {
+    int maxColorDiff = 0;
+    size_t badPixels = 0;
+};
+
+Comparison compare(const Frame& golden, const Frame& frame, int colorTolerance, bool checkDepth, std::vector<Color>* diffImage) {
+    Comparison result;
+    if (diffImage) diffImage->resize(golden.color.size());
+    for (size_t i = 0; i < golden.color.size(); i++) {
+        const Color& a = golden.color[i];
+        const Color& b = frame.color[i];
+        int d = std::max({ std::abs(a.r - b.r), std::abs(a.g - b.g), std::abs(a.b - b.b) });
+        bool depthMatches = !checkDepth || golden.depth[i] == frame.depth[i];
+        bool bad = d > colorTolerance || !depthMatches;
+        result.maxColorDiff = std::max(result.maxColorDiff, d);
+        if (bad) result.badPixels++;
+        if (diffImage) {
+            // Failing pixels in red over a dimmed copy of the golden
+            (*diffImage)[i] = bad ? Color{ 255, 0, 0 } : Color{ static_cast<unsigned char>(a.r / 3), static_cast<unsigned char>(a.g / 3), static_cast<unsigned char>(a.b / 3) };
+        }
+    }
+    return result;
+}
+
+// Runs one backend at every thread count against expected and, for kernel users, under
+// every supported ISA. Returns the number of failed checks.
+int check_backend(const Scene& scene, const Mesh& mesh, const Backend& backend, const Frame& expected, ImageWriter& writer, const std::string& diffDir) {
+    namespace fs = std::filesystem;
+    const int threadCounts[] = { 1, 2, 4, 8 };
+    int failures = 0;
+
+    Frame first;
+    for (int threads : threadCounts) {
+        if (!backend.threaded && threads > 1) break;
+        Frame frame = render(scene, mesh, backend, threads);
+        std::string label = std::string(scene.name) + " " + backend.name + " t" + std::to_string(threads);
+
+        std::vector<Color> diffImage;
+        bool exactDepth = backend.format.depth == DepthFormat::FLOAT32;
+        Comparison result = compare(expected, frame, backend.colorTolerance, exactDepth, &diffImage);
+        bool ok = result.badPixels <= size_t(backend.allowedBadFraction * SIZE * SIZE);
+
+        if (threads == 1) {
+            first = frame;
+        }
+        else if (!identical(frame, first)) {
+            std::cout << "FAIL " << label << ": differs from the single-threaded result" << std::endl;
+            ok = false;
+        }
+
+        std::cout << (ok ? "PASS " : "FAIL ") << label << " (max channel diff " << result.maxColorDiff
+            << ", " << result.badPixels << " pixels over tolerance)" << std::endl;
+        if (!ok) {
+            failures++;
+            fs::create_directories(diffDir);
+            std::string base = diffDir + "/" + scene.name + "_" + backend.name + "_t" + std::to_string(threads);
+            writer.write(base + "_diff.png", diffImage.data(), SIZE, SIZE);
+            writer.write(base + ".png", frame.color.data(), SIZE, SIZE);
+        }
+    }
+
+    // Kernels are built without FP contraction, so every ISA must match the default one exactly
+    if (backend.usesKernels) {
+        const KernelTable& active = kernels();
+        for (const KernelTable* table : supported_kernels()) {
+            if (table == &active) continue;
+            use_kernels(*table);
+            bool ok = identical(render(scene, mesh, backend, 1), first);
+            std::cout << (ok ? "PASS " : "FAIL ") << scene.name << " " << backend.name << " " << table->isa
+                << (ok ? " (identical to " : " (differs from ") << active.isa << ")" << std::endl;
+            if (!ok) failures++;
+        }
+        use_kernels(active);
+    }
+    return failures;
+}
+
+// Records the world x and z that reach every pixel, so the check can read the varyings back
+struct PlaneProbeShader {
+    static constexpr int VARYINGS = 2;
+
+    std::vector<float>* probe; // x, z per pixel, NaN where nothing was drawn
+
+    Pipeline::VaryingVertex<VARYINGS> vertex(const vec3& v, const vec3&, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>&) const {
+        Pipeline::VaryingVertex<VARYINGS> output;
+        output.clipPos = perspective * modelview * vec4{ v.x, v.y, v.z, 1.0 };
+        output.varyings[0] = static_cast<float>(v.x);
+        output.varyings[1] = static_cast<float>(v.z);
+        return output;
+    }
+
+    void fragment(const Pipeline::VaryingBatch<VARYINGS>& in, Pipeline::FragmentBatch& batch) const {
+        for (int i = 0; i < Pipeline::BATCH_SIZE; i++) {
+            if (!(batch.mask & (1u << i))) continue;
+            size_t pixel = size_t(batch.y[i]) * SIZE + batch.x[i];
+            (*probe)[pixel * 2] = in.value[0][i];
+            (*probe)[pixel * 2 + 1] = in.value[1][i];
+            batch.color[i] = Color{ 255, 255, 255 };
+        }
+    }
+};
+
+// A long floor seen at a grazing angle, where screen-space interpolation is off by whole
+// units in the distance. Every covered pixel's varyings must match the point where the
+// pixel's ray meets the plane, solved exactly from the camera matrices.
+int check_perspective_varyings() {
+    const double floorY = -0.5;
+    const Camera camera{ { 0, 0, 2 }, { 0, -0.5, -2 }, { 0, 1, 0 } };
+    Mesh floor;
+    floor.positions = { { -3, floorY, 1.5 }, { 3, floorY, 1.5 }, { 3, floorY, -12 }, { -3, floorY, -12 } };
+    floor.normals.assign(4, vec3{ 0, 1, 0 });
+    floor.indices = { 0, 1, 2, 0, 2, 3 };
+
+    int failures = 0;
+    for (int threads : { 1, 4 }) {
+        Pipeline pipeline(SIZE, SIZE);
+        apply_camera(pipeline, camera);
+        pipeline.set_threads(threads);
+        pipeline.begin_frame();
+
+        std::vector<float> probe(size_t(SIZE) * SIZE * 2, std::nanf(""));
+        PlaneProbeShader shader{ &probe };
+        draw_mesh_varyings(pipeline, shader, floor, 0.0f);
+
+        // Screen x is row 0 over row 3 of the full transform, screen y row 1 over row 3;
+        // on the plane both are linear in the unknown x and z
+        mat<4, 4> m = pipeline.get_viewport() * pipeline.get_perspective() * pipeline.get_modelview();
+        size_t covered = 0;
+        double maxError = 0;
+        for (int y = 0; y < SIZE; y++) {
+            for (int x = 0; x < SIZE; x++) {
+                const float* value = &probe[(size_t(y) * SIZE + x) * 2];
+                if (std::isnan(value[0])) continue;
+                double r[4], q[4];
+                for (int j = 0; j < 4; j++) {
+                    r[j] = m(0, j) - x * m(3, j);
+                    q[j] = m(1, j) - y * m(3, j);
+                }
+                double rc = -(r[1] * floorY + r[3]), qc = -(q[1] * floorY + q[3]);
+                double det = r[0] * q[2] - r[2] * q[0];
+                double exactX = (rc * q[2] - r[2] * qc) / det;
+                double exactZ = (r[0] * qc - rc * q[0]) / det;
+                maxError = std::max({ maxError, std::abs(value[0] - exactX), std::abs(value[1] - exactZ) });
+                covered++;
+            }
+        }
+
+        // Float planes keep the error near 1e-5; screen-space interpolation is off by several units
+        bool ok = covered > size_t(SIZE) * SIZE / 4 && maxError < 1e-3;
+        std::cout << (ok ? "PASS " : "FAIL ") << "floor varyings t" << threads << " (max world error " << maxError
+            << " over " << covered << " pixels)" << std::endl;
+        if (!ok) failures++;
+    }
+    return failures;
+}
+
+}
+
+int run_regression(const std::string& goldenDir, bool update) {
+    namespace fs = std::filesystem;
+    fs::create_directories(goldenDir);
+    std::string diffDir = goldenDir + "/diff";
+
+    ImageWriter writer;
+    int failures = 0;
+    const std::vector<PointLight> lights = test_lights();
+
+    for (const Scene& scene : scenes) {
+        Mesh mesh;
+        if (!load_mesh(scene.mesh, mesh)) {
+            std::cout << "FAIL " << scene.name << ": could not load " << scene.mesh << std::endl;
+            failures++;
+            continue;
+        }
+
+        std::string colorPath = goldenDir + "/" + scene.name + ".ppm";
+        std::string depthPath = goldenDir + "/" + scene.name + ".pfm";
+
+        if (update) {
+            Frame frame = render(scene, mesh, backends()[0], 1);
+            writer.write(colorPath, ImageFormat::PPM, frame.color.data(), SIZE, SIZE);
+            write_pfm(depthPath, frame.depth);
+            std::cout << "updated " << scene.name << std::endl;
+            continue;
+        }
+
+        Frame golden;
+        if (!read_ppm(colorPath, golden.color) || !read_pfm(depthPath, golden.depth)) {
+            std::cout << "FAIL " << scene.name << ": missing golden, run with --update" << std::endl;
+            failures++;
+            continue;
+        }
+
+        for (const Backend& backend : backends()) {
+            failures += check_backend(scene, mesh, backend, golden, writer, diffDir);
+        }
+
+        // Clustered point lights need no golden: the reference is every light summed in full
+        Frame allLights = render(scene, mesh, clustered_backend("lights-all", lights, true), 1);
+        failures += check_backend(scene, mesh, clustered_backend("lights-clustered", lights, false), allLights, writer, diffDir);
+    }
+
+    if (!update) failures += check_perspective_varyings();
+
+    writer.flush();
+    std::cout << (failures == 0 ? "all checks passed" : std::to_string(failures) + " checks failed") << std::endl;
+    return failures;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <string>
+
+// Golden-image regression harness. Renders a fixed set of scenes through every
+// rasterization backend and thread count, then compares framebuffer and zbuffer
+// with the goldens in goldenDir (per-pixel tolerance per backend). Every backend
+// must also be bit-exact across thread counts, and the kernel-backed ones across
+// every ISA the CPU supports (kernels.h). Failures leave a diff image in
+// goldenDir/diff. Clustered point lighting is checked the same way against every
+// light summed in full, which needs no golden, and perspective-correct varyings against
+// a floor plane solved analytically. With update set, the goldens are regenerated from
+// the scalar reference path instead. Returns the number of failed checks.
+int run_regression(const std::string& goldenDir, bool update);
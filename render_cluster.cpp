@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "render_cluster.h"
+
+namespace {
+
+bool send_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+#ifdef MSG_NOSIGNAL
+        ssize_t n = ::send(fd, p, len, MSG_NOSIGNAL); // a dead worker is an error, not SIGPIPE
+#else
+        ssize_t n = ::write(fd, p, len);
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+const char* target_name(const RenderRequest& request) {
+    auto is = [&](TargetPreset preset) {
+        TargetFormat f = target_preset(preset);
+        return request.target.color == f.color && request.target.depth == f.depth;
+    };
+    if (request.autoTarget) return "auto";
+    if (is(TargetPreset::DISPLAY)) return "display";
+    if (is(TargetPreset::COMPACT)) return "compact";
+    return "reference";
+}
+
+// The request as a protocol line, with the band as its region
+std::string request_line(const RenderRequest& request, const std::string& id, int y, int height) {
+    char line[1024];
+    std::snprintf(line, sizeof(line),
+        "render %s mesh=%s eye=%.17g,%.17g,%.17g center=%.17g,%.17g,%.17g up=%.17g,%.17g,%.17g size=%dx%d "
+        "rotation=%.9g light=%.17g,%.17g,%.17g color=%d,%d,%d region=0,%d,%d,%d target=%s format=tile\n",
+        id.c_str(), request.mesh.c_str(), request.eye.x, request.eye.y, request.eye.z,
+        request.center.x, request.center.y, request.center.z, request.up.x, request.up.y, request.up.z,
+        request.width, request.height, request.rotation, request.light.x, request.light.y, request.light.z,
+        request.color.r, request.color.g, request.color.b, y, request.width, height, target_name(request));
+    return line;
+}
+
+}
+
+RenderCluster::~RenderCluster() {
+    for (Worker& worker : this->workers) {
+        send_all(worker.fd, "quit\n", 5);
+        close(worker.fd);
+        if (worker.pid > 0) waitpid(worker.pid, nullptr, 0);
+    }
+}
+
+bool RenderCluster::spawn_local(int count, unsigned int threadsPerWorker) {
+    for (int i = 0; i < count; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            std::cerr << "socketpair: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "fork: " << std::strerror(errno) << std::endl;
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (pid == 0) {
+            // Worker: keep only its own end, so the others see EOF when the coordinator exits
+            close(fds[0]);
+            for (const Worker& worker : this->workers) close(worker.fd);
+            RenderServer server(1, threadsPerWorker); // the coordinator sends one band per frame
+            _exit(server.serve_fd(fds[1]));
+        }
+        close(fds[1]);
+        this->workers.push_back(Worker{ fds[0], pid, {} });
+    }
+    return true;
+}
+
+bool RenderCluster::connect(const std::string& socketPath) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "socket: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "connect " << socketPath << ": " << std::strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+    this->workers.push_back(Worker{ fd, 0, {} });
+    return true;
+}
+
+bool RenderCluster::read_line(Worker& worker, std::string& line) {
+    char chunk[4096];
+    size_t newline;
+    while ((newline = worker.buffer.find('\n')) == std::string::npos) {
+        ssize_t n = read(worker.fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        worker.buffer.append(chunk, n);
+    }
+    line = worker.buffer.substr(0, newline);
+    worker.buffer.erase(0, newline + 1);
+    return true;
+}
+
+bool RenderCluster::read_body(Worker& worker, size_t bytes, std::vector<uint8_t>& out) {
+    out.resize(bytes);
+    size_t have = std::min(bytes, worker.buffer.size());
+    std::memcpy(out.data(), worker.buffer.data(), have);
+    worker.buffer.erase(0, have);
+    while (have < bytes) {
+        ssize_t n = read(worker.fd, out.data() + have, bytes - have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        have += n;
+    }
+    return true;
+}
+
+bool RenderCluster::upload_mesh(const std::string& name, const Mesh& mesh) {
+    std::vector<uint8_t> data;
+    serialize_mesh(mesh, data);
+    std::string header = "upload " + name + " " + std::to_string(data.size()) + "\n";
+
+    // Send to everyone first so the workers decode in parallel
+    for (Worker& worker : this->workers) {
+        if (!send_all(worker.fd, header.data(), header.size()) || !send_all(worker.fd, data.data(), data.size())) {
+            std::cerr << "Could not upload " << name << " to a worker" << std::endl;
+            return false;
+        }
+    }
+    bool ok = true;
+    for (Worker& worker : this->workers) {
+        std::string line;
+        if (!read_line(worker, line) || line.compare(0, 3, "ok ") != 0) {
+            std::cerr << "Worker rejected " << name << ": " << line << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+void RenderCluster::plan_bands(int height) {
+    int rows = static_cast<int>(this->rowCost.size());
+    int count = std::min(rows, size());
+    std::vector<double> prefix(rows + 1, 0.0);
+    for (int t = 0; t < rows; t++) prefix[t + 1] = prefix[t] + this->rowCost[t];
+
+    // Cut where the running cost crosses each multiple of total / count, keeping every band non-empty
+    this->bands.clear();
+    this->bandRows.clear();
+    int first = 0;
+    for (int b = 0; b < count; b++) {
+        int last = rows;
+        if (b + 1 < count) {
+            double target = prefix[rows] * (b + 1) / count;
+            last = static_cast<int>(std::lower_bound(prefix.begin(), prefix.end(), target) - prefix.begin());
+            if (last > first + 1 && target - prefix[last - 1] < prefix[last] - target) last--; // nearer cut
+            last = std::clamp(last, first + 1, rows - (count - b - 1));
+        }
+        // Tile rows count from the bottom of the screen, image rows from the top
+        int top = std::max(0, height - last * Pipeline::TILE_SIZE);
+        int bottom = height - first * Pipeline::TILE_SIZE;
+        this->bands.push_back(Band{ top, bottom - top, static_cast<float>(prefix[last] - prefix[first]), 0.0f });
+        this->bandRows.emplace_back(first, last);
+        first = last;
+    }
+}
+
+void RenderCluster::update_costs() {
+    // Spread each band's measured time over its rows in the proportions estimated so far.
+    // Rows inside one band cannot be told apart, but the cuts move every frame and refine it.
+    for (size_t b = 0; b < this->bands.size(); b++) {
+        auto [first, last] = this->bandRows[b];
+        double estimated = this->bands[b].estimatedMs;
+        double measured = std::max(this->bands[b].renderMs, 1e-3f);
+        for (int t = first; t < last; t++) {
+            this->rowCost[t] = estimated > 0 ? this->rowCost[t] * measured / estimated : measured / (last - first);
+        }
+    }
+    // An empty row still costs its clear and readback; a floor keeps it from collapsing to zero
+    double mean = std::accumulate(this->rowCost.begin(), this->rowCost.end(), 0.0) / this->rowCost.size();
+    for (double& cost : this->rowCost) cost = std::max(cost, mean * 0.01);
+}
+
+bool RenderCluster::render(const RenderRequest& request, std::vector<Color>& color, std::vector<float>& depth) {
+    if (this->workers.empty()) {
+        std::cerr << "Render cluster has no workers" << std::endl;
+        return false;
+    }
+    if (request.width != this->costWidth || request.height != this->costHeight) {
+        // New frame size: start from a uniform estimate
+        this->costWidth = request.width;
+        this->costHeight = request.height;
+        this->rowCost.assign((request.height + Pipeline::TILE_SIZE - 1) / Pipeline::TILE_SIZE, 1.0);
+    }
+    plan_bands(request.height);
+
+    std::vector<std::string> ids(this->bands.size());
+    for (size_t b = 0; b < this->bands.size(); b++) {
+        ids[b] = std::to_string(this->nextId++);
+        std::string line = request_line(request, ids[b], this->bands[b].y, this->bands[b].height);
+        if (!send_all(this->workers[b].fd, line.data(), line.size())) {
+            std::cerr << "Could not send a request to worker " << b << std::endl;
+            return false;
+        }
+    }
+
+    color.resize(size_t(request.width) * request.height);
+    depth.resize(size_t(request.width) * request.height);
+
+    // The workers render concurrently; collecting in order only queues the faster ones' replies in their sockets
+    for (size_t b = 0; b < this->bands.size(); b++) {
+        Worker& worker = this->workers[b];
+        std::string line;
+        if (!read_line(worker, line)) {
+            std::cerr << "Worker " << b << " closed the connection" << std::endl;
+            return false;
+        }
+        std::istringstream status(line);
+        std::string word, id;
+        size_t bytes = 0;
+        status >> word >> id >> bytes;
+        if (word != "ok" || id != ids[b]) {
+            std::cerr << "Worker " << b << ": " << line << std::endl;
+            return false;
+        }
+        if (!read_body(worker, bytes, this->reply)) {
+            std::cerr << "Worker " << b << " closed the connection" << std::endl;
+            return false;
+        }
+
+        TileHeader header;
+        size_t pixels = size_t(this->bands[b].height) * request.width;
+        if (bytes != sizeof(header) + pixels * (sizeof(Color) + sizeof(float))) {
+            std::cerr << "Worker " << b << " sent a tile of the wrong size" << std::endl;
+            return false;
+        }
+        std::memcpy(&header, this->reply.data(), sizeof(header));
+        size_t offset = size_t(this->bands[b].y) * request.width; // bands span full rows
+        std::memcpy(color.data() + offset, this->reply.data() + sizeof(header), pixels * sizeof(Color));
+        std::memcpy(depth.data() + offset, this->reply.data() + sizeof(header) + pixels * sizeof(Color), pixels * sizeof(float));
+        this->bands[b].renderMs = header.renderMs;
+    }
+
+    update_costs();
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <string>
+#include <sys/types.h>
+#include <utility>
+#include <vector>
+
+#include "color.h"
+#include "mesh.h"
+#include "render_server.h"
+
+// Sort-first rendering across RenderServer processes. Each frame is cut into horizontal
+// bands of whole tile rows, one per worker; every worker draws the full mesh into its
+// band only (format=tile with a region) and the coordinator copies the returned color
+// and depth into the final buffers. Band boundaries follow the render times of the
+// previous frame, so a worker that drew a dense band gets fewer rows next time.
+class RenderCluster {
+public:
+    RenderCluster() = default;
+    ~RenderCluster(); // sends quit to every worker and reaps the ones it spawned
+
+    RenderCluster(const RenderCluster&) = delete;
+    RenderCluster& operator=(const RenderCluster&) = delete;
+
+    // Forks count local workers, each serving one end of a socketpair and rendering its band
+    // on threadsPerWorker threads. Call before anything starts threads (OpenMP included): a forked child
+    // only keeps the thread that forked.
+    bool spawn_local(int count, unsigned int threadsPerWorker);
+    // Adds a worker already listening with --serve <socket>
+    bool connect(const std::string& socketPath);
+    int size() const { return static_cast<int>(workers.size()); }
+
+    // Sends the mesh to every worker once; requests then refer to it by name
+    bool upload_mesh(const std::string& name, const Mesh& mesh);
+
+    // Renders the whole request.width x request.height frame. color and depth are laid
+    // out like Pipeline's framebuffer and zbuffer (row 0 at the top).
+    bool render(const RenderRequest& request, std::vector<Color>& color, std::vector<float>& depth);
+
+    struct Band {
+        int y, height;      // image rows
+        float estimatedMs;  // what the balancer expected
+        float renderMs;     // what the worker reported
+    };
+    const std::vector<Band>& last_frame() const { return bands; }
+
+private:
+    struct Worker {
+        int fd;
+        pid_t pid; // 0 for workers added with connect()
+        std::string buffer; // bytes read past the last reply
+    };
+
+    std::vector<Worker> workers;
+    std::vector<double> rowCost; // estimated ms per tile row, counted from the bottom like Pipeline's tiles
+    int costWidth = 0, costHeight = 0;
+    std::vector<Band> bands; // band i goes to worker i
+    std::vector<std::pair<int, int>> bandRows; // [first, last) tile row of each band
+    std::vector<uint8_t> reply;
+    uint64_t nextId = 0;
+
+    void plan_bands(int height);
+    void update_costs();
+    bool read_line(Worker& worker, std::string& line);
+    bool read_body(Worker& worker, size_t bytes, std::vector<uint8_t>& out);
+};
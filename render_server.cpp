@@ -0,0 +1,473 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mesh_loader.h"
+#include "render_server.h"
+#include "renderer.h"
+#include "shader.h"
+
+namespace {
+
+bool parse_vec3(const std::string& value, vec3& v) {
+    return std::sscanf(value.c_str(), "%lf,%lf,%lf", &v.x, &v.y, &v.z) == 3;
+}
+
+bool write_all(int fd, const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+size_t target_bytes(const Pipeline& target) {
+    return size_t(target.get_width()) * target.get_height() * bytes_per_pixel(target.get_format());
+}
+
+}
+
+bool parse_request(const std::string& line, RenderRequest& request, std::string& error) {
+    std::istringstream stream(line);
+    std::string command;
+    stream >> command >> request.id;
+    if (command != "render" || request.id.empty()) {
+        error = "expected: render <id> mesh=<path> ...";
+        return false;
+    }
+
+    std::string token;
+    while (stream >> token) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) {
+            error = "bad argument " + token;
+            return false;
+        }
+        std::string key = token.substr(0, eq);
+        std::string value = token.substr(eq + 1);
+
+        bool ok = true;
+        if (key == "mesh") {
+            request.mesh = value;
+        }
+        else if (key == "eye") {
+            ok = parse_vec3(value, request.eye);
+        }
+        else if (key == "center") {
+            ok = parse_vec3(value, request.center);
+        }
+        else if (key == "up") {
+            ok = parse_vec3(value, request.up);
+        }
+        else if (key == "light") {
+            ok = parse_vec3(value, request.light);
+        }
+        else if (key == "size") {
+            ok = std::sscanf(value.c_str(), "%dx%d", &request.width, &request.height) == 2 &&
+                request.width > 0 && request.height > 0 && request.width <= 16384 && request.height <= 16384;
+        }
+        else if (key == "rotation") {
+            ok = std::sscanf(value.c_str(), "%f", &request.rotation) == 1;
+        }
+        else if (key == "color") {
+            int r, g, b;
+            ok = std::sscanf(value.c_str(), "%d,%d,%d", &r, &g, &b) == 3 &&
+                r >= 0 && g >= 0 && b >= 0 && r <= 255 && g <= 255 && b <= 255;
+            request.color = Color{ static_cast<unsigned char>(r), static_cast<unsigned char>(g), static_cast<unsigned char>(b) };
+        }
+        else if (key == "region") {
+            ok = std::sscanf(value.c_str(), "%d,%d,%d,%d", &request.regionX, &request.regionY, &request.regionWidth, &request.regionHeight) == 4 &&
+                request.regionX >= 0 && request.regionY >= 0 && request.regionWidth > 0 && request.regionHeight > 0;
+        }
+        else if (key == "target") {
+            request.autoTarget = value == "auto";
+            if (value == "reference") request.target = target_preset(TargetPreset::REFERENCE);
+            else if (value == "display") request.target = target_preset(TargetPreset::DISPLAY);
+            else if (value == "compact") request.target = target_preset(TargetPreset::COMPACT);
+            else ok = request.autoTarget;
+        }
+        else if (key == "format") {
+            request.raw = value == "raw";
+            request.tile = value == "tile";
+            if (value == "ppm") request.format = ImageFormat::PPM;
+            else if (value == "qoi") request.format = ImageFormat::QOI;
+            else if (value == "png") request.format = ImageFormat::PNG_FAST;
+            else if (value == "png-stored") request.format = ImageFormat::PNG;
+            else ok = request.raw || request.tile;
+        }
+        else {
+            ok = false;
+        }
+
+        if (!ok) {
+            error = "bad argument " + token;
+            return false;
+        }
+    }
+
+    if (request.mesh.empty()) {
+        error = "missing mesh=<path>";
+        return false;
+    }
+    if (request.autoTarget) request.target = target_preset_for(request.width, request.height);
+    if (request.regionWidth > 0 && (request.regionX + request.regionWidth > request.width || request.regionY + request.regionHeight > request.height)) {
+        error = "region outside the frame";
+        return false;
+    }
+    return true;
+}
+
+RenderServer::RenderServer(unsigned int workers, unsigned int renderThreads) : pool(workers),
+    renderThreads(static_cast<int>(renderThreads > 0 ? renderThreads : std::max(1u, std::thread::hardware_concurrency() / std::max(1u, workers)))) {}
+
+int RenderServer::serve_stdio() {
+    std::signal(SIGPIPE, SIG_IGN);
+
+    // Replies get a private copy of stdout; everything else printed to stdout
+    // (mesh loading messages and the like) is sent to stderr so it cannot corrupt the stream
+    std::cout.flush();
+    int replyFd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    serve_stream(STDIN_FILENO, replyFd);
+    close(replyFd);
+    return 0;
+}
+
+int RenderServer::serve_fd(int fd) {
+    std::signal(SIGPIPE, SIG_IGN);
+    serve_stream(fd, fd);
+    return 0;
+}
+
+int RenderServer::serve_socket(const std::string& path) {
+    std::signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return 1;
+    }
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::perror("socket");
+        return 1;
+    }
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listener, 16) < 0) {
+        std::perror("bind/listen");
+        close(listener);
+        return 1;
+    }
+    std::cerr << "Render server listening on " << path << std::endl;
+
+    for (;;) {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            std::perror("accept");
+            break;
+        }
+        std::thread([this, client] {
+            serve_stream(client, client);
+            close(client);
+        }).detach();
+    }
+
+    close(listener);
+    unlink(path.c_str());
+    return 1;
+}
+
+void RenderServer::serve_stream(int inFd, int outFd) {
+    std::mutex mutex; // guards outFd and inFlight
+    std::condition_variable idle;
+    int inFlight = 0;
+
+    auto reply = [&](const std::string& header, const std::vector<uint8_t>& body) {
+        std::lock_guard<std::mutex> lock(mutex);
+        write_all(outFd, header.data(), header.size());
+        write_all(outFd, body.data(), body.size());
+    };
+
+    std::string buffer;
+    char chunk[4096];
+    bool quit = false;
+    while (!quit) {
+        ssize_t n = read(inFd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buffer.append(chunk, n);
+
+        size_t newline;
+        while (!quit && (newline = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, newline);
+            buffer.erase(0, newline + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty()) continue;
+            if (line == "quit") {
+                quit = true;
+                break;
+            }
+
+            if (line.compare(0, 7, "upload ") == 0) {
+                std::istringstream args(line.substr(7));
+                std::string name;
+                size_t bytes = 0;
+                if (!(args >> name >> bytes)) {
+                    reply("error - expected: upload <name> <bytes>\n", {});
+                    continue;
+                }
+                // The payload cannot be skipped without reading it, so an oversized one ends the connection
+                if (bytes > MAX_UPLOAD_BYTES) {
+                    reply("error " + name + " upload too large\n", {});
+                    quit = true;
+                    break;
+                }
+                // The mesh data follows the line directly and may be partly unread
+                while (buffer.size() < bytes) {
+                    ssize_t got = read(inFd, chunk, sizeof(chunk));
+                    if (got < 0 && errno == EINTR) continue;
+                    if (got <= 0) break;
+                    buffer.append(chunk, got);
+                }
+                if (buffer.size() < bytes) {
+                    quit = true; // connection closed mid-upload
+                    break;
+                }
+                Mesh mesh;
+                bool valid = deserialize_mesh(reinterpret_cast<const uint8_t*>(buffer.data()), bytes, mesh);
+                buffer.erase(0, bytes);
+                if (valid) {
+                    add_mesh(name, std::make_shared<const Mesh>(std::move(mesh)));
+                    reply("ok " + name + " 0\n", {});
+                }
+                else {
+                    reply("error " + name + " bad mesh data\n", {});
+                }
+                continue;
+            }
+
+            RenderRequest request;
+            std::string error;
+            if (!parse_request(line, request, error)) {
+                reply("error " + (request.id.empty() ? std::string("-") : request.id) + " " + error + "\n", {});
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                inFlight++;
+            }
+            pool.submit([this, request, &reply, &mutex, &idle, &inFlight] {
+                std::vector<uint8_t> frame = render(request);
+                if (frame.empty()) {
+                    reply("error " + request.id + " could not load " + request.mesh + "\n", {});
+                }
+                else {
+                    reply("ok " + request.id + " " + std::to_string(frame.size()) + "\n", frame);
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                inFlight--;
+                idle.notify_all();
+            });
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [&] { return inFlight == 0; }); // jobs still reference this stream
+}
+
+std::vector<uint8_t> RenderServer::render(const RenderRequest& request) {
+    std::shared_ptr<const Mesh> mesh = get_mesh(request.mesh);
+    if (!mesh) return {};
+
+    std::unique_ptr<Pipeline> target = acquire_target(request.width, request.height, request.target);
+    target->set_threads(this->renderThreads); // concurrent requests share the cores instead of each taking all of them
+    target->lookat(request.eye, request.center, request.up);
+    target->init_perspective(magnitude(request.eye - request.center));
+    target->init_viewport(0, 0, request.width, request.height);
+
+    bool region = request.regionWidth > 0;
+    int rx = region ? request.regionX : 0, ry = region ? request.regionY : 0;
+    int rw = region ? request.regionWidth : request.width, rh = region ? request.regionHeight : request.height;
+    if (region) {
+        // Only the tiles under the region are rasterized. Every format but tile encodes the whole
+        // target, so it is cleared in full first: a pooled target still holds the last request's frame.
+        if (!request.tile) {
+            target->invalidate();
+            target->begin_frame();
+        }
+        target->end_frame();
+        target->invalidate(Rect{ rx, request.height - ry - rh, rx + rw - 1, request.height - 1 - ry });
+    }
+    else {
+        target->invalidate();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    target->begin_frame();
+
+    PhongShader shader;
+    shader.eye = request.eye;
+    shader.lightPos = request.light;
+    shader.color = request.color;
+    draw_mesh(*target, shader, *mesh, request.rotation);
+    target->end_frame();
+
+    float renderMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // Replies are always rgb24 and float depth; packed and reduced targets are converted here
+    std::vector<Color> unpacked;
+    const Color* color = target->get_framebuffer_data();
+    if (!color) {
+        unpacked.resize(target->get_framebuffer_size());
+        target->read_rgb(unpacked.data());
+        color = unpacked.data();
+    }
+
+    std::vector<uint8_t> out;
+    const uint8_t* rgb = reinterpret_cast<const uint8_t*>(color);
+    if (request.tile) {
+        std::vector<float> decoded;
+        const float* depth = target->get_zbuffer().data();
+        if (request.target.depth != DepthFormat::FLOAT32) {
+            decoded.resize(target->get_framebuffer_size());
+            target->read_depth(decoded.data());
+            depth = decoded.data();
+        }
+
+        TileHeader header{ rx, ry, rw, rh, renderMs, 0 };
+        size_t colorBytes = size_t(rw) * rh * sizeof(Color);
+        out.resize(sizeof(header) + colorBytes + size_t(rw) * rh * sizeof(float));
+        std::memcpy(out.data(), &header, sizeof(header));
+        for (int j = 0; j < rh; j++) {
+            size_t row = size_t(ry + j) * request.width + rx; // framebuffer rows run top to bottom
+            std::memcpy(out.data() + sizeof(header) + size_t(j) * rw * sizeof(Color), color + row, rw * sizeof(Color));
+            std::memcpy(out.data() + sizeof(header) + colorBytes + size_t(j) * rw * sizeof(float), depth + row, rw * sizeof(float));
+        }
+    }
+    else if (request.raw) {
+        out.assign(rgb, rgb + target->get_framebuffer_size() * sizeof(Color));
+    }
+    else {
+        encode_image(request.format, rgb, request.width, request.height, out);
+    }
+
+    release_target(std::move(target));
+    return out;
+}
+
+void RenderServer::add_mesh(const std::string& name, std::shared_ptr<const Mesh> mesh) {
+    std::promise<std::shared_ptr<const Mesh>> promise;
+    promise.set_value(std::move(mesh));
+    std::lock_guard<std::mutex> lock(meshMutex);
+    meshes[name] = promise.get_future().share();
+}
+
+bool RenderServer::set_asset_root(const std::string& path) {
+    std::error_code ec;
+    std::filesystem::path root = std::filesystem::canonical(path, ec);
+    if (ec || !std::filesystem::is_directory(root)) {
+        std::cerr << "Asset root " << path << " is not a directory" << std::endl;
+        return false;
+    }
+    this->assetRoot = root;
+    return true;
+}
+
+bool RenderServer::resolve_asset(const std::string& path, std::string& file) const {
+    namespace fs = std::filesystem;
+    if (this->assetRoot.empty() || path.empty() || fs::path(path).is_absolute()) return false;
+    // Symlinks are followed before the check, so a link cannot lead out of the root either
+    std::error_code ec;
+    fs::path resolved = fs::weakly_canonical(this->assetRoot / path, ec);
+    if (ec) return false;
+    fs::path relative = resolved.lexically_relative(this->assetRoot);
+    if (relative.empty() || *relative.begin() == "..") return false;
+    file = resolved.string();
+    return true;
+}
+
+std::shared_ptr<const Mesh> RenderServer::get_mesh(const std::string& path) {
+    std::promise<std::shared_ptr<const Mesh>> promise;
+    std::shared_future<std::shared_ptr<const Mesh>> future;
+    bool first = false;
+    {
+        std::lock_guard<std::mutex> lock(meshMutex);
+        auto it = meshes.find(path);
+        if (it == meshes.end()) {
+            future = promise.get_future().share();
+            meshes.emplace(path, future);
+            first = true;
+        }
+        else {
+            future = it->second;
+        }
+    }
+
+    // The first request for a mesh loads it, concurrent requests wait for the same result
+    if (first) {
+        Mesh mesh;
+        std::shared_ptr<const Mesh> loaded;
+        std::string file;
+        if (!resolve_asset(path, file)) {
+            std::cerr << "Refusing mesh path " << path << " outside the asset root" << std::endl;
+        }
+        if (!file.empty() && load_mesh(file, mesh, false)) {
+            loaded = std::make_shared<const Mesh>(std::move(mesh));
+        }
+        else {
+            std::lock_guard<std::mutex> lock(meshMutex);
+            meshes.erase(path); // let a later request retry
+        }
+        promise.set_value(loaded);
+    }
+    return future.get();
+}
+
+std::unique_ptr<Pipeline> RenderServer::acquire_target(int width, int height, TargetFormat format) {
+    {
+        std::lock_guard<std::mutex> lock(targetMutex);
+        for (auto it = idleTargets.begin(); it != idleTargets.end(); ++it) {
+            TargetFormat f = (*it)->get_format();
+            if ((*it)->get_width() == width && (*it)->get_height() == height && f.color == format.color && f.depth == format.depth) {
+                std::unique_ptr<Pipeline> target = std::move(*it);
+                idleTargets.erase(it);
+                idleBytes -= target_bytes(*target);
+                return target;
+            }
+        }
+    }
+    return std::make_unique<Pipeline>(width, height, format);
+}
+
+void RenderServer::release_target(std::unique_ptr<Pipeline> target) {
+    size_t bytes = target_bytes(*target);
+    if (bytes > MAX_IDLE_TARGET_BYTES) return; // too large to keep around
+
+    std::lock_guard<std::mutex> lock(targetMutex);
+    while (idleBytes + bytes > MAX_IDLE_TARGET_BYTES) {
+        idleBytes -= target_bytes(*idleTargets.front());
+        idleTargets.erase(idleTargets.begin()); // drop the least recently released
+    }
+    idleTargets.push_back(std::move(target));
+    idleBytes += bytes;
+}
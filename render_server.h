@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "color.h"
+#include "geometry.h"
+#include "image_writer.h"
+#include "mesh.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+// One line of the server protocol:
+//   render <id> mesh=<path> [eye=x,y,z] [center=x,y,z] [up=x,y,z] [size=WxH] [rotation=rad]
+//          [light=x,y,z] [color=r,g,b] [format=ppm|qoi|png|png-stored|raw|tile] [region=x,y,w,h]
+//          [target=reference|display|compact|auto]
+// mesh is an uploaded mesh's name or an OBJ path relative to the asset root; paths leading
+// outside the root are refused.
+// The reply is "ok <id> <bytes>\n" followed by the encoded frame, or "error <id> <message>\n".
+// Replies can arrive in a different order than the requests, matched by id.
+//
+// region limits rendering to a rectangle in image coordinates (top-left origin); only the
+// tiles under it are rasterized, and other formats than tile show background elsewhere. target picks the render target layout (TargetPreset);
+// auto uses target_preset_for() the size. Replies are rgb24 and float depth either way. format=tile replies with a TileHeader, the region's rgb24
+// pixels and its float depths, so a coordinator can composite color and depth.
+//
+//   upload <name> <bytes>
+// followed by <bytes> of serialize_mesh() output stores a mesh under name; later requests
+// use it with mesh=<name>. The reply is "ok <name> 0\n" or an error line; uploads larger
+// than MAX_UPLOAD_BYTES are refused with "upload too large" and close the connection.
+struct RenderRequest {
+    std::string id;
+    std::string mesh;
+    vec3 eye{ -1, 0, 2 };
+    vec3 center{ 0, 0, 0 };
+    vec3 up{ 0, 1, 0 };
+    int width = 256, height = 256;
+    float rotation = 0.0f;
+    vec3 light{ 2, 2, 3 };
+    Color color{ 200, 200, 200 };
+    ImageFormat format = ImageFormat::PNG_FAST;
+    bool raw = false; // rgb24 bytes without any container
+    bool tile = false; // TileHeader + rgb24 + float depth of the region
+    int regionX = 0, regionY = 0, regionWidth = 0, regionHeight = 0; // zero width = whole frame
+    TargetFormat target;
+    bool autoTarget = false; // target=auto, resolved once the size is known
+};
+
+struct TileHeader {
+    int32_t x, y, width, height; // region in image coordinates
+    float renderMs;              // time spent rendering it on the server
+    uint32_t reserved;
+};
+
+bool parse_request(const std::string& line, RenderRequest& request, std::string& error);
+
+// Long-running renderer: meshes and render targets stay resident between requests
+// and requests are rendered concurrently on a worker pool. Each request rasterizes on
+// renderThreads OpenMP threads; 0 splits the cores evenly between the workers.
+class RenderServer {
+public:
+    explicit RenderServer(unsigned int workers = std::thread::hardware_concurrency(), unsigned int renderThreads = 0);
+
+    int serve_stdio();                        // requests on stdin, replies on stdout
+    int serve_socket(const std::string& path); // Unix domain socket, any number of clients
+    int serve_fd(int fd);                      // one connected socket, e.g. a socketpair end
+
+    void add_mesh(const std::string& name, std::shared_ptr<const Mesh> mesh);
+    // Directory mesh=<path> may load from. Until one is set only uploaded meshes are served.
+    // The server never writes mesh caches there.
+    bool set_asset_root(const std::string& path);
+
+    std::vector<uint8_t> render(const RenderRequest& request); // encoded frame, empty if the mesh failed to load
+
+private:
+    static constexpr size_t MAX_IDLE_TARGET_BYTES = size_t(512) << 20; // color and depth of every pooled target
+    static constexpr size_t MAX_UPLOAD_BYTES = size_t(1) << 30;
+
+    ThreadPool pool;
+    int renderThreads;
+
+    std::filesystem::path assetRoot; // canonical, empty if unset
+    std::mutex meshMutex;
+    std::map<std::string, std::shared_future<std::shared_ptr<const Mesh>>> meshes;
+
+    std::mutex targetMutex;
+    std::vector<std::unique_ptr<Pipeline>> idleTargets;
+    size_t idleBytes = 0;
+
+    void serve_stream(int inFd, int outFd);
+    std::shared_ptr<const Mesh> get_mesh(const std::string& path);
+    bool resolve_asset(const std::string& path, std::string& file) const;
+    std::unique_ptr<Pipeline> acquire_target(int width, int height, TargetFormat format);
+    void release_target(std::unique_ptr<Pipeline> target);
+};
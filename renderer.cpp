@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <cmath>
+
+#include "renderer.h"
+
+namespace {
+
+struct WorldVertex {
+    vec3 position, normal;
+};
+
+}
+
+void draw_mesh(Pipeline& pipeline, Pipeline::IShader& shader, const Mesh& mesh, float rotation) {
+    // Rotation around the Y axis is applied to the model before the pipeline transform
+    float cosR = cos(rotation);
+    float sinR = sin(rotation);
+    auto rotate_y = [&](vec3 v) {
+        return vec3{ v.x * cosR + v.z * sinR, v.y, -v.x * sinR + v.z * cosR };
+        };
+
+    VertexCache<Pipeline::VertexOutput> cache;
+    auto shade_vertex = [&](uint32_t i) {
+        vec3 v = rotate_y(mesh.positions[i]);
+        vec3 n = normalize(rotate_y(mesh.normals[i]));
+        return pipeline.transform_vertex(shader, v, n);
+    };
+
+    for (size_t t = 0; t < mesh.triangle_count(); t++) {
+        const uint32_t* tri = &mesh.indices[t * 3];
+
+        // Copies, because a later lookup may evict an earlier corner from the cache
+        Pipeline::VertexOutput out0 = cache.get(tri[0], shade_vertex);
+        Pipeline::VertexOutput out1 = cache.get(tri[1], shade_vertex);
+        Pipeline::VertexOutput out2 = cache.get(tri[2], shade_vertex);
+
+        auto clip = pipeline.assemble_triangle(shader, out0, out1, out2);
+        pipeline.rasterize(clip, shader);
+    }
+}
+
+bool mesh_screen_bounds(const Pipeline& pipeline, const Mesh& mesh, float rotation, Rect& out) {
+    if (mesh.positions.empty()) return false;
+    vec3 lo = mesh.positions[0], hi = mesh.positions[0];
+    for (const vec3& p : mesh.positions) {
+        lo = vec3{ std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z) };
+        hi = vec3{ std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z) };
+    }
+
+    // The corners of the model-space box, rotated like draw_mesh() rotates vertices, enclose the rotated mesh
+    float cosR = cos(rotation);
+    float sinR = sin(rotation);
+    mat<4, 4> toClip = pipeline.get_perspective() * pipeline.get_modelview();
+    vec4 corners[8];
+    for (int i = 0; i < 8; i++) {
+        vec3 c{ (i & 1) ? hi.x : lo.x, (i & 2) ? hi.y : lo.y, (i & 4) ? hi.z : lo.z };
+        corners[i] = toClip * vec4{ c.x * cosR + c.z * sinR, c.y, -c.x * sinR + c.z * cosR, 1.0 };
+    }
+    return pipeline.screen_bounds(corners, 8, out);
+}
+
+void apply_camera(Pipeline& pipeline, const Camera& camera) {
+    pipeline.lookat(camera.eye, camera.center, camera.up);
+    pipeline.init_perspective(magnitude(camera.eye - camera.center));
+    pipeline.init_viewport(0, 0, pipeline.get_width(), pipeline.get_height());
+}
+
+void draw_mesh_multiview(const std::vector<RenderView>& views, const Mesh& mesh, float rotation) {
+    float cosR = cos(rotation);
+    float sinR = sin(rotation);
+    auto rotate_y = [&](vec3 v) {
+        return vec3{ v.x * cosR + v.z * sinR, v.y, -v.x * sinR + v.z * cosR };
+        };
+
+    if (views.empty()) return;
+
+    // Per-view scratch comes from the first view's frame arena, so repeated frames do not allocate
+    FrameArena& arena = views[0].pipeline->frame_arena();
+
+    // Eyes taken into object space once, so culling needs no per-triangle transform
+    vec3* objectEyes = arena.allocate<vec3>(views.size());
+    for (size_t v = 0; v < views.size(); v++) {
+        vec3 e = views[v].eye;
+        objectEyes[v] = vec3{ e.x * cosR - e.z * sinR, e.y, e.x * sinR + e.z * cosR };
+    }
+
+    VertexCache<WorldVertex> fetched;
+    auto fetch_vertex = [&](uint32_t i) {
+        return WorldVertex{ rotate_y(mesh.positions[i]), normalize(rotate_y(mesh.normals[i])) };
+    };
+    VertexCache<Pipeline::VertexOutput>* shaded = arena.allocate_zeroed<VertexCache<Pipeline::VertexOutput>>(views.size());
+    uint8_t* facing = arena.allocate<uint8_t>(views.size());
+
+    for (size_t t = 0; t < mesh.triangle_count(); t++) {
+        const uint32_t* tri = &mesh.indices[t * 3];
+        const vec3& p0 = mesh.positions[tri[0]];
+        vec3 faceNormal = cross(mesh.positions[tri[1]] - p0, mesh.positions[tri[2]] - p0);
+
+        bool anyFacing = false;
+        for (size_t v = 0; v < views.size(); v++) {
+            facing[v] = dot(faceNormal, objectEyes[v] - p0) > 0;
+            anyFacing = anyFacing || facing[v];
+        }
+        if (!anyFacing) continue;
+
+        WorldVertex w[3] = { fetched.get(tri[0], fetch_vertex), fetched.get(tri[1], fetch_vertex), fetched.get(tri[2], fetch_vertex) };
+
+        for (size_t v = 0; v < views.size(); v++) {
+            if (!facing[v]) continue;
+            Pipeline& pipeline = *views[v].pipeline;
+            Pipeline::IShader& shader = *views[v].shader;
+
+            Pipeline::VertexOutput out[3];
+            for (int k = 0; k < 3; k++) {
+                out[k] = shaded[v].get(tri[k], [&](uint32_t) { return pipeline.transform_vertex(shader, w[k].position, w[k].normal); });
+            }
+            auto clip = pipeline.assemble_triangle(shader, out[0], out[1], out[2]);
+            pipeline.rasterize(clip, shader);
+        }
+    }
+}
+
+std::vector<Camera> stereo_cameras(const Camera& camera, double separation) {
+    vec3 forward = normalize(camera.center - camera.eye);
+    vec3 right = normalize(cross(forward, camera.up)) * (separation / 2);
+    // Parallel axes: both eyes keep the original viewing direction
+    return {
+        Camera{ camera.eye - right, camera.center - right, camera.up },
+        Camera{ camera.eye + right, camera.center + right, camera.up },
+    };
+}
+
+std::vector<Camera> cube_map_cameras(const vec3& position) {
+    // With the focal length equal to the eye-center distance, a unit offset gives a 90 degree face
+    return {
+        Camera{ position, position + vec3{ 1, 0, 0 }, vec3{ 0, 1, 0 } },
+        Camera{ position, position + vec3{ -1, 0, 0 }, vec3{ 0, 1, 0 } },
+        Camera{ position, position + vec3{ 0, 1, 0 }, vec3{ 0, 0, -1 } },
+        Camera{ position, position + vec3{ 0, -1, 0 }, vec3{ 0, 0, 1 } },
+        Camera{ position, position + vec3{ 0, 0, 1 }, vec3{ 0, 1, 0 } },
+        Camera{ position, position + vec3{ 0, 0, -1 }, vec3{ 0, 1, 0 } },
+    };
+}
+
+std::vector<Camera> orbit_cameras(const vec3& center, double distance, double height, int count) {
+    std::vector<Camera> cameras;
+    for (int i = 0; i < count; i++) {
+        double angle = 2 * M_PI * i / count;
+        vec3 eye = center + vec3{ distance * std::sin(angle), height, distance * std::cos(angle) };
+        cameras.push_back(Camera{ eye, center, vec3{ 0, 1, 0 } });
+    }
+    return cameras;
+}
+
+std::vector<Color> compose_grid(const std::vector<const Pipeline*>& tiles, int columns, int& width, int& height) {
+    if (tiles.empty() || columns <= 0) {
+        width = height = 0;
+        return {};
+    }
+    int tileW = tiles[0]->get_width(), tileH = tiles[0]->get_height();
+    int rows = (static_cast<int>(tiles.size()) + columns - 1) / columns;
+    width = tileW * columns;
+    height = tileH * rows;
+
+    std::vector<Color> sheet(size_t(width) * height, Color{ 0, 0, 0 });
+    std::vector<Color> unpacked; // for targets that are not RGB8
+    for (size_t i = 0; i < tiles.size(); i++) {
+        int ox = static_cast<int>(i % columns) * tileW;
+        int oy = static_cast<int>(i / columns) * tileH;
+        const Color* src = tiles[i]->get_framebuffer_data();
+        if (!src) {
+            unpacked.resize(size_t(tileW) * tileH);
+            tiles[i]->read_rgb(unpacked.data());
+            src = unpacked.data();
+        }
+        for (int y = 0; y < tileH; y++) {
+            std::copy(src + size_t(y) * tileW, src + size_t(y + 1) * tileW, sheet.begin() + size_t(oy + y) * width + ox);
+        }
+    }
+    return sheet;
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <cmath>
+#include <vector>
+
+#include "mesh.h"
+#include "mesh_optimizer.h"
+#include "pipeline.h"
+
+// FIFO cache keyed by vertex index, the model compute_acmr() measures
+template<typename T>
+struct VertexCache {
+    uint32_t index[POST_TRANSFORM_CACHE_SIZE];
+    T value[POST_TRANSFORM_CACHE_SIZE];
+    int fill = 0, head = 0;
+
+    template<typename F>
+    const T& get(uint32_t i, F&& compute) {
+        for (int c = 0; c < fill; c++) {
+            if (index[c] == i) return value[c];
+        }
+        int slot = head;
+        head = (head + 1) % POST_TRANSFORM_CACHE_SIZE;
+        if (fill < POST_TRANSFORM_CACHE_SIZE) fill++;
+        index[slot] = i;
+        value[slot] = compute(i);
+        return value[slot];
+    }
+};
+
+// Draws every triangle of the mesh, rotated by `rotation` radians around the Y axis.
+// Vertices go through a small FIFO post-transform cache, so meshes ordered by
+// optimize_mesh() run the vertex shader far fewer than three times per triangle.
+void draw_mesh(Pipeline& pipeline, Pipeline::IShader& shader, const Mesh& mesh, float rotation);
+
+// Screen rectangle draw_mesh() can touch with the pipeline's current camera: the projected
+// box around the rotated mesh. False when part of it is behind the camera.
+bool mesh_screen_bounds(const Pipeline& pipeline, const Mesh& mesh, float rotation, Rect& out);
+
+// draw_mesh() for a varying shader (see Pipeline::VaryingVertex). The shader type is known
+// here, so vertex() and fragment() are direct calls, and a triangle is just its three cached
+// vertices: nothing is copied into the shader per triangle.
+template<class Shader>
+void draw_mesh_varyings(Pipeline& pipeline, const Shader& shader, const Mesh& mesh, float rotation) {
+    float cosR = std::cos(rotation);
+    float sinR = std::sin(rotation);
+    auto rotate_y = [&](vec3 v) {
+        return vec3{ v.x * cosR + v.z * sinR, v.y, -v.x * sinR + v.z * cosR };
+        };
+
+    const mat<4, 4> modelview = pipeline.get_modelview(), perspective = pipeline.get_perspective(), normalMatrix = pipeline.get_normal_matrix();
+    VertexCache<Pipeline::VaryingVertex<Shader::VARYINGS>> cache;
+    auto shade_vertex = [&](uint32_t i) {
+        return shader.vertex(rotate_y(mesh.positions[i]), normalize(rotate_y(mesh.normals[i])), modelview, perspective, normalMatrix);
+    };
+
+    for (size_t t = 0; t < mesh.triangle_count(); t++) {
+        const uint32_t* tri = &mesh.indices[t * 3];
+
+        // Copies, because a later lookup may evict an earlier corner from the cache
+        const Pipeline::VaryingVertex<Shader::VARYINGS> corners[3] = { cache.get(tri[0], shade_vertex), cache.get(tri[1], shade_vertex), cache.get(tri[2], shade_vertex) };
+        pipeline.rasterize(corners, shader);
+    }
+}
+
+struct Camera {
+    vec3 eye, center, up;
+};
+
+// lookat + perspective + full-target viewport, the setup every caller repeats
+void apply_camera(Pipeline& pipeline, const Camera& camera);
+
+// One camera of a multi-view draw. The pipeline must already have its camera applied
+// and its frame begun; each view needs its own shader since shaders hold per-triangle state.
+struct RenderView {
+    Pipeline* pipeline;
+    Pipeline::IShader* shader;
+    vec3 eye;
+};
+
+// Draws the mesh into every view in one pass over its triangles: each triangle is fetched,
+// rotated and backface-tested in object space once, then shaded and rasterized per view.
+// Triangles facing away from all the views never reach a vertex shader.
+void draw_mesh_multiview(const std::vector<RenderView>& views, const Mesh& mesh, float rotation);
+
+// Camera presets for multi-view rendering
+std::vector<Camera> stereo_cameras(const Camera& camera, double separation);         // left, right
+std::vector<Camera> cube_map_cameras(const vec3& position);                          // +X, -X, +Y, -Y, +Z, -Z (90 degree faces)
+std::vector<Camera> orbit_cameras(const vec3& center, double distance, double height, int count);
+
+// Lays equally sized targets out row by row into one image
+std::vector<Color> compose_grid(const std::vector<const Pipeline*>& tiles, int columns, int& width, int& height);
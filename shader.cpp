@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <cmath>
+
+#include "kernels.h"
+#include "shader.h"
+
+namespace {
+
+void fill_spec_table(float* table, int size, double shininess) {
+    for (int i = 0; i <= size; i++) {
+        table[i] = static_cast<float>(std::pow(static_cast<double>(i) / size, shininess));
+    }
+}
+
+}
+
+PhongShader::PhongShader(double shininess) : shininess(shininess) {
+    fill_spec_table(specTable, SPEC_TABLE_SIZE, shininess);
+    kernelInput.shininess = static_cast<float>(shininess);
+    kernelInput.specTableSize = SPEC_TABLE_SIZE;
+}
+
+Pipeline::VertexOutput PhongShader::vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) {
+    // Transform vertex to clip space
+    vec4 clipPos = perspective * modelview * vec4{ v.x, v.y, v.z, 1.0 };
+
+    // Transform normal by inverse transpose
+    vec4 normalTransformed = normalMatrix * vec4{ n.x, n.y, n.z, 0.0 };
+    vec3 normalVec = normalize(vec3{ normalTransformed.x, normalTransformed.y, normalTransformed.z });
+
+    // Return all outputs
+    Pipeline::VertexOutput output;
+    output.clipPos = clipPos;
+    output.worldPos = v;  // Store world-space position (after model rotation, before ModelView)
+    output.normal = normalVec;
+    return output;
+}
+
+void PhongShader::setup_triangle(const vec3 pos[3], const vec3 norm[3]) {
+    for (int i = 0; i < 3; i++) {
+        tri_pos[i] = pos[i];
+        tri_norm[i] = norm[i];
+        for (int c = 0; c < 3; c++) {
+            kernelInput.pos[i][c] = static_cast<float>(pos[i][c]);
+            kernelInput.norm[i][c] = static_cast<float>(norm[i][c]);
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        kernelInput.eye[c] = static_cast<float>(eye[c]);
+        kernelInput.light[c] = static_cast<float>(lightPos[c]);
+    }
+}
+
+std::pair<bool, Color> PhongShader::fragment(const vec3& bar) const {
+    Color baseColor = this->color;
+
+    vec3 normal = bar[0] * tri_norm[0] + bar[1] * tri_norm[1] + bar[2] * tri_norm[2];
+    vec3 fragPos = bar[0] * tri_pos[0] + bar[1] * tri_pos[1] + bar[2] * tri_pos[2];
+
+    vec3 lightDir = normalize(lightPos - fragPos);
+    vec3 viewDir = normalize(eye - fragPos);
+    vec3 reflectDir = reflect(-lightDir, normal);
+
+    float ambient = 0.1;
+    float diff = std::max(dot(normal, lightDir), 0.0);
+    float spec = std::pow(std::max(dot(viewDir, reflectDir), 0.0), shininess);
+
+    float intensity = ambient + diff + spec;
+    Color result = baseColor * intensity;
+
+    return { false, result };
+}
+
+void PhongShader::fragment_batch(Pipeline::FragmentBatch& batch) const {
+    constexpr int N = Pipeline::BATCH_SIZE;
+    static_assert(N == KERNEL_BATCH_SIZE, "kernel batch width out of sync with the pipeline");
+
+    PhongKernelInput in = kernelInput;
+    in.bar = batch.bar;
+    in.specTable = specularLUT ? specTable : nullptr;
+    in.fastRsqrt = fastRsqrt;
+
+    float intensity[N];
+    kernels().phong_intensity(in, intensity);
+
+    for (int i = 0; i < N; i++) {
+        batch.color[i] = color * intensity[i];
+    }
+}
+
+PhongVaryingShader::PhongVaryingShader(double shininess) : shininess(shininess) {
+    fill_spec_table(specTable, PhongShader::SPEC_TABLE_SIZE, shininess);
+}
+
+Pipeline::VaryingVertex<PhongVaryingShader::VARYINGS> PhongVaryingShader::vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) const {
+    vec4 normalTransformed = normalMatrix * vec4{ n.x, n.y, n.z, 0.0 };
+    vec3 normalVec = normalize(vec3{ normalTransformed.x, normalTransformed.y, normalTransformed.z });
+
+    Pipeline::VaryingVertex<VARYINGS> output;
+    output.clipPos = perspective * modelview * vec4{ v.x, v.y, v.z, 1.0 };
+    for (int c = 0; c < 3; c++) {
+        output.varyings[c] = static_cast<float>(v[c]);
+        output.varyings[3 + c] = static_cast<float>(normalVec[c]);
+    }
+    return output;
+}
+
+void PhongVaryingShader::fragment(const Pipeline::VaryingBatch<VARYINGS>& in, Pipeline::FragmentBatch& batch) const {
+    constexpr int N = Pipeline::BATCH_SIZE;
+
+    PhongKernelInput lighting{};
+    for (int c = 0; c < 3; c++) {
+        lighting.eye[c] = static_cast<float>(eye[c]);
+        lighting.light[c] = static_cast<float>(lightPos[c]);
+    }
+    lighting.shininess = static_cast<float>(shininess);
+    lighting.specTable = specularLUT ? specTable : nullptr;
+    lighting.specTableSize = PhongShader::SPEC_TABLE_SIZE;
+    lighting.fastRsqrt = fastRsqrt;
+
+    float intensity[N];
+    kernels().phong_intensity_interpolated(lighting, &in.value[0], &in.value[3], intensity);
+
+    for (int i = 0; i < N; i++) {
+        batch.color[i] = color * intensity[i];
+    }
+}
+
+void ClusteredPhongShader::setup_triangle(const vec3 pos[3], const vec3 norm[3]) {
+    PhongShader::setup_triangle(pos, norm);
+    std::copy(&kernelInput.pos[0][0], &kernelInput.pos[0][0] + 9, &lightInput.pos[0][0]);
+    std::copy(&kernelInput.norm[0][0], &kernelInput.norm[0][0] + 9, &lightInput.norm[0][0]);
+    std::copy(kernelInput.eye, kernelInput.eye + 3, lightInput.eye);
+}
+
+std::pair<bool, Color> ClusteredPhongShader::fragment(const vec3& bar) const {
+    vec3 normal = bar[0] * tri_norm[0] + bar[1] * tri_norm[1] + bar[2] * tri_norm[2];
+    vec3 fragPos = bar[0] * tri_pos[0] + bar[1] * tri_pos[1] + bar[2] * tri_pos[2];
+    vec3 viewDir = normalize(eye - fragPos);
+
+    double intensity = 0.1;
+    for (const PointLight& light : clusters->lights()) {
+        vec3 toLight = light.position - fragPos;
+        double falloff = std::max(1 - dot(toLight, toLight) / (light.radius * light.radius), 0.0);
+        if (falloff == 0) continue;
+
+        vec3 lightDir = normalize(toLight);
+        vec3 reflectDir = reflect(-lightDir, normal);
+        double diff = std::max(dot(normal, lightDir), 0.0);
+        double spec = std::pow(std::max(dot(viewDir, reflectDir), 0.0), shininess);
+        intensity += light.intensity * falloff * falloff * (diff + spec);
+    }
+    return { false, color * static_cast<float>(intensity) };
+}
+
+void ClusteredPhongShader::fragment_batch(Pipeline::FragmentBatch& batch) const {
+    constexpr int N = Pipeline::BATCH_SIZE;
+
+    int cluster[N]; // from every lane's own pixel and depth
+    for (int i = 0; i < N; i++) {
+        if (!(batch.mask & (1u << i))) continue;
+        vec3 fragPos = batch.bar[0][i] * tri_pos[0] + batch.bar[1][i] * tri_pos[1] + batch.bar[2][i] * tri_pos[2];
+        cluster[i] = clusters->cluster_at(batch.x[i], batch.y[i], clusters->view_distance(fragPos));
+    }
+
+    const LightClusters::LightData& lights = clusters->light_data();
+    PointLightKernelInput in = lightInput;
+    in.bar = batch.bar;
+    in.shininess = static_cast<float>(shininess);
+    in.specTable = specularLUT ? specTable : nullptr;
+    in.specTableSize = SPEC_TABLE_SIZE;
+    in.lightX = lights.x.data();
+    in.lightY = lights.y.data();
+    in.lightZ = lights.z.data();
+    in.lightInvRadius2 = lights.invRadius2.data();
+    in.lightIntensity = lights.intensity.data();
+
+    // A batch collects covered pixels of one tile, over as many rows as it takes. Clusters
+    // use the same tiles, so the lanes differ at most in depth slice; each distinct cluster
+    // is lit for the whole batch and kept for its own lanes
+    uint32_t remaining = batch.mask;
+    while (remaining) {
+        int c = cluster[__builtin_ctz(remaining)];
+        uint32_t lanes = 0;
+        for (int i = 0; i < N; i++) {
+            if ((remaining & (1u << i)) && cluster[i] == c) lanes |= 1u << i;
+        }
+        remaining &= ~lanes;
+
+        in.lights = clusters->cluster_lights(c, in.lightCount);
+        float intensity[N];
+        kernels().point_lights_intensity(in, intensity);
+        for (int i = 0; i < N; i++) {
+            if (lanes & (1u << i)) batch.color[i] = color * (0.1f + intensity[i]);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "color.h"
+#include "geometry.h"
+#include "kernels.h"
+#include "light_clusters.h"
+#include "pipeline.h"
+
+// Phong lighting with a single point light. fragment() is the double-precision
+// reference; fragment_batch() lights a whole block in float through the
+// kernel picked for this CPU (kernels.h).
+struct PhongShader : Pipeline::IShader {
+    static constexpr int SPEC_TABLE_SIZE = 1024;
+
+    Color color;
+    vec3 eye;
+    vec3 lightPos;
+
+    // Opt-in precision trade-offs, only used by the batch path
+    bool specularLUT = false; // pow() replaced by a table lookup over [0, 1]
+    bool fastRsqrt = false;   // 1/sqrt from the bit-level estimate plus one Newton step
+
+    explicit PhongShader(double shininess = 32);
+
+    Pipeline::VertexOutput vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) override;
+    void setup_triangle(const vec3 pos[3], const vec3 norm[3]) override;
+    std::pair<bool, Color> fragment(const vec3& bar) const override;
+    void fragment_batch(Pipeline::FragmentBatch& batch) const override;
+
+protected:
+    double shininess;
+    float specTable[SPEC_TABLE_SIZE + 1];
+
+    vec3 tri_pos[3];
+    vec3 tri_norm[3];
+
+    // float copies of the triangle and light setup for the batch kernel
+    PhongKernelInput kernelInput{};
+};
+
+// PhongShader on the varying path: world position and normal travel as six varyings,
+// interpolated perspective-correctly, so fragments are lit where they really are rather
+// than where screen-space barycentrics put them. No per-triangle state.
+struct PhongVaryingShader {
+    static constexpr int VARYINGS = 6; // world position, normal
+
+    Color color;
+    vec3 eye;
+    vec3 lightPos;
+
+    bool specularLUT = false; // as in PhongShader
+    bool fastRsqrt = false;
+
+    explicit PhongVaryingShader(double shininess = 32);
+
+    Pipeline::VaryingVertex<VARYINGS> vertex(const vec3& v, const vec3& n, const mat<4, 4>& modelview, const mat<4, 4>& perspective, const mat<4, 4>& normalMatrix) const;
+    void fragment(const Pipeline::VaryingBatch<VARYINGS>& in, Pipeline::FragmentBatch& batch) const;
+
+private:
+    double shininess;
+    float specTable[PhongShader::SPEC_TABLE_SIZE + 1];
+};
+
+// Phong lighting from many point lights. fragment_batch() looks up each fragment's cluster
+// from its screen position and view depth and only evaluates that cluster's lights;
+// fragment() is the reference and sums every light, which gives the same image because
+// a light contributes exactly nothing outside its radius. lightPos is unused.
+struct ClusteredPhongShader : PhongShader {
+    const LightClusters* clusters = nullptr; // built for this frame's camera before drawing
+
+    using PhongShader::PhongShader;
+
+    void setup_triangle(const vec3 pos[3], const vec3 norm[3]) override;
+    std::pair<bool, Color> fragment(const vec3& bar) const override;
+    void fragment_batch(Pipeline::FragmentBatch& batch) const override;
+
+private:
+    PointLightKernelInput lightInput{};
+};
@@ -0,0 +1,68 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads consuming a FIFO of jobs.
+class ThreadPool {
+public:
+    explicit ThreadPool(unsigned int count = std::thread::hardware_concurrency()) {
+        if (count == 0) count = 1;
+        for (unsigned int i = 0; i < count; i++) {
+            workers.emplace_back([this] { worker_loop(); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (std::thread& t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    template<typename F>
+    auto submit(F&& job) -> std::future<decltype(job())> {
+        using R = decltype(job());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(job));
+        std::future<R> result = task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.emplace([task] { (*task)(); });
+        }
+        cv.notify_one();
+        return result;
+    }
+
+    size_t size() const { return workers.size(); }
+
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    void worker_loop() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping && jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop();
+            }
+            job();
+        }
+    }
+};
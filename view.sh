@@ -1,3 +1,3 @@
 #!/bin/bash
-magick framebuffer.ppm -scale 800% framebuffer.png
-open framebuffer.png
+# The renderer writes PNGs directly, this only opens them
+if command -v open >/dev/null; then open framebuffer.png; else xdg-open framebuffer.png; fi
@@ -1,2 +1 @@
-magick zbuffer.ppm -scale 800% zbuffer.png
-open zbuffer.png
\ No newline at end of file
+if command -v open >/dev/null; then open zbuffer.png; else xdg-open zbuffer.png; fi